@@ -0,0 +1,293 @@
+#include "ED_MQTT_alloc.h"
+#include <cstdio>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#if ED_MQTT_ALLOC_AUDIT
+#include <esp_heap_caps.h>
+#endif
+
+namespace ED_MQTT {
+
+#if ED_MQTT_ALLOC_AUDIT
+
+// Taken inside the allocator wrappers, from tasks and ISRs alike: a spinlock
+// and fixed tables only, nothing here may allocate or log.
+static portMUX_TYPE s_alloc_mux = portMUX_INITIALIZER_UNLOCKED;
+static AllocAudit::Totals s_totals = {};
+static AllocAudit::Site s_sites[ALLOC_SITES] = {};
+static volatile bool s_booted = false;
+
+// Innermost scope of the running task.
+static thread_local AllocScope *t_scope = nullptr;
+
+// Thread-local storage belongs to tasks: before the scheduler starts
+// (startup, global constructors) there is none yet, and an ISR would read
+// the interrupted task's. Outside a task nothing is tagged.
+static inline bool task_context() {
+  return xTaskGetSchedulerState() != taskSCHEDULER_NOT_STARTED && !xPortInIsrContext();
+}
+
+// ── Scopes ───────────────────────────────────────────────────────────
+AllocScope::AllocScope(const char *tag, Kind kind)
+    : m_tag(tag), m_hot(kind == HOT), m_prev(nullptr), m_linked(task_context()) {
+  if (!m_linked)
+    return;
+  m_hot = m_hot || (kind == TAG && t_scope && t_scope->m_hot);
+  m_prev = t_scope;
+  t_scope = this;
+}
+
+AllocScope::~AllocScope() {
+  if (m_linked)
+    t_scope = m_prev;
+}
+
+// ── Recording ────────────────────────────────────────────────────────
+void AllocAudit::recordAlloc(void *ptr, size_t requested, uintptr_t pc) {
+  if (!ptr)
+    return;
+  const AllocScope *scope = task_context() ? t_scope : nullptr;
+  const char *tag = scope ? scope->m_tag : nullptr;
+  const bool hot = scope && scope->m_hot;
+  const size_t size = heap_caps_get_allocated_size(ptr);
+  bool violation = false;
+
+  portENTER_CRITICAL_SAFE(&s_alloc_mux);
+  ++s_totals.allocs;
+  s_totals.liveBytes += (uint32_t)(size ? size : requested);
+  const bool after = s_booted;
+  if (after) {
+    ++s_totals.afterBoot;
+    if (hot) {
+      ++s_totals.hot;
+      violation = true;
+    }
+  }
+  Site *slot = nullptr;
+  for (uint8_t i = 0; i < ALLOC_SITES; ++i) {
+    Site &s = s_sites[i];
+    if (s.count == 0) {   // first free slot: sites are never removed
+      s.tag = tag;
+      s.pc = pc;
+      slot = &s;
+      break;
+    }
+    if (s.pc == pc && s.tag == tag) {
+      slot = &s;
+      break;
+    }
+  }
+  if (slot) {
+    ++slot->count;
+    slot->bytes += (uint32_t)requested;
+    slot->afterBoot += after ? 1 : 0;
+    slot->hot += violation ? 1 : 0;
+  } else {
+    ++s_totals.untracked;
+  }
+  portEXIT_CRITICAL_SAFE(&s_alloc_mux);
+
+#if ED_MQTT_ALLOC_AUDIT_ASSERT
+  configASSERT(!violation);   // hot path allocated after boot: see the site table
+#else
+  (void)violation;
+#endif
+}
+
+void AllocAudit::recordFree(size_t size) {
+  portENTER_CRITICAL_SAFE(&s_alloc_mux);
+  ++s_totals.frees;
+  s_totals.liveBytes -= size < s_totals.liveBytes ? (uint32_t)size : s_totals.liveBytes;
+  portEXIT_CRITICAL_SAFE(&s_alloc_mux);
+}
+
+// ── Queries ──────────────────────────────────────────────────────────
+void AllocAudit::bootComplete() { s_booted = true; }
+
+bool AllocAudit::booted() { return s_booted; }
+
+AllocAudit::Totals AllocAudit::totals() {
+  portENTER_CRITICAL_SAFE(&s_alloc_mux);
+  const Totals t = s_totals;
+  portEXIT_CRITICAL_SAFE(&s_alloc_mux);
+  return t;
+}
+
+bool AllocAudit::site(uint8_t i, Site &out) {
+  if (i >= ALLOC_SITES)
+    return false;
+  portENTER_CRITICAL_SAFE(&s_alloc_mux);
+  out = s_sites[i];
+  portEXIT_CRITICAL_SAFE(&s_alloc_mux);
+  return out.count > 0;
+}
+
+#else  // !ED_MQTT_ALLOC_AUDIT
+
+void AllocAudit::bootComplete() {}
+bool AllocAudit::booted() { return false; }
+AllocAudit::Totals AllocAudit::totals() { return {}; }
+bool AllocAudit::site(uint8_t, Site &) { return false; }
+
+#endif
+
+// ── Reporting ────────────────────────────────────────────────────────
+size_t AllocAudit::writeReport(FieldWriter &w) {
+  const Totals t = totals();
+  w.beginObject();
+  w.addInt("audit", enabled() ? 1 : 0);
+  w.addInt("booted", booted() ? 1 : 0);
+  w.addInt("allocs", t.allocs);
+  w.addInt("frees", t.frees);
+  w.addInt("live", t.liveBytes);
+  w.addInt("afterBoot", t.afterBoot);
+  w.addInt("hot", t.hot);
+  w.addInt("untracked", t.untracked);
+  w.beginArray("sites");
+  Site s;
+  for (uint8_t i = 0; i < ALLOC_SITES && site(i, s); ++i) {
+    char pc[12];
+    snprintf(pc, sizeof pc, "0x%08lx", (unsigned long)s.pc);
+    w.beginObject();
+    w.addString("tag", s.tag ? s.tag : "-");
+    w.addString("pc", pc);
+    w.addInt("n", s.count);
+    w.addInt("bytes", s.bytes);
+    w.addInt("afterBoot", s.afterBoot);
+    w.addInt("hot", s.hot);
+    w.endObject();
+  }
+  w.endArray();
+  w.endObject();
+  return w.overflow() ? 0 : w.length();
+}
+
+void AllocAudit::writeFields(FieldWriter &w) {
+  const Totals t = totals();
+  w.addInt("d_HEAPA", t.afterBoot);
+  w.addInt("d_HEAPH", t.hot);
+}
+
+} // namespace ED_MQTT
+
+// ── Allocator wrappers (-Wl,--wrap=…) ────────────────────────────────
+#if ED_MQTT_ALLOC_AUDIT
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+void *__real_heap_caps_malloc(size_t size, uint32_t caps);
+void *__real_heap_caps_calloc(size_t n, size_t size, uint32_t caps);
+void *__real_heap_caps_realloc(void *ptr, size_t size, uint32_t caps);
+void __real_heap_caps_free(void *ptr);
+
+#define ED_ALLOC_CALLER() ((uintptr_t)__builtin_return_address(0))
+
+// Set while a libc wrapper runs: newlib's malloc/free call heap_caps_*,
+// and that inner call must not be counted a second time. Per task; before
+// the scheduler starts there is one thread, and each core has one for its
+// ISRs (see task_context()).
+static thread_local bool t_in_libc = false;
+static bool s_early_in_libc = false;
+static bool s_isr_in_libc[portNUM_PROCESSORS] = {};
+
+static inline bool &in_libc() {
+  if (xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED)
+    return s_early_in_libc;
+  if (xPortInIsrContext())
+    return s_isr_in_libc[xPortGetCoreID()];
+  return t_in_libc;
+}
+
+struct LibcCall {
+  bool &flag;
+  bool outer;
+  LibcCall() : flag(in_libc()), outer(flag) { flag = true; }
+  ~LibcCall() { flag = outer; }
+};
+
+static inline void audit_free(void *ptr) {
+  if (ptr)
+    ED_MQTT::AllocAudit::recordFree(heap_caps_get_allocated_size(ptr));
+}
+
+// A resize counts as a free of the old block and a new allocation; the old
+// block is only released when the call succeeds.
+static inline void audit_resize(void *ptr, size_t oldSize, void *p, size_t size,
+                                uintptr_t pc) {
+  if (ptr && (p || size == 0))
+    ED_MQTT::AllocAudit::recordFree(oldSize);
+  ED_MQTT::AllocAudit::recordAlloc(p, size, pc);
+}
+
+void *__wrap_malloc(size_t size) {
+  void *p;
+  {
+    LibcCall libc;
+    p = __real_malloc(size);
+  }
+  ED_MQTT::AllocAudit::recordAlloc(p, size, ED_ALLOC_CALLER());
+  return p;
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  void *p;
+  {
+    LibcCall libc;
+    p = __real_calloc(n, size);
+  }
+  ED_MQTT::AllocAudit::recordAlloc(p, n * size, ED_ALLOC_CALLER());
+  return p;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  const size_t old = ptr ? heap_caps_get_allocated_size(ptr) : 0;
+  void *p;
+  {
+    LibcCall libc;
+    p = __real_realloc(ptr, size);
+  }
+  audit_resize(ptr, old, p, size, ED_ALLOC_CALLER());
+  return p;
+}
+
+void __wrap_free(void *ptr) {
+  audit_free(ptr);
+  LibcCall libc;
+  __real_free(ptr);
+}
+
+void *__wrap_heap_caps_malloc(size_t size, uint32_t caps) {
+  void *p = __real_heap_caps_malloc(size, caps);
+  if (!in_libc())
+    ED_MQTT::AllocAudit::recordAlloc(p, size, ED_ALLOC_CALLER());
+  return p;
+}
+
+void *__wrap_heap_caps_calloc(size_t n, size_t size, uint32_t caps) {
+  void *p = __real_heap_caps_calloc(n, size, caps);
+  if (!in_libc())
+    ED_MQTT::AllocAudit::recordAlloc(p, n * size, ED_ALLOC_CALLER());
+  return p;
+}
+
+void *__wrap_heap_caps_realloc(void *ptr, size_t size, uint32_t caps) {
+  if (in_libc())
+    return __real_heap_caps_realloc(ptr, size, caps);
+  const size_t old = ptr ? heap_caps_get_allocated_size(ptr) : 0;
+  void *p = __real_heap_caps_realloc(ptr, size, caps);
+  audit_resize(ptr, old, p, size, ED_ALLOC_CALLER());
+  return p;
+}
+
+void __wrap_heap_caps_free(void *ptr) {
+  if (!in_libc())
+    audit_free(ptr);
+  __real_heap_caps_free(ptr);
+}
+
+#undef ED_ALLOC_CALLER
+} // extern "C"
+#endif
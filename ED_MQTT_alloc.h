@@ -0,0 +1,101 @@
+#pragma once
+
+#include "ED_MQTT_config.h"
+#include "ED_MQTT_encode.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_MQTT {
+
+/**
+ * Heap allocation audit (build option ED_MQTT_ALLOC_AUDIT).
+ *
+ * Configure with -DED_MQTT_ALLOC_AUDIT=ON: the link then wraps malloc, calloc,
+ * realloc, free and heap_caps_malloc/calloc/realloc/free, and every
+ * allocation in the firmware is counted once against a site: the innermost
+ * AllocScope tag of the allocating task plus the caller's address
+ * (decode with addr2line). The libc entry points call into heap_caps_*;
+ * those inner calls are not recorded again.
+ *
+ *   AllocScope scope("mqtt.data", AllocScope::HOT);
+ *
+ * marks a hot path. Once bootComplete() has been called (the dispatcher does
+ * it when the boot timeline is out), an allocation inside a hot scope is a
+ * violation: counted, and with ED_MQTT_ALLOC_AUDIT_ASSERT a configASSERT
+ * failure. TAG scopes only name the subsystem and keep the hotness of the
+ * enclosing scope; EXEMPT scopes cover known allocations (the esp-mqtt
+ * outbox of a QoS1/2 publish) and are never violations. ":ALLOC" publishes
+ * the report, diag carries the totals (d_HEAPA / d_HEAPH).
+ *
+ * Without the option AllocScope is empty, the wrappers are not built and the
+ * queries return zeros. Not combinable with another --wrap=heap_caps_* user
+ * (the diag component's heap tracer): both define the wrappers.
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint8_t ALLOC_SITES = ED_MQTT_ALLOC_SITES;
+static_assert(ED_MQTT_ALLOC_SITES >= 1 && ED_MQTT_ALLOC_SITES <= 255,
+              "ED_MQTT_ALLOC_SITES must be 1..255");
+
+class AllocScope {
+public:
+  enum Kind : uint8_t { TAG, HOT, EXEMPT };
+#if ED_MQTT_ALLOC_AUDIT
+  explicit AllocScope(const char *tag, Kind kind = TAG);
+  ~AllocScope();
+  AllocScope(const AllocScope &) = delete;
+  AllocScope &operator=(const AllocScope &) = delete;
+
+private:
+  friend class AllocAudit;
+  const char *m_tag;
+  bool m_hot;   // this scope or an enclosing one is hot
+  AllocScope *m_prev;
+  bool m_linked;   // false: made outside a task, t_scope left alone
+#else
+  explicit AllocScope(const char *, Kind = TAG) {}
+#endif
+};
+
+class AllocAudit {
+public:
+  struct Totals {
+    uint32_t allocs;      // since boot
+    uint32_t frees;
+    uint32_t liveBytes;   // allocated and not freed
+    uint32_t afterBoot;   // allocations after bootComplete()
+    uint32_t hot;         // of those, inside a hot scope
+    uint32_t untracked;   // sites that did not fit the table
+  };
+  struct Site {
+    const char *tag;   // innermost scope, nullptr: none
+    uintptr_t pc;      // caller of the allocator
+    uint32_t count;
+    uint32_t bytes;
+    uint32_t afterBoot;
+    uint32_t hot;
+  };
+
+  static constexpr bool enabled() { return ED_MQTT_ALLOC_AUDIT != 0; }
+
+  /// From here on, hot-scope allocations are violations. Idempotent.
+  static void bootComplete();
+  static bool booted();
+
+  static Totals totals();
+  /// Copy of site i (< ALLOC_SITES); false when the slot is empty.
+  static bool site(uint8_t i, Site &out);
+
+  /// {"audit":1,"booted":1,"allocs":…,"sites":[{"tag":…,"pc":"0x…",…}]}
+  static size_t writeReport(FieldWriter &w);
+  /// Diag fields: d_HEAPA after-boot allocations, d_HEAPH hot-path ones.
+  static void writeFields(FieldWriter &w);
+
+#if ED_MQTT_ALLOC_AUDIT
+  /// Wrapper entry points, not for application use.
+  static void recordAlloc(void *ptr, size_t requested, uintptr_t pc);
+  static void recordFree(size_t size);
+#endif
+};
+
+} // namespace ED_MQTT
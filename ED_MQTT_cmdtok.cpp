@@ -0,0 +1,279 @@
+#include "ED_MQTT_cmdtok.h"
+#include <cstring>
+
+namespace ED_MQTT_dispatcher {
+
+static constexpr uint8_t MAX_JSON_DEPTH = 16;
+
+JsonCmdTokenizer::JsonCmdTokenizer(const char *json, size_t len)
+    : m_cur{json, json ? json + len : json} {}
+
+void JsonCmdTokenizer::skipWs(Cursor &c) {
+    while (c.p < c.end &&
+           (*c.p == ' ' || *c.p == '\t' || *c.p == '\r' || *c.p == '\n'))
+        ++c.p;
+}
+
+// Cursor must sit on the opening quote; leaves it after the closing quote.
+bool JsonCmdTokenizer::scanString(Cursor &c, const char **s, size_t *n) {
+    if (c.p >= c.end || *c.p != '"') return false;
+    const char *start = ++c.p;
+    while (c.p < c.end) {
+        if (*c.p == '\\') {
+            c.p += 2;
+            continue;
+        }
+        if (*c.p == '"') {
+            if (s) *s = start;
+            if (n) *n = (size_t)(c.p - start);
+            ++c.p;
+            return true;
+        }
+        ++c.p;
+    }
+    return false;
+}
+
+bool JsonCmdTokenizer::skipValue(Cursor &c, Kind *kind) {
+    skipWs(c);
+    if (c.p >= c.end) return false;
+
+    if (*c.p == '"') {
+        if (kind) *kind = Kind::STRING;
+        return scanString(c, nullptr, nullptr);
+    }
+
+    if (*c.p == '{' || *c.p == '[') {
+        if (kind) *kind = (*c.p == '{') ? Kind::OBJECT : Kind::ARRAY;
+        uint8_t depth = 0;
+        while (c.p < c.end) {
+            char ch = *c.p;
+            if (ch == '"') {
+                if (!scanString(c, nullptr, nullptr)) return false;
+                continue;
+            }
+            if (ch == '{' || ch == '[') {
+                if (++depth > MAX_JSON_DEPTH) return false;
+            } else if (ch == '}' || ch == ']') {
+                if (depth == 0) return false;
+                if (--depth == 0) {
+                    ++c.p;
+                    return true;
+                }
+            }
+            ++c.p;
+        }
+        return false;
+    }
+
+    // number, true, false, null
+    if (kind) *kind = Kind::SCALAR;
+    const char *start = c.p;
+    while (c.p < c.end && *c.p != ',' && *c.p != '}' && *c.p != ']' &&
+           *c.p != ' ' && *c.p != '\t' && *c.p != '\r' && *c.p != '\n')
+        ++c.p;
+    return c.p > start;
+}
+
+// Cursor on '{'. Extracts "cmd" and "data", skips everything else.
+bool JsonCmdTokenizer::parseObject(Entry &out) {
+    Cursor &c = m_cur;
+    auto fail = [this]() { m_failed = true; return false; };
+    out = {};
+    ++c.p; // '{'
+    for (;;) {
+        skipWs(c);
+        if (c.p >= c.end) return fail();
+        if (*c.p == '}') {
+            ++c.p;
+            return out.cmd != nullptr;
+        }
+
+        const char *key;
+        size_t keyLen;
+        if (!scanString(c, &key, &keyLen)) return fail();
+        skipWs(c);
+        if (c.p >= c.end || *c.p != ':') return fail();
+        ++c.p;
+        skipWs(c);
+
+        const char *vstart = c.p;
+        Kind kind = Kind::NONE;
+        if (!skipValue(c, &kind)) return fail();
+
+        if (keyLen == 3 && memcmp(key, "cmd", 3) == 0 && kind == Kind::STRING) {
+            out.cmd = vstart + 1;
+            out.cmdLen = (size_t)(c.p - vstart) - 2;
+        } else if (keyLen == 4 && memcmp(key, "data", 4) == 0) {
+            out.dataKind = kind;
+            if (kind == Kind::STRING) {
+                out.data = vstart + 1;
+                out.dataLen = (size_t)(c.p - vstart) - 2;
+            } else {
+                out.data = vstart;
+                out.dataLen = (size_t)(c.p - vstart);
+            }
+        }
+
+        skipWs(c);
+        if (c.p < c.end && *c.p == ',') ++c.p;
+    }
+}
+
+bool JsonCmdTokenizer::next(Entry &out) {
+    if (m_done || m_failed) return false;
+    Cursor &c = m_cur;
+
+    if (!m_started) {
+        m_started = true;
+        skipWs(c);
+        if (c.p >= c.end) {
+            m_done = true;
+            return false;
+        }
+        if (*c.p == '{') {
+            m_done = true; // single object
+            return parseObject(out);
+        }
+        if (*c.p != '[') {
+            m_failed = true;
+            return false;
+        }
+        m_batch = true;
+        ++c.p;
+    }
+
+    for (;;) {
+        skipWs(c);
+        if (c.p >= c.end) {
+            m_failed = true;
+            return false;
+        }
+        if (*c.p == ']') {
+            m_done = true;
+            return false;
+        }
+        if (*c.p == ',') {
+            ++c.p;
+            continue;
+        }
+        if (*c.p == '{') {
+            if (parseObject(out)) return true;
+            if (m_failed) return false;
+            continue; // object without "cmd": skip it
+        }
+        // Non-object array element: skip it.
+        if (!skipValue(c, nullptr)) {
+            m_failed = true;
+            return false;
+        }
+    }
+}
+
+size_t JsonCmdTokenizer::unescape(const char *s, size_t n, char *out, size_t outLen) {
+    if (outLen == 0) return 0;
+    size_t w = 0;
+    for (size_t i = 0; i < n && w + 1 < outLen; ++i) {
+        char ch = s[i];
+        if (ch == '\\' && i + 1 < n) {
+            char e = s[++i];
+            switch (e) {
+            case 'n': ch = '\n'; break;
+            case 't': ch = '\t'; break;
+            case 'r': ch = '\r'; break;
+            case 'b': ch = '\b'; break;
+            case 'f': ch = '\f'; break;
+            case 'u': {
+                unsigned v = 0;
+                size_t k = 0;
+                for (; k < 4 && i + 1 < n; ++k) {
+                    char h = s[++i];
+                    v <<= 4;
+                    if (h >= '0' && h <= '9') v |= (unsigned)(h - '0');
+                    else if (h >= 'a' && h <= 'f') v |= (unsigned)(h - 'a' + 10);
+                    else if (h >= 'A' && h <= 'F') v |= (unsigned)(h - 'A' + 10);
+                }
+                ch = (v < 0x80) ? (char)v : '?';
+                break;
+            }
+            default: ch = e; break; // \" \\ \/
+            }
+        }
+        out[w++] = ch;
+    }
+    out[w] = '\0';
+    return w;
+}
+
+size_t JsonCmdTokenizer::objectToFlags(const char *obj, size_t n, char *out,
+                                       size_t outLen) {
+    if (outLen == 0) return 0;
+    out[0] = '\0';
+    Cursor c{obj, obj + n};
+    skipWs(c);
+    if (c.p >= c.end || *c.p != '{') return 0;
+    ++c.p;
+
+    size_t w = 0;
+    for (;;) {
+        skipWs(c);
+        if (c.p >= c.end || *c.p == '}') break;
+
+        const char *key;
+        size_t keyLen;
+        if (!scanString(c, &key, &keyLen)) break;
+        skipWs(c);
+        if (c.p >= c.end || *c.p != ':') break;
+        ++c.p;
+        skipWs(c);
+
+        const char *vstart = c.p;
+        Kind kind = Kind::NONE;
+        if (!skipValue(c, &kind)) break;
+
+        if (w + keyLen + 3 >= outLen) break;
+        if (w) out[w++] = ' ';
+        out[w++] = '-';
+        w += unescape(key, keyLen, out + w, outLen - w);
+        if (w + 2 >= outLen) {
+            out[w] = '\0';
+            break;
+        }
+        out[w++] = ' ';
+        if (kind == Kind::STRING)
+            w += unescape(vstart + 1, (size_t)(c.p - vstart) - 2, out + w, outLen - w);
+        else {
+            size_t vlen = (size_t)(c.p - vstart);
+            if (w + vlen >= outLen) vlen = outLen - w - 1;
+            memcpy(out + w, vstart, vlen);
+            w += vlen;
+        }
+        out[w] = '\0';
+
+        skipWs(c);
+        if (c.p < c.end && *c.p == ',') ++c.p;
+    }
+    return w;
+}
+
+size_t JsonCmdTokenizer::renderData(const Entry &e, char *out, size_t outLen) {
+    if (outLen == 0) return 0;
+    switch (e.dataKind) {
+    case Kind::STRING:
+        return unescape(e.data, e.dataLen, out, outLen);
+    case Kind::OBJECT:
+        return objectToFlags(e.data, e.dataLen, out, outLen);
+    case Kind::ARRAY:
+    case Kind::SCALAR: {
+        size_t n = e.dataLen < outLen - 1 ? e.dataLen : outLen - 1;
+        memcpy(out, e.data, n);
+        out[n] = '\0';
+        return n;
+    }
+    default:
+        out[0] = '\0';
+        return 0;
+    }
+}
+
+} // namespace ED_MQTT_dispatcher
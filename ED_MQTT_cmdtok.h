@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_MQTT_dispatcher {
+
+/**
+ * Single-pass, allocation-free tokenizer for JSON command payloads.
+ *
+ * Accepted shapes:
+ *   {"cmd":"X","data":...}
+ *   [{"cmd":"X","data":...}, {"cmd":"Y"}, ...]
+ *
+ * next() yields spans pointing into the input buffer — nothing is copied.
+ * Strings may contain escapes, unknown keys and nested values are skipped
+ * with proper depth tracking. The input does not need a NUL terminator.
+ */
+class JsonCmdTokenizer {
+public:
+    enum class Kind : uint8_t { NONE, STRING, OBJECT, ARRAY, SCALAR };
+
+    struct Entry {
+        const char* cmd;      // raw string span (escapes not resolved)
+        size_t      cmdLen;
+        const char* data;     // STRING: inside the quotes; otherwise whole value
+        size_t      dataLen;
+        Kind        dataKind;
+    };
+
+    JsonCmdTokenizer(const char* json, size_t len);
+
+    /// Advance to the next command object. False at end of input or on error.
+    bool next(Entry& out);
+
+    bool isBatch() const { return m_batch; }
+    bool failed() const { return m_failed; }
+
+    /// Resolve JSON escapes of a raw string span into out (always terminated).
+    /// Returns the number of chars written; \uXXXX above 0x7F becomes '?'.
+    static size_t unescape(const char* s, size_t n, char* out, size_t outLen);
+
+    /// Convert a flat data object {"a":1,"b":"x"} into colon flags
+    /// "-a 1 -b x" so it feeds the same grabCommand() flag parser.
+    static size_t objectToFlags(const char* obj, size_t n, char* out, size_t outLen);
+
+    /// Render an Entry's data value in the text form grabCommand() expects.
+    static size_t renderData(const Entry& e, char* out, size_t outLen);
+
+private:
+    struct Cursor {
+        const char* p;
+        const char* end;
+    };
+
+    static void skipWs(Cursor& c);
+    static bool scanString(Cursor& c, const char** s, size_t* n);
+    static bool skipValue(Cursor& c, Kind* kind);
+    bool parseObject(Entry& out);
+
+    Cursor m_cur;
+    bool   m_batch = false;
+    bool   m_started = false;
+    bool   m_done = false;
+    bool   m_failed = false;
+};
+
+} // namespace ED_MQTT_dispatcher
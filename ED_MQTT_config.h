@@ -0,0 +1,196 @@
+#pragma once
+
+/**
+ * Build-time sizing of the component's static tables.
+ *
+ * Every value below can be overridden per project without touching the
+ * component, e.g. in the application's CMakeLists.txt:
+ *
+ *   idf_build_set_property(COMPILE_OPTIONS "-DED_MQTT_MAX_COMMANDS=8" APPEND)
+ *
+ * Small sensor nodes shrink the tables, gateway nodes grow them. The capacity
+ * of an individual command registry is a template argument instead
+ * (CommandRegistryN<N> / CommandWithRegistryN<N>); ED_MQTT_MAX_COMMANDS is
+ * only the default used by the plain CommandRegistry alias.
+ *
+ * The ":MEM" command (MQTTdispatcher::memoryReport()) prints the static RAM
+ * each table actually costs on the running build.
+ */
+
+// ── ED_MQTT::MqttClient ──────────────────────────────────────────────────────
+#ifndef ED_MQTT_MAX_CONNECTED_CALLBACKS
+#define ED_MQTT_MAX_CONNECTED_CALLBACKS 4
+#endif
+#ifndef ED_MQTT_MAX_DATA_CALLBACKS
+#define ED_MQTT_MAX_DATA_CALLBACKS 4
+#endif
+#ifndef ED_MQTT_MAX_PUBLISHED_CALLBACKS
+#define ED_MQTT_MAX_PUBLISHED_CALLBACKS 2
+#endif
+#ifndef ED_MQTT_MAX_PAYLOAD
+#define ED_MQTT_MAX_PAYLOAD 4096
+#endif
+#ifndef ED_MQTT_COMPRESS_MIN
+#define ED_MQTT_COMPRESS_MIN 256      // smallest payload worth compressing
+#endif
+#ifndef ED_MQTT_COMPRESS_BUF_LEN
+#define ED_MQTT_COMPRESS_BUF_LEN 2048 // largest payload that gets compressed
+#endif
+#ifndef ED_MQTT_MAX_COMPRESS_TOPICS
+#define ED_MQTT_MAX_COMPRESS_TOPICS 4 // filters set with setTopicCompression()
+#endif
+#ifndef ED_MQTT_INFLATE_BUF_LEN
+#define ED_MQTT_INFLATE_BUF_LEN ED_MQTT_MAX_PAYLOAD // 0 drops compressed input
+#endif
+#ifndef ED_MQTT_MAX_CORRELATION_LEN
+#define ED_MQTT_MAX_CORRELATION_LEN 64    // MQTT5 correlation data kept for replies
+#endif
+#ifndef ED_MQTT_MAX_USER_PROPS
+#define ED_MQTT_MAX_USER_PROPS 8          // MQTT5 user properties read per message
+#endif
+#ifndef ED_MQTT_MAX_SENSOR_TOPICS
+#define ED_MQTT_MAX_SENSOR_TOPICS 4       // SensorBridge batches
+#endif
+#ifndef ED_MQTT_SENSOR_BATCH_SAMPLES
+#define ED_MQTT_SENSOR_BATCH_SAMPLES 32   // samples held per batch
+#endif
+#ifndef ED_MQTT_SENSOR_BATCH_BUF_LEN
+#define ED_MQTT_SENSOR_BATCH_BUF_LEN 1024 // largest batch message
+#endif
+#ifndef ED_MQTT_MAX_RETAINED_TOPICS
+#define ED_MQTT_MAX_RETAINED_TOPICS 8     // retained payload hashes kept
+#endif
+#ifndef ED_MQTT_MAX_SUBSCRIPTIONS
+#define ED_MQTT_MAX_SUBSCRIPTIONS 12      // topic filters kept subscribed
+#endif
+#ifndef ED_MQTT_MAX_DATA_ROUTES
+#define ED_MQTT_MAX_DATA_ROUTES 8         // data callbacks with a topic filter
+#endif
+#ifndef ED_MQTT_ROUTE_NODES
+#define ED_MQTT_ROUTE_NODES 32            // routing trie: one node per filter level
+#endif
+#ifndef ED_MQTT_ROUTE_TEXT_LEN
+#define ED_MQTT_ROUTE_TEXT_LEN 256        // routing trie: level names
+#endif
+#ifndef ED_MQTT_SUPERVISOR_STACK
+#define ED_MQTT_SUPERVISOR_STACK 8192     // bytes: teardown, reconnect, diag publishing
+#endif
+#ifndef ED_MQTT_SUPERVISOR_QUEUE_LEN
+#define ED_MQTT_SUPERVISOR_QUEUE_LEN 8    // jobs waiting for the supervisor task
+#endif
+#ifndef ED_MQTT_SUPERVISOR_LIFECYCLE_LEN
+#define ED_MQTT_SUPERVISOR_LIFECYCLE_LEN 4 // teardown/reconnect/health jobs, run first
+#endif
+#ifndef ED_MQTT_ALLOC_AUDIT
+#define ED_MQTT_ALLOC_AUDIT 0             // set by the CMake option of the same name
+#endif
+#ifndef ED_MQTT_ALLOC_AUDIT_ASSERT
+#define ED_MQTT_ALLOC_AUDIT_ASSERT 0      // hot-path allocation after boot asserts
+#endif
+#ifndef ED_MQTT_ALLOC_SITES
+#define ED_MQTT_ALLOC_SITES 32            // audit: call sites tracked
+#endif
+#ifndef ED_MQTT_MAX_HOOKS
+#define ED_MQTT_MAX_HOOKS 32              // profiled hooks: callbacks, providers, commands
+#endif
+#ifndef ED_MQTT_HOOK_BUDGET_US
+#define ED_MQTT_HOOK_BUDGET_US 10000      // default per-call hook budget
+#endif
+#ifndef ED_MQTT_LOG_STREAM
+#define ED_MQTT_LOG_STREAM 0              // 1: forward log lines to the "log" topic
+#endif
+#ifndef ED_MQTT_LOG_STREAM_LEVEL
+#define ED_MQTT_LOG_STREAM_LEVEL 2        // esp_log_level_t forwarded at boot: 2 = WARN
+#endif
+#ifndef ED_MQTT_LOG_SLOTS
+#define ED_MQTT_LOG_SLOTS 32              // log lines waiting for the drain (power of two)
+#endif
+#ifndef ED_MQTT_LOG_LINE_LEN
+#define ED_MQTT_LOG_LINE_LEN 128          // longer log lines are truncated
+#endif
+#ifndef ED_MQTT_LOG_BATCH_LEN
+#define ED_MQTT_LOG_BATCH_LEN 1024        // bytes per "log" message
+#endif
+#ifndef ED_MQTT_LOG_FLUSH_MS
+#define ED_MQTT_LOG_FLUSH_MS 1000         // drain period
+#endif
+#ifndef ED_MQTT_LOG_RATE_BPS
+#define ED_MQTT_LOG_RATE_BPS 1024         // log stream budget, bytes/s
+#endif
+
+// ── ED_MQTT_dispatcher ───────────────────────────────────────────────────────
+#ifndef ED_MQTT_MAX_COMMANDS
+#define ED_MQTT_MAX_COMMANDS 16
+#endif
+#ifndef ED_MQTT_MAX_OPT_PARAMS
+#define ED_MQTT_MAX_OPT_PARAMS 8
+#endif
+#ifndef ED_MQTT_MAX_CMD_SUBSCRIBERS
+#define ED_MQTT_MAX_CMD_SUBSCRIBERS 4
+#endif
+#ifndef ED_MQTT_MAX_CMD_GROUPS
+#define ED_MQTT_MAX_CMD_GROUPS 4          // cmd/group/<name> topics joined
+#endif
+#ifndef ED_MQTT_CMD_BROADCAST
+#define ED_MQTT_CMD_BROADCAST 1           // 0: no fleet-wide "cmd" subscription
+#endif
+#ifndef ED_MQTT_WORK_QUEUE_LEN
+#define ED_MQTT_WORK_QUEUE_LEN 8          // shared-subscription work items queued
+#endif
+#ifndef ED_MQTT_WORK_ITEM_LEN
+#define ED_MQTT_WORK_ITEM_LEN 512         // largest work item payload
+#endif
+#ifndef ED_MQTT_WORK_STACK
+#define ED_MQTT_WORK_STACK 4096           // bytes: worker task, runs the work handler
+#endif
+#ifndef ED_MQTT_WORK_PRIORITY
+#define ED_MQTT_WORK_PRIORITY 4
+#endif
+#ifndef ED_MQTT_MAX_REGISTRIES
+#define ED_MQTT_MAX_REGISTRIES 8
+#endif
+#ifndef ED_MQTT_MAX_JSON_PROVIDERS
+#define ED_MQTT_MAX_JSON_PROVIDERS 8
+#endif
+#ifndef ED_MQTT_DIAG_FRAGMENT_LEN
+#define ED_MQTT_DIAG_FRAGMENT_LEN 192
+#endif
+#ifndef ED_MQTT_MAX_METRICS
+#define ED_MQTT_MAX_METRICS 8
+#endif
+#ifndef ED_MQTT_METRIC_ISR_SLOTS
+#define ED_MQTT_METRIC_ISR_SLOTS 32       // ISR samples waiting for the diag tick (power of two)
+#endif
+#ifndef ED_MQTT_HISTORY_LEN
+#define ED_MQTT_HISTORY_LEN 8192          // diag history ring, bytes
+#endif
+#ifndef ED_MQTT_HISTORY_RECORD_MAX
+#define ED_MQTT_HISTORY_RECORD_MAX 1024   // one stored snapshot, after compression
+#endif
+#ifndef ED_MQTT_HISTORY_CHUNK_LEN
+#define ED_MQTT_HISTORY_CHUNK_LEN 1536    // one ":HIST" reply message
+#endif
+#ifndef ED_MQTT_HISTORY_INTERVAL_MS
+#define ED_MQTT_HISTORY_INTERVAL_MS 10000 // snapshot period, 0: off until ":HISTRATE"
+#endif
+#ifndef ED_MQTT_MAX_BATCH_CMDS
+#define ED_MQTT_MAX_BATCH_CMDS 64
+#endif
+#ifndef ED_MQTT_MAX_PENDING_REQUESTS
+#define ED_MQTT_MAX_PENDING_REQUESTS 8
+#endif
+#ifndef ED_MQTT_DEDUP_ENTRIES
+#define ED_MQTT_DEDUP_ENTRIES 16
+#endif
+#ifndef ED_MQTT_MAX_CMD_FLOWS
+#define ED_MQTT_MAX_CMD_FLOWS 4
+#endif
+#ifndef ED_MQTT_FLOW_FRAME_SIZE
+#define ED_MQTT_FLOW_FRAME_SIZE 1024      // bytes per coroutine frame slot
+#endif
+#ifndef ED_MQTT_FLOW_STACK
+#define ED_MQTT_FLOW_STACK 4096           // bytes: flow scheduler task, resumes every flow
+#endif
+#ifndef ED_MQTT_FLOW_PRIORITY
+#define ED_MQTT_FLOW_PRIORITY 5
+#endif
@@ -0,0 +1,434 @@
+#include "ED_MQTT_coro.h"
+#include "ED_MQTT_dedup.h"
+#include "ED_MQTT_router.h"
+#include "ED_MQTT_supervisor.h"
+#include "esp_log.h"
+#include <cstring>
+
+static StaticSemaphore_t s_flow_mutex_buffer;
+static SemaphoreHandle_t s_flow_mutex = nullptr;
+
+static SemaphoreHandle_t get_flow_mutex() {
+    if (s_flow_mutex == nullptr) {
+        s_flow_mutex = xSemaphoreCreateMutexStatic(&s_flow_mutex_buffer);
+        configASSERT(s_flow_mutex);
+    }
+    return s_flow_mutex;
+}
+
+namespace ED_MQTT_dispatcher {
+
+static const char *TAG = "MQTTflow";
+
+// ── Static members ───────────────────────────────────────────────────
+CmdFlow       CmdFlowScheduler::s_flows[MAX_CMD_FLOWS] = {};
+CmdFlow      *CmdFlowScheduler::s_current = nullptr;
+QueueHandle_t CmdFlowScheduler::s_queue = nullptr;
+TaskHandle_t  CmdFlowScheduler::s_task = nullptr;
+
+static StaticQueue_t s_flow_queue_buf;
+static uint8_t       s_flow_queue_storage[FLOW_QUEUE_LEN * 8];
+static StaticTask_t  s_flow_task_buf;
+static StackType_t   s_flow_task_stack[FLOW_TASK_STACK];
+
+// ── Coroutine frame pool ─────────────────────────────────────────────
+// Frames are only created and destroyed on the scheduler task.
+alignas(std::max_align_t) static uint8_t s_frames[MAX_CMD_FLOWS][CMD_FLOW_FRAME_SIZE];
+static bool s_frame_used[MAX_CMD_FLOWS] = {};
+
+void *CmdTask::promise_type::operator new(size_t size) noexcept {
+    if (size > CMD_FLOW_FRAME_SIZE) {
+        ESP_LOGE(TAG, "coroutine frame %u > %u bytes", (unsigned)size,
+                 (unsigned)CMD_FLOW_FRAME_SIZE);
+        return nullptr;
+    }
+    for (uint8_t i = 0; i < MAX_CMD_FLOWS; ++i) {
+        if (!s_frame_used[i]) {
+            s_frame_used[i] = true;
+            return s_frames[i];
+        }
+    }
+    ESP_LOGE(TAG, "coroutine frame pool exhausted");
+    return nullptr;
+}
+
+void CmdTask::promise_type::operator delete(void *ptr) noexcept {
+    for (uint8_t i = 0; i < MAX_CMD_FLOWS; ++i)
+        if (ptr == s_frames[i]) s_frame_used[i] = false;
+}
+
+// ── Awaiters (run on the scheduler task, inside resume()) ───────────
+bool DelayAwaiter::await_suspend(std::coroutine_handle<>) noexcept {
+    CmdFlow *flow = CmdFlowScheduler::current();
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (flow->cancelRequested) {
+        flow->result = FlowStatus::CANCELLED;
+        xSemaphoreGive(mutex);
+        return false;
+    }
+    flow->wait = CmdFlow::Wait::DELAY;
+    flow->result = FlowStatus::OK;
+    flow->hasDeadline = true;
+    flow->wakeAt = xTaskGetTickCount() + ticks;
+    xSemaphoreGive(mutex);
+    return true;
+}
+
+FlowStatus DelayAwaiter::await_resume() const noexcept {
+    CmdFlow *flow = CmdFlowScheduler::current();
+    return (ticks == 0 || !flow) ? FlowStatus::OK : flow->result;
+}
+
+bool PublishAwaiter::await_suspend(std::coroutine_handle<>) noexcept {
+    CmdFlow *flow = CmdFlowScheduler::current();
+    ED_MQTT::MqttClient *mqtt = ED_MQTT::MqttClient::getInstance();
+    if (!mqtt) {
+        immediate = FlowStatus::FAILED;
+        return false;
+    }
+
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (flow->cancelRequested) {
+        xSemaphoreGive(mutex);
+        immediate = FlowStatus::CANCELLED;
+        return false;
+    }
+    // Arm before publishing: PUBACK may arrive before publish returns.
+    flow->wait = CmdFlow::Wait::PUBLISH;
+    flow->msgId = -1;
+    flow->hasDeadline = true;
+    flow->wakeAt = xTaskGetTickCount() + pdMS_TO_TICKS(FLOW_PUBACK_TIMEOUT_MS);
+    xSemaphoreGive(mutex);
+
+    int msg_id = mqtt->publishWithId(topic, message, qos, retain);
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (msg_id < 0 || qos == 0 || msg_id == ED_MQTT::MqttClient::PUBLISH_SKIPPED) {
+        // QoS0 has no acknowledgement, an unchanged retained payload is not
+        // sent; a failed enqueue resumes at once.
+        flow->wait = CmdFlow::Wait::NONE;
+        flow->hasDeadline = false;
+        xSemaphoreGive(mutex);
+        immediate = (msg_id < 0) ? FlowStatus::FAILED : FlowStatus::OK;
+        return false;
+    }
+    flow->msgId = msg_id;
+    xSemaphoreGive(mutex);
+    suspended = true;
+    return true;
+}
+
+FlowStatus PublishAwaiter::await_resume() const noexcept {
+    return suspended ? CmdFlowScheduler::current()->result : immediate;
+}
+
+bool MessageAwaiter::await_suspend(std::coroutine_handle<>) noexcept {
+    CmdFlow *flow = CmdFlowScheduler::current();
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (flow->cancelRequested) {
+        flow->result = FlowStatus::CANCELLED;
+        flow->msgLen = 0;
+        xSemaphoreGive(mutex);
+        return false;
+    }
+    strncpy(flow->filter, filter ? filter : "#", sizeof(flow->filter) - 1);
+    flow->filter[sizeof(flow->filter) - 1] = '\0';
+    flow->msgLen = 0;
+    flow->wait = CmdFlow::Wait::MESSAGE;
+    flow->hasDeadline = (timeout != 0);
+    flow->wakeAt = xTaskGetTickCount() + timeout;
+    xSemaphoreGive(mutex);
+    return true;
+}
+
+FlowMessage MessageAwaiter::await_resume() const noexcept {
+    CmdFlow *flow = CmdFlowScheduler::current();
+    return FlowMessage{flow->result, flow->msg, flow->msgLen};
+}
+
+bool CancelAwaiter::await_ready() const noexcept {
+    CmdFlow *flow = CmdFlowScheduler::current();
+    return flow && flow->cancelRequested;
+}
+
+bool CancelAwaiter::await_suspend(std::coroutine_handle<>) noexcept {
+    CmdFlow *flow = CmdFlowScheduler::current();
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (flow->cancelRequested) {
+        xSemaphoreGive(mutex);
+        return false;
+    }
+    flow->wait = CmdFlow::Wait::CANCEL;
+    flow->hasDeadline = false;
+    xSemaphoreGive(mutex);
+    return true;
+}
+
+// ── Scheduler ────────────────────────────────────────────────────────
+esp_err_t CmdFlowScheduler::start() {
+    static_assert(sizeof(FlowEvent) <= 8, "FlowEvent must fit the queue slot");
+    if (s_task) return ESP_OK;
+    get_flow_mutex();
+    s_queue = xQueueCreateStatic(FLOW_QUEUE_LEN, sizeof(FlowEvent),
+                                 s_flow_queue_storage, &s_flow_queue_buf);
+    configASSERT(s_queue);
+    s_task = xTaskCreateStatic(scheduler_task, "cmd_flows", FLOW_TASK_STACK,
+                               nullptr, FLOW_TASK_PRIORITY, s_flow_task_stack,
+                               &s_flow_task_buf);
+    if (!s_task) {
+        ESP_LOGE(TAG, "scheduler task creation failed");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+bool CmdFlowScheduler::post(const FlowEvent &ev) {
+    if (!s_queue) {
+        ESP_LOGE(TAG, "scheduler not started");
+        return false;
+    }
+    if (xQueueSend(s_queue, &ev, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "flow queue full, event %d dropped", (int)ev.type);
+        return false;
+    }
+    return true;
+}
+
+bool CmdFlowScheduler::spawn(const ctrlCommand &cmd, uint32_t dedupTicket) {
+    if (!cmd.coroPointer) {
+        CommandDedupCache::complete(dedupTicket, nullptr);
+        return false;
+    }
+
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    uint8_t slot = MAX_CMD_FLOWS;
+    for (uint8_t i = 0; i < MAX_CMD_FLOWS; ++i) {
+        if (!s_flows[i].inUse) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == MAX_CMD_FLOWS) {
+        xSemaphoreGive(mutex);
+        CommandDedupCache::complete(dedupTicket, nullptr);
+        ESP_LOGE(TAG, "no free flow slot for '%s' (max %d)", cmd.cmdID, MAX_CMD_FLOWS);
+        return false;
+    }
+    CmdFlow &flow = s_flows[slot];
+    flow.cmd = cmd;
+    flow.handle = nullptr;
+    flow.inUse = true;
+    flow.cancelRequested = false;
+    flow.wait = CmdFlow::Wait::NONE;
+    flow.hasDeadline = false;
+    flow.msgId = -1;
+    flow.dedupTicket = dedupTicket;
+    xSemaphoreGive(mutex);
+
+    if (!post({EvType::SPAWN, slot, 0})) {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        release(flow);
+        xSemaphoreGive(mutex);
+        return false;
+    }
+    return true;
+}
+
+uint8_t CmdFlowScheduler::cancel(const char *cmdID) {
+    uint8_t n = 0;
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < MAX_CMD_FLOWS; ++i) {
+        CmdFlow &flow = s_flows[i];
+        if (!flow.inUse || strcmp(flow.cmd.cmdID, cmdID) != 0) continue;
+        flow.cancelRequested = true;
+        ++n;
+        if (flow.wait != CmdFlow::Wait::NONE && flow.wait != CmdFlow::Wait::READY) {
+            flow.wait = CmdFlow::Wait::READY;
+            flow.result = FlowStatus::CANCELLED;
+            flow.hasDeadline = false;
+            xSemaphoreGive(mutex);
+            post({EvType::RESUME, i, 0});
+            xSemaphoreTake(mutex, portMAX_DELAY);
+        }
+    }
+    xSemaphoreGive(mutex);
+    ESP_LOGI(TAG, "cancel '%s': %u flow(s)", cmdID, n);
+    return n;
+}
+
+uint8_t CmdFlowScheduler::activeCount() {
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < MAX_CMD_FLOWS; ++i)
+        if (s_flows[i].inUse) ++n;
+    return n;
+}
+
+void CmdFlowScheduler::memoryReport(ED_MQTT::MemoryReport &report) {
+    report.row("flow.slots", activeCount(), MAX_CMD_FLOWS, sizeof s_flows);
+    report.row("flow.frames", 0, 0, sizeof s_frames);
+    report.row("flow.queue", 0, 0, sizeof s_flow_queue_storage);
+    ED_MQTT::reportTaskStack(report, "flow.stack", s_task, sizeof s_flow_task_stack);
+}
+
+void CmdFlowScheduler::notifyPublished(int msgId) {
+    if (msgId < 0) return;
+    post({EvType::PUBLISHED, 0, msgId});
+}
+
+void CmdFlowScheduler::notifyMessage(const char *topic, int topicLen,
+                                     const char *data, size_t dataLen) {
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < MAX_CMD_FLOWS; ++i) {
+        CmdFlow &flow = s_flows[i];
+        if (!flow.inUse || flow.wait != CmdFlow::Wait::MESSAGE) continue;
+        if (!ED_MQTT::TopicRouter::matches(flow.filter, topic, topicLen)) continue;
+
+        size_t n = dataLen < sizeof(flow.msg) - 1 ? dataLen : sizeof(flow.msg) - 1;
+        memcpy(flow.msg, data, n);
+        flow.msg[n] = '\0';
+        flow.msgLen = n;
+        flow.wait = CmdFlow::Wait::READY;
+        flow.result = (n < dataLen) ? FlowStatus::FAILED : FlowStatus::OK;
+        flow.hasDeadline = false;
+        xSemaphoreGive(mutex);
+        post({EvType::RESUME, i, 0});
+        xSemaphoreTake(mutex, portMAX_DELAY);
+    }
+    xSemaphoreGive(mutex);
+}
+
+void CmdFlowScheduler::resume(CmdFlow &flow) {
+    s_current = &flow;
+    flow.handle.resume();
+    s_current = nullptr;
+
+    if (flow.handle.done()) {
+        flow.handle.destroy();
+        SemaphoreHandle_t mutex = get_flow_mutex();
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        ESP_LOGD(TAG, "flow '%s' finished", flow.cmd.cmdID);
+        flow.handle = nullptr;
+        flow.wait = CmdFlow::Wait::NONE;
+        release(flow);
+        xSemaphoreGive(mutex);
+    }
+}
+
+// Frees the slot; a flow that never acked still closes its dedup entry.
+// Flow mutex held.
+void CmdFlowScheduler::release(CmdFlow &flow) {
+    CommandDedupCache::complete(flow.dedupTicket, nullptr);
+    flow.dedupTicket = 0;
+    flow.inUse = false;
+}
+
+uint32_t CmdFlowScheduler::takeDedupTicket() {
+    if (!s_current || xTaskGetCurrentTaskHandle() != s_task)
+        return 0;
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    uint32_t ticket = s_current->dedupTicket;
+    s_current->dedupTicket = 0;
+    xSemaphoreGive(mutex);
+    return ticket;
+}
+
+void CmdFlowScheduler::handleEvent(const FlowEvent &ev) {
+    SemaphoreHandle_t mutex = get_flow_mutex();
+
+    switch (ev.type) {
+    case EvType::SPAWN: {
+        CmdFlow &flow = s_flows[ev.slot];
+        CmdTask task = flow.cmd.coroPointer(&flow.cmd);
+        flow.handle = task.release();
+        if (!flow.handle) {
+            ESP_LOGE(TAG, "flow '%s' could not be started", flow.cmd.cmdID);
+            xSemaphoreTake(mutex, portMAX_DELAY);
+            release(flow);
+            xSemaphoreGive(mutex);
+            return;
+        }
+        resume(flow);
+        break;
+    }
+
+    case EvType::RESUME: {
+        CmdFlow &flow = s_flows[ev.slot];
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        bool ready = flow.inUse && flow.handle && flow.wait == CmdFlow::Wait::READY;
+        if (ready) flow.wait = CmdFlow::Wait::NONE;
+        xSemaphoreGive(mutex);
+        if (ready) resume(flow);
+        break;
+    }
+
+    case EvType::PUBLISHED:
+        for (uint8_t i = 0; i < MAX_CMD_FLOWS; ++i) {
+            CmdFlow &flow = s_flows[i];
+            xSemaphoreTake(mutex, portMAX_DELAY);
+            bool hit = flow.inUse && flow.wait == CmdFlow::Wait::PUBLISH &&
+                       flow.msgId == ev.msgId;
+            if (hit) {
+                flow.wait = CmdFlow::Wait::NONE;
+                flow.result = FlowStatus::OK;
+                flow.hasDeadline = false;
+            }
+            xSemaphoreGive(mutex);
+            if (hit) resume(flow);
+        }
+        break;
+    }
+}
+
+void CmdFlowScheduler::expireDeadlines() {
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    TickType_t now = xTaskGetTickCount();
+    for (uint8_t i = 0; i < MAX_CMD_FLOWS; ++i) {
+        CmdFlow &flow = s_flows[i];
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        bool due = flow.inUse && flow.hasDeadline &&
+                   (int32_t)(now - flow.wakeAt) >= 0;
+        if (due) {
+            flow.result = (flow.wait == CmdFlow::Wait::DELAY) ? FlowStatus::OK
+                                                              : FlowStatus::TIMEOUT;
+            flow.wait = CmdFlow::Wait::NONE;
+            flow.hasDeadline = false;
+        }
+        xSemaphoreGive(mutex);
+        if (due) resume(flow);
+    }
+}
+
+TickType_t CmdFlowScheduler::nextTimeout() {
+    TickType_t now = xTaskGetTickCount();
+    TickType_t best = portMAX_DELAY;
+    SemaphoreHandle_t mutex = get_flow_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < MAX_CMD_FLOWS; ++i) {
+        const CmdFlow &flow = s_flows[i];
+        if (!flow.inUse || !flow.hasDeadline) continue;
+        int32_t left = (int32_t)(flow.wakeAt - now);
+        TickType_t t = left > 0 ? (TickType_t)left : 0;
+        if (t < best) best = t;
+    }
+    xSemaphoreGive(mutex);
+    return best;
+}
+
+void CmdFlowScheduler::scheduler_task(void *) {
+    for (;;) {
+        FlowEvent ev;
+        if (xQueueReceive(s_queue, &ev, nextTimeout()) == pdTRUE)
+            handleEvent(ev);
+        expireDeadlines();
+    }
+}
+
+} // namespace ED_MQTT_dispatcher
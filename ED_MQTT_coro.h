@@ -0,0 +1,203 @@
+#pragma once
+
+#include "ED_MQTT_dispatcher.h"
+#include <coroutine>
+#include <cstddef>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+namespace ED_MQTT_dispatcher {
+
+/**
+ * Coroutine command flows.
+ *
+ * A ctrlCommand may bind `coroPointer` instead of `funcPointer`. The handler
+ * is then a C++20 coroutine returning CmdTask and may co_await:
+ *  - publishAcked(topic, msg, qos)  resumes on PUBACK/PUBCOMP (or timeout)
+ *  - delayMs(ms)                    resumes after the delay
+ *  - nextMessage(filter, timeout)   resumes on the next message matching filter
+ *  - cancelled()                    resumes when the flow is cancelled
+ *
+ * Every flow is resumed by ONE scheduler task (static stack, static queue).
+ * Coroutine frames come from a fixed pool — no heap, no task per flow.
+ * The command is copied into the flow slot, so `cmd` stays valid for the
+ * whole lifetime of the coroutine.
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint8_t  MAX_CMD_FLOWS        = ED_MQTT_MAX_CMD_FLOWS;
+static constexpr size_t   CMD_FLOW_FRAME_SIZE  = ED_MQTT_FLOW_FRAME_SIZE;
+static constexpr size_t   FLOW_TOPIC_LEN       = 64;
+static constexpr size_t   FLOW_MSG_LEN         = 256;
+static constexpr uint32_t FLOW_TASK_STACK      = ED_MQTT_FLOW_STACK;
+static constexpr UBaseType_t FLOW_TASK_PRIORITY = ED_MQTT_FLOW_PRIORITY;
+static constexpr uint8_t  FLOW_QUEUE_LEN       = 8;
+static constexpr uint32_t FLOW_PUBACK_TIMEOUT_MS = 10000;
+static_assert(ED_MQTT_MAX_CMD_FLOWS > 0 && ED_MQTT_MAX_CMD_FLOWS <= 32,
+              "ED_MQTT_MAX_CMD_FLOWS must be 1..32");
+static_assert(ED_MQTT_FLOW_FRAME_SIZE >= 256 && ED_MQTT_FLOW_FRAME_SIZE % alignof(std::max_align_t) == 0,
+              "ED_MQTT_FLOW_FRAME_SIZE must be >= 256 and a multiple of max_align_t");
+static_assert(ED_MQTT_FLOW_STACK >= 2048, "ED_MQTT_FLOW_STACK below 2048 bytes");
+static_assert(ED_MQTT_FLOW_PRIORITY > 0 && ED_MQTT_FLOW_PRIORITY < configMAX_PRIORITIES,
+              "ED_MQTT_FLOW_PRIORITY must be 1..configMAX_PRIORITIES-1");
+
+enum class FlowStatus : uint8_t { OK, TIMEOUT, CANCELLED, FAILED };
+
+// ── CmdTask (coroutine return type) ─────────────────────────────────
+class CmdTask {
+public:
+    struct promise_type {
+        CmdTask get_return_object() {
+            return CmdTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        static CmdTask get_return_object_on_allocation_failure() { return CmdTask{}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {}
+
+        static void* operator new(size_t size) noexcept;
+        static void  operator delete(void* ptr) noexcept;
+    };
+
+    CmdTask() = default;
+    explicit CmdTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+    CmdTask(CmdTask&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    CmdTask(const CmdTask&) = delete;
+    CmdTask& operator=(const CmdTask&) = delete;
+
+    std::coroutine_handle<promise_type> release() {
+        auto h = handle;
+        handle = nullptr;
+        return h;
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle = nullptr;
+};
+
+// ── CmdFlow (one running coroutine) ─────────────────────────────────
+struct CmdFlow {
+    enum class Wait : uint8_t { NONE, READY, DELAY, PUBLISH, MESSAGE, CANCEL };
+
+    ctrlCommand cmd = {};
+    std::coroutine_handle<CmdTask::promise_type> handle = nullptr;
+    bool        inUse = false;
+    bool        cancelRequested = false;
+
+    Wait        wait = Wait::NONE;
+    FlowStatus  result = FlowStatus::OK;
+    bool        hasDeadline = false;
+    TickType_t  wakeAt = 0;
+    int         msgId = -1;
+    uint32_t    dedupTicket = 0;   // completed by the flow's ack or its end
+
+    char        filter[FLOW_TOPIC_LEN] = {};
+    char        msg[FLOW_MSG_LEN] = {};
+    size_t      msgLen = 0;
+};
+
+struct FlowMessage {
+    FlowStatus  status;
+    const char* data;   // valid until the next co_await
+    size_t      len;
+};
+
+// ── Awaitables ──────────────────────────────────────────────────────
+struct DelayAwaiter {
+    TickType_t ticks;
+    bool await_ready() const noexcept { return ticks == 0; }
+    bool await_suspend(std::coroutine_handle<>) noexcept;
+    FlowStatus await_resume() const noexcept;
+};
+
+struct PublishAwaiter {
+    const char* topic;
+    const char* message;
+    int         qos;
+    bool        retain;
+    FlowStatus  immediate = FlowStatus::OK;
+    bool        suspended = false;
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<>) noexcept;
+    FlowStatus await_resume() const noexcept;
+};
+
+struct MessageAwaiter {
+    const char* filter;
+    TickType_t  timeout;
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<>) noexcept;
+    FlowMessage await_resume() const noexcept;
+};
+
+struct CancelAwaiter {
+    bool await_ready() const noexcept;
+    bool await_suspend(std::coroutine_handle<>) noexcept;
+    FlowStatus await_resume() const noexcept { return FlowStatus::CANCELLED; }
+};
+
+inline DelayAwaiter delayMs(uint32_t ms) { return DelayAwaiter{pdMS_TO_TICKS(ms)}; }
+inline PublishAwaiter publishAcked(const char* topic, const char* message,
+                                   int qos = 1, bool retain = false) {
+    return PublishAwaiter{topic, message, qos, retain};
+}
+/// timeout_ms == 0 waits forever (until cancelled).
+inline MessageAwaiter nextMessage(const char* filter, uint32_t timeout_ms = 0) {
+    return MessageAwaiter{filter, pdMS_TO_TICKS(timeout_ms)};
+}
+inline CancelAwaiter cancelled() { return CancelAwaiter{}; }
+
+// ── CmdFlowScheduler ────────────────────────────────────────────────
+class CmdFlowScheduler {
+public:
+    static esp_err_t start();
+
+    /// Copy cmd into a free flow slot and start its coroutine. Any task.
+    /// dedupTicket (see ED_MQTT_dedup.h) moves to the flow.
+    static bool spawn(const ctrlCommand& cmd, uint32_t dedupTicket = 0);
+    /// Cancel every running flow of cmdID. Returns the number cancelled.
+    static uint8_t cancel(const char* cmdID);
+    static uint8_t activeCount();
+    static void memoryReport(ED_MQTT::MemoryReport& report);
+
+    /// Event sinks, called from the MQTT event task.
+    static void notifyPublished(int msgId);
+    static void notifyMessage(const char* topic, int topicLen,
+                              const char* data, size_t dataLen);
+
+    /// Flow currently being resumed (scheduler task only).
+    static CmdFlow* current() { return s_current; }
+    /// Dedup ticket of the current flow, taken so it is completed once;
+    /// 0 off the scheduler task.
+    static uint32_t takeDedupTicket();
+
+private:
+    enum class EvType : uint8_t { SPAWN, RESUME, PUBLISHED };
+    struct FlowEvent {
+        EvType  type;
+        uint8_t slot;
+        int     msgId;
+    };
+
+    static void scheduler_task(void* arg);
+    static void handleEvent(const FlowEvent& ev);
+    static void resume(CmdFlow& flow);
+    static void release(CmdFlow& flow);
+    static void expireDeadlines();
+    static TickType_t nextTimeout();
+    static bool post(const FlowEvent& ev);
+
+    static CmdFlow        s_flows[MAX_CMD_FLOWS];
+    static CmdFlow*       s_current;
+    static QueueHandle_t  s_queue;
+    static TaskHandle_t   s_task;
+
+    friend struct DelayAwaiter;
+    friend struct PublishAwaiter;
+    friend struct MessageAwaiter;
+    friend struct CancelAwaiter;
+};
+
+} // namespace ED_MQTT_dispatcher
@@ -0,0 +1,139 @@
+#include "ED_MQTT_dedup.h"
+#include "esp_log.h"
+#include <cstring>
+#include <freertos/semphr.h>
+
+static StaticSemaphore_t s_dedup_mutex_buffer;
+static SemaphoreHandle_t s_dedup_mutex = nullptr;
+
+static SemaphoreHandle_t get_dedup_mutex() {
+    if (s_dedup_mutex == nullptr) {
+        s_dedup_mutex = xSemaphoreCreateMutexStatic(&s_dedup_mutex_buffer);
+        configASSERT(s_dedup_mutex);
+    }
+    return s_dedup_mutex;
+}
+
+namespace ED_MQTT_dispatcher {
+
+static const char *TAG = "MQTTdedup";
+
+// ── Static members ───────────────────────────────────────────────────
+CommandDedupCache::Entry CommandDedupCache::s_entries[DEDUP_ENTRIES] = {};
+uint32_t CommandDedupCache::s_suppressed = 0;
+uint32_t CommandDedupCache::s_next_ticket = 0;
+
+uint32_t CommandDedupCache::fnv1a(uint32_t h, const void *data, size_t len) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+CommandDedupCache::Lookup
+CommandDedupCache::check(const ED_MQTT::RequestContext &req, uint32_t msgID,
+                         const char *topic, int topicLen, const char *data,
+                         size_t dataLen, char *reply, size_t replyLen,
+                         uint32_t &ticket) {
+    ticket = 0;
+    // Key source is mixed in so an epoch can never equal a payload hash.
+    // A cut correlation is only a prefix and may be shared: not a key.
+    uint32_t key = 2166136261u;
+    bool strongKey = true;
+    if (req.correlationLen > 0 && !req.correlationTruncated) {
+        key = fnv1a(key, "C", 1);
+        key = fnv1a(key, req.correlation, req.correlationLen);
+    } else if (req.epoch != 0) {
+        key = fnv1a(key, "E", 1);
+        key = fnv1a(key, &req.epoch, sizeof req.epoch);
+    } else {
+        key = fnv1a(key, "P", 1);
+        key = fnv1a(key, topic, (size_t)topicLen);
+        key = fnv1a(key, data, dataLen);
+        strongKey = false;
+    }
+    // Without an id only QoS>0 traffic can be redelivered.
+    if (!strongKey && req.qos == 0)
+        return Lookup::NEW;
+
+    TickType_t now = xTaskGetTickCount();
+    const TickType_t ttl = pdMS_TO_TICKS(DEDUP_TTL_MS);
+    Lookup result = Lookup::NEW;
+
+    SemaphoreHandle_t mutex = get_dedup_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    Entry *slot = nullptr;
+    Entry *oldest = nullptr;
+    for (uint8_t i = 0; i < DEDUP_ENTRIES; ++i) {
+        Entry &e = s_entries[i];
+        if (e.used && (TickType_t)(now - e.at) > ttl)
+            e.used = false;
+        if (!e.used) {
+            if (!slot) slot = &e;
+            continue;
+        }
+        if (!oldest || (TickType_t)(now - e.at) > (TickType_t)(now - oldest->at))
+            oldest = &e;
+        if (e.key != key)
+            continue;
+        // A payload-hash hit only counts when the broker flags a redelivery.
+        if (!strongKey && !req.dup)
+            continue;
+        result = e.done ? Lookup::DONE : Lookup::RUNNING;
+        if (e.done && reply && replyLen) {
+            strncpy(reply, e.reply, replyLen - 1);
+            reply[replyLen - 1] = '\0';
+        }
+        ++s_suppressed;
+        break;
+    }
+
+    if (result == Lookup::NEW) {
+        Entry &e = slot ? *slot : *oldest;
+        if (++s_next_ticket == 0) s_next_ticket = 1;
+        e.key = key;
+        e.ticket = ticket = s_next_ticket;
+        e.at = now;
+        e.used = true;
+        e.done = false;
+        e.reply[0] = '\0';
+    }
+    xSemaphoreGive(mutex);
+
+    if (result != Lookup::NEW)
+        ESP_LOGW(TAG, "duplicate command %lu suppressed (%s)", (unsigned long)msgID,
+                 result == Lookup::DONE ? "re-acked" : "still running");
+    return result;
+}
+
+void CommandDedupCache::complete(uint32_t ticket, const char *reply) {
+    if (ticket == 0) return;
+    SemaphoreHandle_t mutex = get_dedup_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (uint8_t i = 0; i < DEDUP_ENTRIES; ++i) {
+        Entry &e = s_entries[i];
+        if (!e.used || e.done || e.ticket != ticket)
+            continue;
+        e.done = true;
+        size_t n = reply ? strlen(reply) : 0;
+        if (n < sizeof e.reply) {
+            memcpy(e.reply, reply ? reply : "", n + 1);
+        } else {
+            e.reply[0] = '\0';   // too big to cache: duplicates get a short notice
+        }
+        break;
+    }
+    xSemaphoreGive(mutex);
+}
+
+void CommandDedupCache::memoryReport(ED_MQTT::MemoryReport &report) {
+    uint8_t used = 0;
+    for (uint8_t i = 0; i < DEDUP_ENTRIES; ++i)
+        if (s_entries[i].used) ++used;
+    report.row("dedup", used, DEDUP_ENTRIES, sizeof s_entries);
+}
+
+} // namespace ED_MQTT_dispatcher
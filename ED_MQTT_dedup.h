@@ -0,0 +1,70 @@
+#pragma once
+
+#include "ED_mqtt.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_MQTT_dispatcher {
+
+/**
+ * Idempotency cache for incoming commands.
+ *
+ * QoS1 commands can be redelivered by the broker after a reconnect. Each
+ * command is keyed by its MQTT5 correlation data (unless it was cut), else
+ * its epoch, else a hash of topic + payload (the payload key is only
+ * consulted for DUP redeliveries so that an operator can still repeat a
+ * command on purpose). Builtins (":HELP", ":MEM", …) are not cached.
+ *
+ * check() hands out a ticket for the entry it reserved; the reply is stored
+ * against that ticket, never against the msgID (which the client reuses).
+ *
+ * A duplicate of a finished command is answered with the cached reply; a
+ * duplicate of a command still running is dropped. Entries expire after
+ * DEDUP_TTL_MS. Fixed table, no heap.
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint8_t  DEDUP_ENTRIES   = ED_MQTT_DEDUP_ENTRIES;
+static constexpr size_t   DEDUP_REPLY_LEN = 192;
+static constexpr uint32_t DEDUP_TTL_MS    = 10 * 60 * 1000;
+static_assert(ED_MQTT_DEDUP_ENTRIES > 0 && ED_MQTT_DEDUP_ENTRIES <= 255,
+              "ED_MQTT_DEDUP_ENTRIES must be 1..255");
+
+class CommandDedupCache {
+public:
+    enum class Lookup : uint8_t { NEW, RUNNING, DONE };
+
+    /// Check an incoming command. NEW reserves an entry for it and sets
+    /// ticket (0 when the command is not tracked); DONE copies the cached
+    /// reply into reply (always terminated, may be "" if it did not fit the
+    /// cache).
+    static Lookup check(const ED_MQTT::RequestContext& req, uint32_t msgID,
+                        const char* topic, int topicLen,
+                        const char* data, size_t dataLen,
+                        char* reply, size_t replyLen, uint32_t& ticket);
+
+    /// Store the reply sent for the entry of ticket so duplicates can be
+    /// answered. No-op for ticket 0 or an entry already completed/recycled.
+    static void complete(uint32_t ticket, const char* reply);
+
+    static uint32_t suppressedCount() { return s_suppressed; }
+    static void memoryReport(ED_MQTT::MemoryReport& report);
+
+private:
+    struct Entry {
+        uint32_t   key;
+        uint32_t   ticket;
+        TickType_t at;
+        bool       used;
+        bool       done;
+        char       reply[DEDUP_REPLY_LEN];
+    };
+
+    static uint32_t fnv1a(uint32_t h, const void* data, size_t len);
+
+    static Entry    s_entries[DEDUP_ENTRIES];
+    static uint32_t s_suppressed;
+    static uint32_t s_next_ticket;
+};
+
+} // namespace ED_MQTT_dispatcher
@@ -1,9 +1,22 @@
 #include "ED_MQTT_dispatcher.h"
+#include "ED_MQTT_alloc.h"
+#include "ED_MQTT_cmdtok.h"
+#include "ED_MQTT_coro.h"
+#include "ED_MQTT_dedup.h"
+#include "ED_MQTT_history.h"
+#include "ED_MQTT_logstream.h"
+#include "ED_MQTT_metrics.h"
+#include "ED_MQTT_profile.h"
+#include "ED_MQTT_router.h"
+#include "ED_MQTT_sensors.h"
+#include "ED_MQTT_supervisor.h"
+#include "ED_MQTT_work.h"
 #include "ED_S_JSON.h"
 #include "ED_sys.h"
 #include "ED_wifi.h"
 #include "esp_log.h"
 #include <cctype>
+#include <cmath>
 #include <cstring>
 
 static StaticSemaphore_t s_disp_mutex_buffer;
@@ -17,6 +30,18 @@ static SemaphoreHandle_t get_disp_mutex() {
     return s_disp_mutex;
 }
 
+// Diag message assembly: provider cache + s_diag_buf.
+static StaticSemaphore_t s_diag_mutex_buffer;
+static SemaphoreHandle_t s_diag_mutex = nullptr;
+
+static SemaphoreHandle_t get_diag_mutex() {
+    if (s_diag_mutex == nullptr) {
+        s_diag_mutex = xSemaphoreCreateMutexStatic(&s_diag_mutex_buffer);
+        configASSERT(s_diag_mutex);
+    }
+    return s_diag_mutex;
+}
+
 namespace ED_MQTT_dispatcher {
 
 static const char *TAG = "MQTTdisp";
@@ -25,20 +50,122 @@ static const char *TAG = "MQTTdisp";
 iCommandRunner *MQTTdispatcher::s_subscribers[MAX_CMD_SUBSCRIBERS] = {};
 uint8_t MQTTdispatcher::s_subscriber_count = 0;
 
-esp_mqtt_client_handle_t MQTTdispatcher::s_clHandle = nullptr;
-TaskHandle_t MQTTdispatcher::s_info_task_handle = nullptr;
+uint32_t MQTTdispatcher::s_info_pending = 0;
 TimerHandle_t MQTTdispatcher::s_info_timer = nullptr;
+TimerHandle_t MQTTdispatcher::s_hist_timer = nullptr;
+TimerHandle_t MQTTdispatcher::s_boot_timer = nullptr;
+static StaticTimer_t s_info_timer_buf;
+static StaticTimer_t s_hist_timer_buf;
+static StaticTimer_t s_boot_timer_buf;
+// Guards s_info_pending: set from timers and the MQTT task, taken by the job.
+static portMUX_TYPE s_info_mux = portMUX_INITIALIZER_UNLOCKED;
+bool MQTTdispatcher::s_boot_reported = false;
 char MQTTdispatcher::s_mqtt_id[18] = {};
+char MQTTdispatcher::s_cmd_topic[32] = {};
+char MQTTdispatcher::s_groups[MAX_CMD_GROUPS > 0 ? MAX_CMD_GROUPS : 1][CMD_GROUP_LEN] = {};
 ED_MQTT::MqttClient *MQTTdispatcher::s_mqtt = nullptr;
 esp_mqtt_client_config_t *MQTTdispatcher::s_config = nullptr;
-MQTTdispatcher::JsonFieldProvider
+MQTTdispatcher::ProviderSlot
     MQTTdispatcher::s_json_providers[MAX_JSON_PROVIDERS] = {};
 uint8_t MQTTdispatcher::s_json_provider_count = 0;
+char MQTTdispatcher::s_diag_buf[DIAG_BUFFER_LEN] = {};
+uint32_t MQTTdispatcher::s_diag_seq = 0;
+bool MQTTdispatcher::s_diag_delta = false;
+uint16_t MQTTdispatcher::s_diag_keyframe_every = DIAG_KEYFRAME_EVERY;
+uint16_t MQTTdispatcher::s_diag_since_key = 0;
+volatile bool MQTTdispatcher::s_diag_key_requested = false;
+MQTTdispatcher::TopicEncoding MQTTdispatcher::s_topic_enc[MAX_TOPIC_ENCODINGS] = {};
+uint8_t MQTTdispatcher::s_topic_enc_count = 0;
 char MQTTdispatcher::s_cached_ip[16] = "";
+MQTTdispatcher::BatchResult MQTTdispatcher::s_batch[MAX_BATCH_CMDS] = {};
+uint8_t MQTTdispatcher::s_batch_count = 0;
+uint16_t MQTTdispatcher::s_batch_dropped = 0;
+uint8_t MQTTdispatcher::s_batch_cur = 0;
+TaskHandle_t MQTTdispatcher::s_batch_task = nullptr;
+uint32_t MQTTdispatcher::s_dedup_ticket = 0;
+TaskHandle_t MQTTdispatcher::s_dedup_task = nullptr;
+MQTTdispatcher::PendingRequest MQTTdispatcher::s_pending[MAX_PENDING_REQUESTS] = {};
+uint8_t MQTTdispatcher::s_pending_next = 0;
+uint32_t MQTTdispatcher::s_pending_evicted = 0;
+
+// Append s as a JSON string body (no quotes). Returns chars written.
+static size_t json_escape(char *out, size_t len, const char *s) {
+  size_t w = 0;
+  for (; s && *s && w + 2 < len; ++s) {
+    char ch = *s;
+    if (ch == '"' || ch == '\\') {
+      out[w++] = '\\';
+      out[w++] = ch;
+    } else if ((unsigned char)ch < 0x20) {
+      out[w++] = ' ';
+    } else {
+      out[w++] = ch;
+    }
+  }
+  if (len) out[w < len ? w : len - 1] = '\0';
+  return w;
+}
+
+// Milliseconds to ticks in 64 bits: pdMS_TO_TICKS() overflows a 32-bit
+// TickType_t (above ~11.9 h at 100 Hz). False when the period does not fit
+// below portMAX_DELAY.
+static bool period_ticks(uint64_t ms, TickType_t &ticks) {
+  uint64_t t = ms * configTICK_RATE_HZ / 1000;
+  if (t >= portMAX_DELAY)
+    return false;
+  ticks = (TickType_t)(t ? t : 1);
+  return true;
+}
+
+// Parse "<n>[s|m|h|d]" (seconds by default), "0" or "D" into milliseconds.
+// Returns false on malformed input and on periods a timer cannot hold;
+// disable is set for "0" and "D".
+static bool parse_period(const char *arg, uint32_t &ms, bool &disable) {
+  while (*arg && isspace((unsigned char)*arg)) ++arg;
+  disable = false;
+  ms = 0;
+  if (*arg == 'D' || *arg == 'd') {
+    disable = true;
+    return true;
+  }
+  int number = 0;
+  if (sscanf(arg, "%d", &number) != 1 || number < 0)
+    return false;
+  if (number == 0) {
+    disable = true;
+    return true;
+  }
+  while (*arg && isdigit((unsigned char)*arg)) ++arg;
+  uint64_t multiplier = 1;   // default = seconds
+  switch (*arg) {
+  case 'm': case 'M': multiplier = 60; break;
+  case 'h': case 'H': multiplier = 3600; break;
+  case 'd': case 'D': multiplier = 86400; break;
+  default: break;
+  }
+  const uint64_t total = (uint64_t)number * multiplier * 1000;
+  TickType_t ticks;
+  if (total > UINT32_MAX || !period_ticks(total, ticks))
+    return false;
+  ms = (uint32_t)total;
+  return true;
+}
 
 //-------------------------------------------------------------
 
 // ── ctrlCommand helpers ─────────────────────────────────────────────
+bool ctrlCommand::setID(const char *id) {
+  size_t len = id ? strnlen(id, CMD_ID_LEN) : 0;
+  if (len == 0 || len >= CMD_ID_LEN) {
+    ESP_LOGE("CmdReg", "command name '%.*s' empty or over %u chars",
+             (int)len, id ? id : "", (unsigned)(CMD_ID_LEN - 1));
+    cmdID[0] = '\0';
+    return false;
+  }
+  memcpy(cmdID, id, len + 1);
+  return true;
+}
+
 const char *ctrlCommand::getParam(const char *key) const {
   for (uint8_t i = 0; i < paramCount; ++i)
     if (strncmp(optParam[i].key, key, PARAM_KEY_LEN) == 0)
@@ -74,35 +201,46 @@ void ctrlCommand::appendHelp(char *buf, size_t len) const {
 }
 
 // ── CommandRegistry ──────────────────────────────────────────────────
-void CommandRegistry::registerCommand(const ctrlCommand &cmd) {
-  if (count >= MAX_COMMANDS) {
-    return;
+bool CommandRegistryBase::registerCommand(const ctrlCommand &cmd) {
+  size_t idLen = strnlen(cmd.cmdID, CMD_ID_LEN);
+  if (idLen == 0 || idLen >= CMD_ID_LEN) {
+    ESP_LOGE("CmdReg", "command name '%.*s' empty or over %u chars, dropped",
+             (int)idLen, cmd.cmdID, (unsigned)(CMD_ID_LEN - 1));
+    return false;
   }
   for (uint8_t i = 0; i < count; ++i)
     if (strcmp(entries[i].cmdID, cmd.cmdID) == 0) {
       entries[i] = cmd;
-      return;
+      return true;
     }
+  if (count >= m_capacity) {
+    ESP_LOGE("CmdReg", "registry full (%u commands), '%s' dropped",
+             m_capacity, cmd.cmdID);
+    return false;
+  }
   entries[count++] = cmd;
+  return true;
 }
 
-ctrlCommand *CommandRegistry::getCommand(const char *cmdID) const {
+ctrlCommand *CommandRegistryBase::getCommand(const char *cmdID) const {
   for (uint8_t i = 0; i < count; ++i)
     if (strcmp(entries[i].cmdID, cmdID) == 0)
       return const_cast<ctrlCommand *>(&entries[i]);
   return nullptr;
 }
 
-bool CommandRegistry::dispatch(const char *cmdID) {
+bool CommandRegistryBase::dispatch(const char *cmdID) {
   ctrlCommand *cmd = getCommand(cmdID);
   if (cmd && cmd->funcPointer) {
+    ED_MQTT::HookTimer timed(
+        ED_MQTT::HookProfiler::lookup(ED_MQTT::HookKind::COMMAND, cmd->cmdID));
     cmd->funcPointer(cmd);
     return true;
   }
   return false;
 }
 
-void CommandRegistry::getHelpBrief(char *buf, size_t len) const {
+void CommandRegistryBase::getHelpBrief(char *buf, size_t len) const {
   buf[0] = '\0';
   size_t used = 0;
   for (uint8_t i = 0; i < count && used < len; ++i) {
@@ -114,8 +252,8 @@ void CommandRegistry::getHelpBrief(char *buf, size_t len) const {
     snprintf(buf, len, "  No commands.\n");
 }
 
-void CommandRegistry::getHelpDetail(const char *cmdID, char *buf,
-                                    size_t len) const {
+void CommandRegistryBase::getHelpDetail(const char *cmdID, char *buf,
+                                        size_t len) const {
   const ctrlCommand *cmd = nullptr;
   for (uint8_t i = 0; i < count; ++i)
     if (strcmp(entries[i].cmdID, cmdID) == 0) {
@@ -139,17 +277,20 @@ void CommandRegistry::getHelpDetail(const char *cmdID, char *buf,
   }
 }
 
-CommandWithRegistry::CommandWithRegistry(const char* regID, const char* briefDesc) {
-    GlobalCommandRegistry::instance().registerRegistry(regID, &registry, briefDesc);
+CommandWithRegistryBase::CommandWithRegistryBase(CommandRegistryBase &reg,
+                                                 const char *regID,
+                                                 const char *briefDesc)
+    : m_registry(reg) {
+    GlobalCommandRegistry::instance().registerRegistry(regID, &reg, briefDesc);
 }
 
 // ── CommandWithRegistry::grabCommand (injects _msgID and _original) ──
-void CommandWithRegistry::grabCommand(const char *commandID,
-                                      const char *commandData,
-                                      size_t /*dataLen*/,
-                                      uint32_t msgID) {
+void CommandWithRegistryBase::grabCommand(const char *commandID,
+                                          const char *commandData,
+                                          size_t /*dataLen*/,
+                                          uint32_t msgID) {
 
-    ctrlCommand *cmd = registry.getCommand(commandID);
+    ctrlCommand *cmd = m_registry.getCommand(commandID);
     if (!cmd) {
         ESP_LOGW("CmdReg", "Command '%s' not found", commandID);
         return;
@@ -238,8 +379,13 @@ void CommandWithRegistry::grabCommand(const char *commandID,
     const char *finalMsgID = cmd->getParam("_msgID");
 
     // Execute the command
-    if (cmd->funcPointer)
+    if (cmd->coroPointer)
+        CmdFlowScheduler::spawn(*cmd, MQTTdispatcher::handOffDedupTicket());
+    else if (cmd->funcPointer) {
+        ED_MQTT::HookTimer timed(
+            ED_MQTT::HookProfiler::lookup(ED_MQTT::HookKind::COMMAND, cmd->cmdID));
         cmd->funcPointer(cmd);
+    }
 }
 
 // ── GlobalCommandRegistry (singleton) ───────────────────────────────
@@ -251,10 +397,15 @@ GlobalCommandRegistry &GlobalCommandRegistry::instance() {
 void GlobalCommandRegistry::setBaseUrl(const char *url) { m_baseUrl = url; }
 
 bool GlobalCommandRegistry::registerRegistry(const char *regID,
-                                             CommandRegistry *reg,
+                                             CommandRegistryBase *reg,
                                              const char *briefDesc) {
-  if (m_count >= MAX_REGISTRIES || !regID || !reg)
+  if (!regID || !reg)
     return false;
+  if (m_count >= MAX_REGISTRIES) {
+    ESP_LOGE("CmdReg", "registry table full (max %d), '%s' dropped",
+             MAX_REGISTRIES, regID);
+    return false;
+  }
   m_registries[m_count++] = {regID, reg, briefDesc};
   return true;
 }
@@ -266,6 +417,25 @@ RegistryInfo *GlobalCommandRegistry::findRegistry(const char *regID) const {
   return nullptr;
 }
 
+const ctrlCommand *GlobalCommandRegistry::findCommand(const char *cmdID) const {
+  for (uint8_t i = 0; i < m_count; ++i) {
+    const ctrlCommand *cmd = m_registries[i].registry->getCommand(cmdID);
+    if (cmd)
+      return cmd;
+  }
+  return nullptr;
+}
+
+void GlobalCommandRegistry::memoryReport(ED_MQTT::MemoryReport &report) const {
+  report.row("registries", m_count, MAX_REGISTRIES, sizeof m_registries);
+  for (uint8_t i = 0; i < m_count; ++i) {
+    char name[24];
+    snprintf(name, sizeof name, "reg.%s", m_registries[i].regID);
+    const CommandRegistryBase *reg = m_registries[i].registry;
+    report.row(name, reg->size(), reg->capacity(), reg->storageBytes());
+  }
+}
+
 void GlobalCommandRegistry::getHelpOverview(char *buf, size_t len) const {
   if (m_count == 0) {
     snprintf(buf, len, "No registries available.");
@@ -343,19 +513,130 @@ void GlobalCommandRegistry::getCommandHelp(const char *regID, const char *cmdID,
 // ── MQTTdispatcher implementation ────────────────────────────────────
 
 esp_mqtt_client_handle_t MQTTdispatcher::getClientHandle() {
-    SemaphoreHandle_t mutex = get_disp_mutex();
-    xSemaphoreTake(mutex, portMAX_DELAY);
-    esp_mqtt_client_handle_t cl = s_clHandle;
-    xSemaphoreGive(mutex);
-    return cl;
+    return s_mqtt ? s_mqtt->getHandle() : nullptr;
 }
 
-void MQTTdispatcher::subscribe(iCommandRunner *subscriber) {
+bool MQTTdispatcher::subscribe(iCommandRunner *subscriber) {
   if (s_subscriber_count >= MAX_CMD_SUBSCRIBERS) {
     ESP_LOGE(TAG, "subscriber table full (max %d)", MAX_CMD_SUBSCRIBERS);
-    return;
+    return false;
   }
   s_subscribers[s_subscriber_count++] = subscriber;
+  return true;
+}
+
+// ── Command groups and targeting ─────────────────────────────────────
+static bool valid_group_name(const char *name) {
+  if (!name || !name[0] || strlen(name) >= CMD_GROUP_LEN)
+    return false;
+  for (const char *p = name; *p; ++p)
+    if (*p == '/' || *p == '+' || *p == '#' || *p == ',' || isspace((unsigned char)*p))
+      return false;
+  return true;
+}
+
+bool MQTTdispatcher::joinGroup(const char *name) {
+  if (!valid_group_name(name)) {
+    ESP_LOGW(TAG, "invalid group name '%s'", name ? name : "");
+    return false;
+  }
+  SemaphoreHandle_t mutex = get_disp_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  char *slot = nullptr;
+  for (uint8_t i = 0; i < MAX_CMD_GROUPS; ++i) {
+    if (strcmp(s_groups[i], name) == 0) {
+      xSemaphoreGive(mutex);
+      return true;
+    }
+    if (!slot && !s_groups[i][0])
+      slot = s_groups[i];
+  }
+  if (slot)
+    strcpy(slot, name);
+  xSemaphoreGive(mutex);
+  if (!slot) {
+    ESP_LOGE(TAG, "group table full (max %d), '%s' not joined", MAX_CMD_GROUPS, name);
+    return false;
+  }
+  char topic[TOPIC_FILTER_LEN];
+  snprintf(topic, sizeof topic, "cmd/group/%s", name);
+  ED_MQTT::MqttClient::addSubscription(topic, ED_MQTT::MqttClient::MqttQoS::QOS0);
+  ESP_LOGI(TAG, "joined group %s", name);
+  return true;
+}
+
+bool MQTTdispatcher::leaveGroup(const char *name) {
+  if (!valid_group_name(name))
+    return false;
+  SemaphoreHandle_t mutex = get_disp_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  bool found = false;
+  for (uint8_t i = 0; i < MAX_CMD_GROUPS && !found; ++i)
+    if (strcmp(s_groups[i], name) == 0) {
+      s_groups[i][0] = '\0';
+      found = true;
+    }
+  xSemaphoreGive(mutex);
+  if (found) {
+    char topic[TOPIC_FILTER_LEN];
+    snprintf(topic, sizeof topic, "cmd/group/%s", name);
+    ED_MQTT::MqttClient::removeSubscription(topic);
+    ESP_LOGI(TAG, "left group %s", name);
+  }
+  return found;
+}
+
+// "target" user property: comma-separated device and group names, "*" for
+// every device. Runs in the MQTT event task before the payload is reassembled.
+bool MQTTdispatcher::targetMatches(const char *target) {
+  SemaphoreHandle_t mutex = get_disp_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  bool hit = false;
+  for (const char *p = target; *p && !hit;) {
+    while (*p == ' ' || *p == ',')
+      ++p;
+    const char *end = p;
+    while (*end && *end != ',')
+      ++end;
+    size_t len = (size_t)(end - p);
+    while (len > 0 && p[len - 1] == ' ')
+      --len;
+    auto is = [&](const char *name) {
+      return name[0] && strlen(name) == len && strncmp(name, p, len) == 0;
+    };
+    hit = is("*") || is(s_mqtt_id);
+    for (uint8_t i = 0; i < MAX_CMD_GROUPS && !hit; ++i)
+      hit = is(s_groups[i]);
+    p = end;
+  }
+  xSemaphoreGive(mutex);
+  return hit;
+}
+
+size_t MQTTdispatcher::memoryReport(char *buf, size_t len) {
+  ED_MQTT::MemoryReport report(buf, len);
+  ED_MQTT::MqttClient::memoryReport(report);
+  ED_MQTT::SensorBridge::memoryReport(report);
+  report.row("disp.subscribers", s_subscriber_count, MAX_CMD_SUBSCRIBERS,
+             sizeof s_subscribers);
+  uint8_t groups = 0;
+  for (uint8_t i = 0; i < MAX_CMD_GROUPS; ++i)
+    groups += s_groups[i][0] ? 1 : 0;
+  report.row("disp.groups", groups, MAX_CMD_GROUPS, sizeof s_groups);
+  GlobalCommandRegistry::instance().memoryReport(report);
+  report.row("disp.json_providers", s_json_provider_count, MAX_JSON_PROVIDERS,
+             sizeof s_json_providers);
+  report.row("disp.diag", 0, 0, sizeof s_diag_buf);
+  report.row("disp.batch", s_batch_count, MAX_BATCH_CMDS, sizeof s_batch);
+  report.row("disp.pending", 0, 0, sizeof s_pending);
+  CommandDedupCache::memoryReport(report);
+  MetricAggregator::memoryReport(report);
+  DiagHistory::memoryReport(report);
+  CmdFlowScheduler::memoryReport(report);
+  WorkQueue::memoryReport(report);
+  ED_MQTT::LogStream::memoryReport(report);
+  report.finish();
+  return report.used;
 }
 
 bool MQTTdispatcher::parseCommand(const char *input, size_t inputLen,
@@ -375,8 +656,10 @@ bool MQTTdispatcher::parseCommand(const char *input, size_t inputLen,
     ++i;
 
   size_t idlen = i - start;
-  if (idlen >= cmdIDLen)
-    idlen = cmdIDLen - 1;
+  if (idlen >= cmdIDLen) {   // never truncate: a prefix could name another command
+    ESP_LOGW(TAG, "command name over %u chars rejected", (unsigned)(cmdIDLen - 1));
+    return false;
+  }
   for (size_t k = 0; k < idlen; ++k)
     cmdID[k] = (char)toupper((unsigned char)input[start + k]);
   cmdID[idlen] = '\0';
@@ -393,45 +676,63 @@ bool MQTTdispatcher::parseCommand(const char *input, size_t inputLen,
   return true;
 }
 
-void MQTTdispatcher::on_mqtt_connected(esp_mqtt_client_handle_t client) {
+void MQTTdispatcher::on_mqtt_connected(esp_mqtt_client_handle_t /*client*/) {
+  // Both are fixed for the device: formatted on the first connect only.
   static char topic_conn[64];
-  static char topic_info[64];
-  static bool built = false;
+  static char msg_conn[48];
+  static int msg_conn_len = 0;
 
-  if (!built) {
+  if (!msg_conn_len) {
     snprintf(topic_conn, sizeof topic_conn, "devices/connections/%s", s_mqtt_id);
-    snprintf(topic_info, sizeof topic_info, "devices/%s/diag", s_mqtt_id);
-    built = true;
+    int n = snprintf(msg_conn, sizeof msg_conn, "%s connects.", s_mqtt_id);
+    msg_conn_len = n > 0 ? n : 0;
   }
 
-     SemaphoreHandle_t mutex = get_disp_mutex();
-    xSemaphoreTake(mutex, portMAX_DELAY);
-    s_clHandle = client;
-    xSemaphoreGive(mutex);
-
-  char msg[96];
-  int n = snprintf(msg, sizeof msg, "%s connects.", s_mqtt_id);
-  if (n < 0)
-    n = 0;
-
-  esp_mqtt_client_publish(client, topic_conn, msg, n,
-                          ED_MQTT::MqttClient::MqttQoS::QOS1, true);
-  int sub_msg_id = esp_mqtt_client_subscribe(client, "cmd", 0);
-  ESP_LOGI(TAG, "Subscribed to 'cmd', msg_id=%d", sub_msg_id);
+  // Through the client wrapper: an unchanged retained notice is not
+  // rewritten on a resumed session.
+  if (s_mqtt)
+    s_mqtt->publishWithId(topic_conn, msg_conn, msg_conn_len,
+                          ED_MQTT::MqttClient::MqttQoS::QOS1, true, nullptr);
+  // The retained diag keyframe is built by the info publisher, off the MQTT
+  // event task, right after this callback returns.
+  requestKeyframe();
+
+  // Boot timeline: sent after the first command, or after the grace period.
+  if (!s_boot_reported && s_boot_timer)
+    xTimerStart(s_boot_timer, 0);
+}
 
-  static char info_buf[JSON_BUFFER_SIZE];
-  build_ping_json(info_buf, sizeof info_buf);
-  esp_mqtt_client_publish(client, topic_info, info_buf, strlen(info_buf),
-                          ED_MQTT::MqttClient::MqttQoS::QOS1, true);
+// Unfiltered callbacks run before routed ones: flows waiting in
+// nextMessage() see every message, commands included, first.
+void MQTTdispatcher::on_mqtt_message(esp_mqtt_client_handle_t /*client*/,
+                                     const char *topic, int topicLen,
+                                     const char *data, size_t dataLen,
+                                     uint32_t /*msgID*/) {
+    CmdFlowScheduler::notifyMessage(topic, topicLen, data, dataLen);
 }
 
 void MQTTdispatcher::on_mqtt_data(esp_mqtt_client_handle_t /*client*/,
                                   const char *topic, int topicLen,
                                   const char *data, size_t dataLen,
                                   uint32_t msgID) {
+    ED_MQTT::AllocScope allocScope("disp.cmd", ED_MQTT::AllocScope::HOT);
     ESP_LOGD(TAG, "MQTT data received: topic=%.*s, data=%.*s", topicLen, topic,
              (int)dataLen, data);
 
+    // Remember MQTT5 reply routing before any handler can ack.
+    const ED_MQTT::RequestContext &req = ED_MQTT::MqttClient::currentRequest();
+    if (req.responseTopic[0])
+        rememberRequest(msgID, req);
+
+    // Marks the boot timeline once this command has been handled, whatever
+    // path below returns.
+    struct FirstCommandMark {
+        ~FirstCommandMark() {
+            if (ED_MQTT::BootTimeline::mark(ED_MQTT::BootTimeline::FIRST_COMMAND))
+                notifyInfo(INFO_NOTIFY_BOOT);
+        }
+    } firstCommandMark;
+
     char cmdID[CMD_ID_LEN];
     char payload_buf[256];
 
@@ -471,73 +772,215 @@ if (strcmp(cmdID, "HELP") == 0 || strcmp(cmdID, "H") == 0) {
         }
     }
 
-    esp_mqtt_client_publish(s_clHandle, "help/response", helpBuf, strlen(helpBuf), 0, 0);
+    if (s_mqtt) {
+        s_mqtt->publishWithId("help/response", helpBuf, 0, 0, false, nullptr);
+    }
     return;
 }
 
+        // ── CANCEL command: stop running coroutine flows of a command ──
+        if (strcmp(cmdID, "CANCEL") == 0) {
+            char target[CMD_ID_LEN] = {0};
+            sscanf(payload_buf, "%15s", target);
+            for (char *c = target; *c; ++c) *c = (char)toupper((unsigned char)*c);
+            uint8_t n = target[0] ? CmdFlowScheduler::cancel(target) : 0;
+            if (s_mqtt) {
+                char ack_msg[64];
+                snprintf(ack_msg, sizeof(ack_msg), "Cancelled %u flow(s) of %s",
+                         n, target[0] ? target : "?");
+                s_mqtt->publishWithId("ack", ack_msg, 0, 0, false, nullptr);
+            }
+            return;
+        }
+
+        // ── MEM command: static RAM used by each table ─────────────
+        if (strcmp(cmdID, "MEM") == 0) {
+            static char memBuf[MEM_REPORT_LEN];
+            size_t n = memoryReport(memBuf, sizeof memBuf);
+            ESP_LOGI(TAG, "static memory budget:\n%s", memBuf);
+            if (s_mqtt) {
+                s_mqtt->publishWithId("mem/response", memBuf, (int)n, 0, false, nullptr);
+            }
+            return;
+        }
+
+        // ── ALLOC command: heap allocation audit report ────────────
+        if (strcmp(cmdID, "ALLOC") == 0) {
+            static char allocBuf[ED_MQTT::AllocAudit::enabled() ? ALLOC_REPORT_LEN : 160];
+            ED_MQTT::JsonWriter w(allocBuf, sizeof allocBuf);
+            size_t n = ED_MQTT::AllocAudit::writeReport(w);
+            if (n == 0) {
+                ESP_LOGW(TAG, "ALLOC: report exceeds %u bytes", (unsigned)sizeof allocBuf);
+            } else if (s_mqtt) {
+                ED_MQTT::PublishOptions opts;
+                opts.contentType = ED_MQTT::contentType(ED_MQTT::Encoding::JSON);
+                s_mqtt->publishWithId("alloc/response", allocBuf, (int)n, 0, false, &opts);
+            }
+            return;
+        }
+
+        // ── PROF command: hook execution times ─────────────────────
+        // ":PROF" publishes the table, ":PROF RESET" clears the counters,
+        // ":PROF <hook> <us>" sets a budget (0: back to the default).
+        if (strcmp(cmdID, "PROF") == 0) {
+            char hook[ED_MQTT::HOOK_NAME_LEN] = {0};
+            unsigned long us = 0;
+            int n = sscanf(payload_buf, "%23s %lu", hook, &us);
+            if (n == 2) {
+                if (!ED_MQTT::HookProfiler::setBudget(hook, (uint32_t)us))
+                    ESP_LOGW(TAG, "PROF: no hook named '%s'", hook);
+                return;
+            }
+            if (n == 1 && strcmp(hook, "RESET") == 0) {
+                ED_MQTT::HookProfiler::reset();
+                return;
+            }
+            static char profBuf[PROF_REPORT_LEN];
+            ED_MQTT::JsonWriter w(profBuf, sizeof profBuf);
+            size_t len = ED_MQTT::HookProfiler::writeReport(w);
+            if (len == 0) {
+                ESP_LOGW(TAG, "PROF: report exceeds %u bytes", (unsigned)sizeof profBuf);
+            } else if (s_mqtt) {
+                ED_MQTT::PublishOptions opts;
+                opts.contentType = ED_MQTT::contentType(ED_MQTT::Encoding::JSON);
+                s_mqtt->publishWithId("prof/response", profBuf, (int)len, 0, false, &opts);
+            }
+            return;
+        }
+
+        // ── LOG command: log stream filter ─────────────────────────
+        // ":LOG <level>" sets the global level, ":LOG <tag> <level>" the
+        // level of one tag, ":LOG <tag> -" drops the tag rule. The status
+        // goes to log/response in every case.
+        if (strcmp(cmdID, "LOG") == 0) {
+            char arg1[ED_MQTT::LOG_TAG_LEN] = {0};
+            char arg2[8] = {0};
+            int n = sscanf(payload_buf, "%15s %7s", arg1, arg2);
+            esp_log_level_t level;
+            bool ok = true;
+            if (n == 1) {
+                ok = ED_MQTT::LogStream::parseLevel(arg1, level);
+                if (ok)
+                    ED_MQTT::LogStream::setLevel(level);
+            } else if (n == 2 && strcmp(arg2, "-") == 0)
+                ok = ED_MQTT::LogStream::clearTagLevel(arg1);
+            else if (n == 2)
+                ok = ED_MQTT::LogStream::parseLevel(arg2, level) &&
+                     ED_MQTT::LogStream::setTagLevel(arg1, level);
+            if (!ok)
+                ESP_LOGW(TAG, "LOG: usage ':LOG [<tag>] NONE|E|W|I|D|V' or ':LOG <tag> -'");
+            char logBuf[256];
+            ED_MQTT::JsonWriter w(logBuf, sizeof logBuf);
+            size_t len = ED_MQTT::LogStream::writeStatus(w);
+            if (len && s_mqtt) {
+                ED_MQTT::PublishOptions opts;
+                opts.contentType = ED_MQTT::contentType(ED_MQTT::Encoding::JSON);
+                s_mqtt->publishWithId("log/response", logBuf, (int)len, 0, false, &opts);
+            }
+            return;
+        }
+
+        // ── ENC command: per-topic payload encoding ────────────────
+        // ":ENC <filter> JSON|CBOR" sets the encoding, ":ENC <filter>
+        // LZSS|PLAIN" turns compression on or off (ED_mqtt.h).
+        if (strcmp(cmdID, "ENC") == 0) {
+            char filter[TOPIC_FILTER_LEN] = {0};
+            char name[8] = {0};
+            sscanf(payload_buf, "%63s %7s", filter, name);
+            ED_MQTT::Encoding enc;
+            bool ok;
+            if (strcmp(name, "LZSS") == 0 || strcmp(name, "PLAIN") == 0)
+                ok = ED_MQTT::MqttClient::setTopicCompression(filter, name[0] == 'L');
+            else
+                ok = ED_MQTT::parseEncoding(name, enc) && setTopicEncoding(filter, enc);
+            if (!ok)
+                ESP_LOGW(TAG, "ENC: usage ':ENC <filter> JSON|CBOR|LZSS|PLAIN'");
+            return;
+        }
+
+        // ── HIST command: past diag snapshots, chunked ─────────────
+        // ":HIST [from [to]]", both in seconds ago; no argument: everything.
+        if (strcmp(cmdID, "HIST") == 0) {
+            unsigned long from = 0, to = 0;
+            int n = sscanf(payload_buf, "%lu %lu", &from, &to);
+            uint32_t now = DiagHistory::uptimeS();
+            uint32_t fromS = 0, toS = now;
+            if (n >= 1)
+                fromS = from < now ? now - (uint32_t)from : 0;
+            if (n >= 2)
+                toS = to < now ? now - (uint32_t)to : 0;
+            uint16_t sent = DiagHistory::exportRange(fromS, toS, publishHistoryChunk,
+                                                     nullptr);
+            ESP_LOGI(TAG, "HIST: %u snapshot(s) from %lus to %lus uptime", sent,
+                     (unsigned long)fromS, (unsigned long)toS);
+            return;
+        }
+
+        // ── HISTRATE command: history sampling period ──────────────
+        if (strcmp(cmdID, "HISTRATE") == 0) {
+            bool disable = false;
+            uint32_t ms = 0;
+            if (!parse_period(payload_buf, ms, disable)) {
+                ESP_LOGW(TAG, "HISTRATE: Invalid argument '%s'", payload_buf);
+                return;
+            }
+            setHistoryInterval(disable ? 0 : ms);
+            return;
+        }
+
+        // ── JOIN / LEAVE commands: command groups ──────────────────
+        if (strcmp(cmdID, "JOIN") == 0 || strcmp(cmdID, "LEAVE") == 0) {
+            char group[CMD_GROUP_LEN] = {0};
+            sscanf(payload_buf, "%23s", group);
+            const bool join = cmdID[0] == 'J';
+            bool ok = join ? joinGroup(group) : leaveGroup(group);
+            if (s_mqtt) {
+                char ack_msg[64];
+                snprintf(ack_msg, sizeof(ack_msg), "%s %s: %s", cmdID,
+                         group[0] ? group : "?", ok ? "OK" : "FAIL");
+                s_mqtt->publishWithId("ack", ack_msg, 0, 0, false, nullptr);
+            }
+            return;
+        }
+
+        // ── KEYFRAME command: full diag message on the next tick ───
+        if (strcmp(cmdID, "KEYFRAME") == 0) {
+            requestKeyframe();
+            return;
+        }
+
         // ── PFREQ command: configure periodic ping interval ────────
         if (strcmp(cmdID, "PFREQ") == 0) {
-            const char *arg = payload_buf;
-            while (*arg && isspace((unsigned char)*arg)) ++arg;
-
             bool disable = false;
+            uint32_t new_period_ms = 0;
             TickType_t new_period_ticks = 0;
-
-            if (*arg == 'D' || *arg == 'd') {
-                disable = true;
-            } else {
-                int number = 0;
-                if (sscanf(arg, "%d", &number) == 1) {
-                    if (number == 0) {
-                        disable = true;
-                    } else {
-                        // move past digits
-                        while (*arg && isdigit((unsigned char)*arg)) ++arg;
-                        unsigned long multiplier = 1;   // default = seconds
-                        char ch = *arg;
-                        if (ch == 's' || ch == 'S') {
-                            ++arg;
-                        } else if (ch == 'm' || ch == 'M') {
-                            multiplier = 60;
-                            ++arg;
-                        } else if (ch == 'h' || ch == 'H') {
-                            multiplier = 3600;
-                            ++arg;
-                        } else if (ch == 'd' || ch == 'D') {
-                            multiplier = 86400;
-                            ++arg;
-                        }
-                        unsigned long total_sec = (unsigned long)number * multiplier;
-                        new_period_ticks = pdMS_TO_TICKS(total_sec * 1000);
-                    }
-                } else {
-                    ESP_LOGW(TAG, "PFREQ: Invalid argument '%s'", arg);
-                    return;
-                }
+            if (!parse_period(payload_buf, new_period_ms, disable) ||
+                (!disable && !period_ticks(new_period_ms, new_period_ticks))) {
+                ESP_LOGW(TAG, "PFREQ: Invalid argument '%s'", payload_buf);
+                return;
             }
 
             if (s_info_timer) {
                 if (disable) {
                     if (xTimerStop(s_info_timer, 0) == pdPASS) {
                         ESP_LOGI(TAG, "PFREQ: Periodic ping disabled");
-                        if (s_clHandle) {
-                            esp_mqtt_client_publish(s_clHandle, "ack", "Ping disabled", 0, 0, 0);
-                        }
+                        if (s_mqtt)
+                            s_mqtt->publishWithId("ack", "Ping disabled", 0, 0, false, nullptr);
                     } else {
                         ESP_LOGE(TAG, "PFREQ: Failed to stop timer");
                     }
                 } else {
                     if (xTimerChangePeriod(s_info_timer, new_period_ticks, 0) == pdPASS) {
                         ESP_LOGI(TAG, "PFREQ: Ping interval changed to %lu ms",
-                                 (unsigned long)(new_period_ticks * portTICK_PERIOD_MS));
+                                 (unsigned long)new_period_ms);
                         // ensure timer is running
                         xTimerStart(s_info_timer, 0);
-                        if (s_clHandle) {
+                        if (s_mqtt) {
                             char ack_msg[64];
                             snprintf(ack_msg, sizeof(ack_msg),
                                      "Ping interval set to %lu ms",
-                                     (unsigned long)(new_period_ticks * portTICK_PERIOD_MS));
-                            esp_mqtt_client_publish(s_clHandle, "ack", ack_msg, 0, 0, 0);
+                                     (unsigned long)new_period_ms);
+                            s_mqtt->publishWithId("ack", ack_msg, 0, 0, false, nullptr);
                         }
                     } else {
                         ESP_LOGE(TAG, "PFREQ: Failed to change timer period");
@@ -550,189 +993,746 @@ if (strcmp(cmdID, "HELP") == 0 || strcmp(cmdID, "H") == 0) {
         }
 
         // Normal colon command – dispatch to subscribers
-        ESP_LOGD(TAG, "Subscriber count: %d", s_subscriber_count);
-        for (uint8_t i = 0; i < s_subscriber_count; ++i) {
-            if (s_subscribers[i]) {
-                ESP_LOGD(TAG, "Dispatching to subscriber %d", i);
-                s_subscribers[i]->grabCommand(cmdID, payload_buf, strlen(payload_buf),
-                                              msgID);
-            } else {
-                ESP_LOGD(TAG, "Subscriber %d is NULL", i);
-            }
-        }
-        if (s_subscriber_count == 0) {
-            ESP_LOGW(TAG, "No subscribers registered - command ignored");
-        }
+        if (!beginCommand(msgID, topic, topicLen, data, dataLen))
+            return;
+        dispatchToSubscribers(cmdID, payload_buf, strlen(payload_buf), msgID);
+        endCommand();
         return;
     } else {
         ESP_LOGW(TAG, "❌ Failed to parse as colon command (does it start with ':'?)");
+        if (dataLen > 0 && data[0] == ':')
+            return;   // malformed colon command, not JSON either
     }
 
     // Try JSON format
+    if (!beginCommand(msgID, topic, topicLen, data, dataLen))
+        return;
     handleCommandObject(data, dataLen, msgID);
+    endCommand();
+}
+
+// QoS redelivery: never run a command twice, re-ack it from the cache.
+bool MQTTdispatcher::beginCommand(uint32_t msgID, const char *topic, int topicLen,
+                                  const char *data, size_t dataLen) {
+    static char dupReply[DEDUP_REPLY_LEN];
+    const ED_MQTT::RequestContext &req = ED_MQTT::MqttClient::currentRequest();
+    uint32_t ticket = 0;
+    switch (CommandDedupCache::check(req, msgID, topic, topicLen, data, dataLen,
+                                     dupReply, sizeof dupReply, ticket)) {
+    case CommandDedupCache::Lookup::RUNNING:
+        return false;
+    case CommandDedupCache::Lookup::DONE:
+        if (!dupReply[0])
+            snprintf(dupReply, sizeof dupReply,
+                     "{\"msgID\":%lu,\"status\":\"DUPLICATE\"}", (unsigned long)msgID);
+        sendResponse(msgID, dupReply);
+        return false;
+    case CommandDedupCache::Lookup::NEW:
+        break;
+    }
+    s_dedup_ticket = ticket;
+    s_dedup_task = xTaskGetCurrentTaskHandle();
+    return true;
+}
+
+void MQTTdispatcher::endCommand() {
+    // Handler returned without acking (or acks from elsewhere): the command
+    // ran, duplicates get the short notice.
+    CommandDedupCache::complete(s_dedup_ticket, nullptr);
+    s_dedup_ticket = 0;
+    s_dedup_task = nullptr;
+}
+
+// Ticket of the command being dispatched by this task, taken so it is
+// completed once.
+uint32_t MQTTdispatcher::takeDedupTicket() {
+    if (s_dedup_task != xTaskGetCurrentTaskHandle())
+        return 0;
+    uint32_t ticket = s_dedup_ticket;
+    s_dedup_ticket = 0;
+    return ticket;
 }
 
-void MQTTdispatcher::handleCommandObject(const char *json, size_t /*jsonLen*/,
+uint32_t MQTTdispatcher::handOffDedupTicket() {
+    if (s_batch_task && s_batch_task == xTaskGetCurrentTaskHandle())
+        return 0;
+    return takeDedupTicket();
+}
+
+void MQTTdispatcher::on_mqtt_published(int msgID) {
+    CmdFlowScheduler::notifyPublished(msgID);
+}
+
+bool MQTTdispatcher::dispatchToSubscribers(const char *cmdID, const char *data,
+                                           size_t dataLen, uint32_t msgID) {
+  if (s_subscriber_count == 0) {
+    ESP_LOGW(TAG, "No subscribers registered - command ignored");
+    return false;
+  }
+  bool handled = false;
+  for (uint8_t i = 0; i < s_subscriber_count; ++i) {
+    if (s_subscribers[i] && s_subscribers[i]->handlesCommand(cmdID)) {
+      ESP_LOGD(TAG, "Dispatching '%s' to subscriber %d", cmdID, i);
+      s_subscribers[i]->grabCommand(cmdID, data, dataLen, msgID);
+      handled = true;
+    }
+  }
+  if (!handled)
+    ESP_LOGW(TAG, "Command '%s' not handled by any subscriber", cmdID);
+  return handled;
+}
+
+// Single object: dispatched as before, the handler acks on its own.
+// Array: every entry runs in order, ackCommand() calls made while an entry
+// executes are captured, and ONE aggregated ack is published at the end.
+void MQTTdispatcher::handleCommandObject(const char *json, size_t jsonLen,
                                          uint32_t cmdID) {
-  // ----- Step 1: try as single object with "cmd" and "data" -----
-  ED_S_JSON::StaticJson decoder(json);
-  if (decoder.isValid()) {
-    const char *cmd = decoder.getString("cmd");
-    const char *data = decoder.getString("data");
-    if (cmd && data) {
-      for (uint8_t i = 0; i < s_subscriber_count; ++i)
-        if (s_subscribers[i])
-          s_subscribers[i]->grabCommand(cmd, data, strlen(data), cmdID);
+  static char data_buf[CMD_DATA_LEN];
+  char cmd_buf[CMD_ID_LEN + 1];   // one spare char detects over-long names
+
+  JsonCmdTokenizer tok(json, jsonLen);
+  JsonCmdTokenizer::Entry e;
+  s_batch_count = 0;
+  s_batch_dropped = 0;
+
+  while (tok.next(e)) {
+    size_t cmd_len = JsonCmdTokenizer::unescape(e.cmd, e.cmdLen, cmd_buf, sizeof cmd_buf);
+    bool tooLong = cmd_len >= CMD_ID_LEN;
+    if (tooLong) {
+      ESP_LOGW(TAG, "command name over %u chars rejected", (unsigned)(CMD_ID_LEN - 1));
+      cmd_buf[CMD_ID_LEN - 1] = '\0';   // only for the batch ack row
+    }
+    size_t data_len = JsonCmdTokenizer::renderData(e, data_buf, sizeof data_buf);
+
+    if (!tok.isBatch()) {
+      if (!tooLong)
+        dispatchToSubscribers(cmd_buf, data_buf, data_len, cmdID);
       return;
     }
+
+    if (s_batch_count >= MAX_BATCH_CMDS) {
+      ++s_batch_dropped;
+      continue;
+    }
+    BatchResult &r = s_batch[s_batch_count];
+    strncpy(r.cmdID, cmd_buf, sizeof r.cmdID - 1);
+    r.cmdID[sizeof r.cmdID - 1] = '\0';
+    r.status = BatchStatus::NOACK;
+    if (tooLong) {
+      ++s_batch_count;
+      r.status = BatchStatus::UNKNOWN;
+      continue;
+    }
+
+    s_batch_cur = s_batch_count++;
+    s_batch_task = xTaskGetCurrentTaskHandle();
+    bool handled = dispatchToSubscribers(cmd_buf, data_buf, data_len, cmdID);
+    s_batch_task = nullptr;
+
+    if (!handled) {
+      r.status = BatchStatus::UNKNOWN;
+    } else if (r.status == BatchStatus::NOACK) {
+      const ctrlCommand *cmd = GlobalCommandRegistry::instance().findCommand(cmd_buf);
+      if (cmd && cmd->coroPointer)
+        r.status = BatchStatus::ASYNC;   // flow acks on its own later
+    }
   }
 
-  // ----- Step 2: try as array of objects { "cmd":..., "data":... } -----
-  const char *p = json;
-  while ((p = strstr(p, "\"cmd\"")) != nullptr) {
-    const char *cmd_start = strchr(p, ':');
-    if (!cmd_start) break;
-    cmd_start = strchr(cmd_start, '"');
-    if (!cmd_start) break;
-    cmd_start++;
-    const char *cmd_end = strchr(cmd_start, '"');
-    if (!cmd_end) break;
+  if (tok.failed())
+    ESP_LOGW(TAG, "JSON command payload malformed after %u entries", s_batch_count);
+  if (tok.isBatch())
+    publishBatchAck(cmdID, tok.failed());
+}
 
-    const char *data_start = strstr(cmd_end, "\"data\"");
-    if (!data_start) break;
-    data_start = strchr(data_start, ':');
-    if (!data_start) break;
-    data_start = strchr(data_start, '"');
-    if (!data_start) break;
-    data_start++;
-    const char *data_end = strchr(data_start, '"');
-    if (!data_end) break;
+void MQTTdispatcher::publishBatchAck(uint32_t msgID, bool parseError) {
+  static const char *const names[] = {"NOACK", "OK", "FAIL", "UNKNOWN", "ASYNC"};
+  static char buf[BATCH_ACK_LEN];
+
+  uint8_t okCount = 0;
+  for (uint8_t i = 0; i < s_batch_count; ++i)
+    if (s_batch[i].status == BatchStatus::OK) ++okCount;
+
+  size_t used = snprintf(buf, sizeof buf,
+                         "{\"msgID\":%lu,\"n\":%u,\"ok\":%u,\"dropped\":%u,"
+                         "\"parseError\":%s,\"res\":[",
+                         (unsigned long)msgID, s_batch_count, okCount,
+                         s_batch_dropped, parseError ? "true" : "false");
+  uint8_t written = 0;
+  for (; written < s_batch_count; ++written) {
+    const BatchResult &r = s_batch[written];
+    // Keep room for the closing tail below.
+    if (used + CMD_ID_LEN + 32 >= sizeof buf) break;
+    used += snprintf(buf + used, sizeof buf - used, "%s{\"cmd\":\"%s\",\"st\":\"%s\"}",
+                     written ? "," : "", r.cmdID, names[(uint8_t)r.status]);
+  }
+  snprintf(buf + used, sizeof buf - used, "],\"truncated\":%u}",
+           (unsigned)(s_batch_count - written));
 
-    char cmd_buf[CMD_ID_LEN];
-    size_t cmd_len = cmd_end - cmd_start;
-    if (cmd_len >= sizeof(cmd_buf)) cmd_len = sizeof(cmd_buf) - 1;
-    strncpy(cmd_buf, cmd_start, cmd_len);
-    cmd_buf[cmd_len] = '\0';
+  CommandDedupCache::complete(takeDedupTicket(), buf);
+  if (!sendResponse(msgID, buf))
+    ESP_LOGE(TAG, "batch ack publish failed");
+}
 
-    char data_buf[256];
-    size_t data_len = data_end - data_start;
-    if (data_len >= sizeof(data_buf)) data_len = sizeof(data_buf) - 1;
-    strncpy(data_buf, data_start, data_len);
-    data_buf[data_len] = '\0';
+void MQTTdispatcher::rememberRequest(uint32_t msgID,
+                                     const ED_MQTT::RequestContext &req) {
+  // A cut correlation would come back unmatched: reply on ack/<id> instead.
+  if (req.correlationTruncated) {
+    ESP_LOGW(TAG, "request %lu: correlation data over %u bytes, reply goes to the ack topic",
+             (unsigned long)msgID, (unsigned)ED_MQTT::MAX_CORRELATION_LEN);
+    return;
+  }
+  SemaphoreHandle_t mutex = get_disp_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  // Oldest slot is recycled when every slot is waiting for an ack.
+  PendingRequest &p = s_pending[s_pending_next];
+  s_pending_next = (uint8_t)((s_pending_next + 1) % MAX_PENDING_REQUESTS);
+  if (p.used) {
+    ++s_pending_evicted;
+    ESP_LOGW(TAG, "pending request %lu evicted without response (%lu so far, raise "
+                  "ED_MQTT_MAX_PENDING_REQUESTS)",
+             (unsigned long)p.msgID, (unsigned long)s_pending_evicted);
+  }
+  p.msgID = msgID;
+  p.used = true;
+  strncpy(p.responseTopic, req.responseTopic, sizeof p.responseTopic - 1);
+  p.responseTopic[sizeof p.responseTopic - 1] = '\0';
+  memcpy(p.correlation, req.correlation, req.correlationLen);
+  p.correlationLen = req.correlationLen;
+  xSemaphoreGive(mutex);
+}
 
-    for (uint8_t i = 0; i < s_subscriber_count; ++i) {
-      if (s_subscribers[i])
-        s_subscribers[i]->grabCommand(cmd_buf, data_buf, data_len, cmdID);
+bool MQTTdispatcher::takeRequest(uint32_t msgID, PendingRequest &out) {
+  bool found = false;
+  SemaphoreHandle_t mutex = get_disp_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < MAX_PENDING_REQUESTS; ++i) {
+    if (s_pending[i].used && s_pending[i].msgID == msgID) {
+      out = s_pending[i];
+      s_pending[i].used = false;
+      found = true;
+      break;
     }
+  }
+  xSemaphoreGive(mutex);
+  return found;
+}
 
-    p = data_end + 1;
-    while (*p && *p != ',' && *p != '}') ++p;
-    if (*p == ',') ++p;
+// Reply to the request's response topic (correlation echoed) if it had one,
+// otherwise to the legacy ack/<id> topic.
+bool MQTTdispatcher::sendResponse(uint32_t msgID, const char *payload) {
+  if (!s_mqtt) {
+    ESP_LOGW(TAG, "sendResponse: MQTT client not available");
+    return false;
+  }
+  PendingRequest req;
+  if (takeRequest(msgID, req)) {
+    ED_MQTT::PublishOptions opts;
+    opts.correlation = req.correlation;
+    opts.correlationLen = req.correlationLen;
+    opts.contentType = "application/json";
+    return s_mqtt->publishWithId(req.responseTopic, payload, 0, 1, false, &opts) >= 0;
+  }
+  return s_mqtt->publish(ackTopic(), payload, 1, false);
+}
+
+const char *MQTTdispatcher::ackTopic() {
+  static char topic_ack[64];
+  static bool built = false;
+  if (!built) {
+    snprintf(topic_ack, sizeof topic_ack, "ack/%s", s_mqtt_id);
+    built = true;
   }
+  return topic_ack;
 }
 
 void MQTTdispatcher::ackCommand(int64_t reqMsgID, const char *commandID,
                                 ackType ackResult, const char *originalCommand) {
-    if (!s_mqtt) {
-        ESP_LOGW(TAG, "ackCommand: MQTT client not available");
+    respondCommand(reqMsgID, commandID, ackResult, originalCommand, nullptr);
+}
+
+void MQTTdispatcher::respondCommand(int64_t reqMsgID, const char *commandID,
+                                    ackType ackResult, const char *originalCommand,
+                                    const char *resultJson) {
+    // Inside a batch: record the result for the aggregated ack instead.
+    if (s_batch_task && s_batch_task == xTaskGetCurrentTaskHandle()) {
+        s_batch[s_batch_cur].status =
+            ackResult == ackType::OK ? BatchStatus::OK : BatchStatus::FAIL;
         return;
     }
 
-    static char topic_ack[64];
-    static bool built = false;
-    if (!built) {
-        snprintf(topic_ack, sizeof topic_ack, "ack/%s", s_mqtt_id);
-        built = true;
+    if (!s_mqtt) {
+        ESP_LOGW(TAG, "ackCommand: MQTT client not available");
+        return;
     }
 
-    char ackbuf[256];
+    uint32_t msgID = (uint32_t)reqMsgID;
+    // Acked while dispatched, or later by the flow the command spawned.
+    uint32_t ticket = takeDedupTicket();
+    if (!ticket) ticket = CmdFlowScheduler::takeDedupTicket();
     const char *display = (originalCommand && originalCommand[0]) ? originalCommand : commandID;
-    int n = snprintf(ackbuf, sizeof ackbuf, "[%s] %s",
-                     display ? display : "?",
-                     ackResult == ackType::OK ? "OK" : "FAIL");
-    if (n < 0) n = 0;
-    if (n >= (int)sizeof ackbuf) n = (int)sizeof ackbuf - 1;
+    const char *status = ackResult == ackType::OK ? "OK" : "FAIL";
+    bool ok;
+
+    PendingRequest req;
+    if (takeRequest(msgID, req)) {
+        char resbuf[512];
+        char esc[PARAM_VAL_LEN * 2];
+        size_t n = snprintf(resbuf, sizeof resbuf,
+                            "{\"msgID\":%lu,\"cmd\":\"%s\",\"status\":\"%s\",\"original\":\"",
+                            (unsigned long)msgID, commandID ? commandID : "?", status);
+        json_escape(esc, sizeof esc, display);
+        n += snprintf(resbuf + n, sizeof resbuf - n, "%s\",\"result\":%s}", esc,
+                      (resultJson && resultJson[0]) ? resultJson : "null");
+        if (n >= sizeof resbuf) {
+            ESP_LOGW(TAG, "response for %s truncated, result dropped", commandID);
+            snprintf(resbuf, sizeof resbuf,
+                     "{\"msgID\":%lu,\"cmd\":\"%s\",\"status\":\"%s\",\"result\":null}",
+                     (unsigned long)msgID, commandID ? commandID : "?", status);
+        }
 
-    bool ok = s_mqtt->publish(topic_ack, ackbuf, 1, false);   // QoS1, not retained
+        CommandDedupCache::complete(ticket, resbuf);
+        ED_MQTT::PublishOptions opts;
+        opts.correlation = req.correlation;
+        opts.correlationLen = req.correlationLen;
+        opts.contentType = "application/json";
+        ok = s_mqtt->publishWithId(req.responseTopic, resbuf, 0, 1, false, &opts) >= 0;
+    } else {
+        char ackbuf[256];
+        int n = snprintf(ackbuf, sizeof ackbuf, "[%s] %s",
+                         display ? display : "?", status);
+        if (n < 0) n = 0;
+        if (n >= (int)sizeof ackbuf) n = (int)sizeof ackbuf - 1;
+        CommandDedupCache::complete(ticket, ackbuf);
+        ok = s_mqtt->publish(ackTopic(), ackbuf, 1, false);   // QoS1, not retained
+    }
     if (!ok) {
         ESP_LOGE(TAG, "ackCommand publish failed");
     }
 }
 
-void MQTTdispatcher::build_ping_json(char *buf, size_t len) {
-    ED_S_JSON::StaticJson doc;
+const char *MQTTdispatcher::diagTopic() {
+  static char topic_info[64];
+  if (!topic_info[0])
+    snprintf(topic_info, sizeof topic_info, "devices/%s/diag", s_mqtt_id);
+  return topic_info;
+}
+
+const char *MQTTdispatcher::diagDeltaTopic() {
+  static char topic_delta[72];
+  if (!topic_delta[0])
+    snprintf(topic_delta, sizeof topic_delta, "devices/%s/diag/delta", s_mqtt_id);
+  return topic_delta;
+}
+
+const char *MQTTdispatcher::historyTopic() {
+  static char topic_hist[72];
+  if (!topic_hist[0])
+    snprintf(topic_hist, sizeof topic_hist, "devices/%s/diag/history", s_mqtt_id);
+  return topic_hist;
+}
 
-    // Root object
+static uint32_t fragment_hash(const uint8_t *s, size_t n) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < n; ++i) {
+    h ^= s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+bool MQTTdispatcher::providerStale(const ProviderSlot &p, TickType_t now,
+                                   ED_MQTT::Encoding enc) {
+  return !p.valid || p.fragEnc != enc || p.refreshMs == 0 ||
+         (TickType_t)(now - p.lastRun) >= pdMS_TO_TICKS(p.refreshMs);
+}
+
+// Run one provider and cache its object in the requested encoding.
+void MQTTdispatcher::refreshProvider(ProviderSlot &p, TickType_t now,
+                                     ED_MQTT::Encoding enc) {
+  uint8_t frag[DIAG_FRAGMENT_LEN];
+  size_t n = 0;
+  bool fits;
+
+  ED_MQTT::HookTimer timed(p.hook);
+  if (p.fieldFn) {
+    if (enc == ED_MQTT::Encoding::CBOR) {
+      ED_MQTT::CborWriter w(frag, sizeof frag);
+      w.beginObject();
+      p.fieldFn(w);
+      w.endObject();
+      fits = !w.overflow();
+      n = w.length();
+    } else {
+      ED_MQTT::JsonWriter w(reinterpret_cast<char *>(frag), sizeof frag);
+      w.beginObject();
+      p.fieldFn(w);
+      w.endObject();
+      fits = !w.overflow();
+      n = w.length();
+    }
+  } else {
+    ED_S_JSON::StaticJson doc;
     doc.beginObject();
+    p.fn(doc);
+    doc.endObject();
+    const char *json = doc.toString();
+    size_t jlen = strlen(json);
+    if (enc == ED_MQTT::Encoding::CBOR) {
+      // Legacy providers only speak JSON: embed it as a CBOR text string.
+      ED_MQTT::CborWriter w(frag, sizeof frag);
+      w.text(json, jlen);
+      fits = !w.overflow();
+      n = w.length();
+    } else {
+      fits = jlen < sizeof frag;
+      if (fits)
+        memcpy(frag, json, jlen);
+      n = jlen;
+    }
+  }
 
-    // Core fields
-    doc.addString("dDGT", "DTF");
-    doc.addString("dS", "N");
-    doc.addString("d_UPT", ED_SYS::ESP_std::Runtime::uptime());
+  p.lastRun = now;
+  if (!fits) {
+    ESP_LOGW(TAG, "provider %s output > %u bytes, keeping last",
+             p.name ? p.name : "?", (unsigned)sizeof frag);
+    if (!p.valid || p.fragEnc != enc) {
+      // Empty object in the requested encoding.
+      if (enc == ED_MQTT::Encoding::CBOR) {
+        p.frag[0] = 0xBF;
+        p.frag[1] = 0xFF;
+      } else {
+        memcpy(p.frag, "{}", 2);
+      }
+      p.fragLen = 2;
+      p.fragEnc = enc;
+      p.valid = true;
+    }
+    return;
+  }
+  memcpy(p.frag, frag, n);
+  p.fragLen = (uint16_t)n;
+  p.fragEnc = enc;
+  p.valid = true;
+}
 
-    // Diagnostics array
-    doc.beginArray("diagnostics");
+// Re-run the providers whose cached fragment expired. Caller holds the diag
+// mutex.
+void MQTTdispatcher::refreshStaleProviders(ED_MQTT::Encoding enc) {
+  TickType_t now = xTaskGetTickCount();
+  bool expensiveRan = false;
+  for (uint8_t i = 0; i < s_json_provider_count; ++i) {
+    ProviderSlot &p = s_json_providers[i];
+    if (!providerStale(p, now, enc))
+      continue;
+    // A cached EXPENSIVE provider waits for a tick no other one used.
+    if (p.valid && p.fragEnc == enc && p.cost == ProviderCost::EXPENSIVE) {
+      if (expensiveRan)
+        continue;
+      expensiveRan = true;
+    }
+    refreshProvider(p, now, enc);
+  }
+}
 
-    // Call each registered provider – each adds one object to the array
-    for (uint8_t i = 0; i < s_json_provider_count; ++i) {
-        if (s_json_providers[i]) {
-            // Start an anonymous object inside the array
-            doc.beginObject();
-            // Provider adds its fields to this object
-            s_json_providers[i](doc);
-            // Close the object
-            doc.endObject();
-        }
+// Assemble the diag message from the cached provider fragments, re-running
+// only the stale providers. A keyframe carries every provider; a delta only
+// those whose fragment changed since it was last published, with their
+// registration index in "idx". Caller holds the diag mutex.
+size_t MQTTdispatcher::build_ping_json(ED_MQTT::FieldWriter &w, bool keyframe) {
+  const ED_MQTT::Encoding enc = w.encoding();
+  refreshStaleProviders(enc);
+
+  uint8_t idx[MAX_JSON_PROVIDERS];
+  uint8_t idxCount = 0;
+  for (uint8_t i = 0; i < s_json_provider_count; ++i) {
+    const ProviderSlot &p = s_json_providers[i];
+    if (!p.valid || p.fragEnc != enc)
+      continue;
+    if (keyframe || fragment_hash(p.frag, p.fragLen) != p.sentHash)
+      idx[idxCount++] = i;
+  }
+  const bool metrics = MetricAggregator::pending();
+  if (!keyframe && idxCount == 0 && !metrics)
+    return 0;
+
+  w.beginObject();
+  if (s_diag_delta) {   // delta bookkeeping only when consumers need it
+    w.addInt("seq", (int64_t)s_diag_seq + 1);
+    w.addInt("kf", keyframe ? 1 : 0);
+  }
+  w.addString("dDGT", "DTF");
+  w.addString("dS", "N");
+  w.addString("d_UPT", ED_SYS::ESP_std::Runtime::uptime());
+  if (keyframe) {
+    if (uint8_t refused = ED_MQTT::MqttClient::subscriptionFailures())
+      w.addInt("d_SUBF", refused);
+  }
+  w.beginArray("diagnostics");
+
+  // Room kept for the idx list (≤ 4 bytes per entry) and the closing bytes.
+  const size_t tail = 3 + (keyframe ? 0 : 8 + 4 * (size_t)idxCount);
+  uint8_t sent = 0;
+  for (uint8_t k = 0; k < idxCount; ++k) {
+    ProviderSlot &p = s_json_providers[idx[k]];
+    if (p.fragLen + 1 + tail > w.remaining()) {
+      ESP_LOGW(TAG, "diag message full, %s omitted", p.name ? p.name : "?");
+      continue;
     }
+    w.raw(p.frag, p.fragLen);
+    p.sentHash = fragment_hash(p.frag, p.fragLen);
+    idx[sent++] = idx[k];
+  }
+  w.endArray();
+  if (metrics || keyframe)
+    MetricAggregator::writeFields(w);   // closes the aggregation window
+  if (!keyframe) {
+    w.beginArray("idx");
+    for (uint8_t k = 0; k < sent; ++k)
+      w.addInt(nullptr, idx[k]);
+    w.endArray();
+  }
+  w.endObject();
+  if (w.overflow()) {
+    ESP_LOGE(TAG, "diag message overflow");
+    return 0;
+  }
 
-    doc.endArray();   // end diagnostics array
-    doc.endObject();  // end root object
+  if (s_diag_delta)
+    ++s_diag_seq;
+  if (keyframe)
+    s_diag_since_key = 0;
+  else
+    ++s_diag_since_key;
+  return w.length();
+}
 
-    // Copy the generated JSON to the output buffer
-    const char* json_str = doc.toString();
-    size_t needed = strlen(json_str) + 1;
+// Encode the diag message into s_diag_buf. Caller holds the diag mutex.
+size_t MQTTdispatcher::build_diag(bool keyframe, ED_MQTT::Encoding enc) {
+  if (enc == ED_MQTT::Encoding::CBOR) {
+    ED_MQTT::CborWriter w(reinterpret_cast<uint8_t *>(s_diag_buf), sizeof s_diag_buf);
+    return build_ping_json(w, keyframe);
+  }
+  ED_MQTT::JsonWriter w(s_diag_buf, sizeof s_diag_buf);
+  return build_ping_json(w, keyframe);
+}
 
-    if (needed <= len) {
-        memcpy(buf, json_str, needed);
-    } else {
-        // Truncate safely if output buffer is too small (should not happen)
-        strncpy(buf, json_str, len - 1);
-        buf[len - 1] = '\0';
-        ESP_LOGW(TAG, "build_ping_json truncated (%zu > %zu)", needed - 1, len - 1);
+bool MQTTdispatcher::setTopicEncoding(const char *filter, ED_MQTT::Encoding enc) {
+  if (!filter || !filter[0] || strlen(filter) >= TOPIC_FILTER_LEN)
+    return false;
+  SemaphoreHandle_t mutex = get_disp_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  TopicEncoding *slot = nullptr;
+  for (uint8_t i = 0; i < s_topic_enc_count; ++i)
+    if (strcmp(s_topic_enc[i].filter, filter) == 0)
+      slot = &s_topic_enc[i];
+  if (!slot && s_topic_enc_count < MAX_TOPIC_ENCODINGS) {
+    slot = &s_topic_enc[s_topic_enc_count++];
+    strcpy(slot->filter, filter);
+  }
+  if (slot)
+    slot->enc = enc;
+  xSemaphoreGive(mutex);
+  if (!slot) {
+    ESP_LOGE(TAG, "topic encoding table full (max %d)", MAX_TOPIC_ENCODINGS);
+    return false;
+  }
+  ESP_LOGI(TAG, "%s encoded as %s", filter, ED_MQTT::contentType(enc));
+  requestKeyframe();   // consumers need a full message in the new encoding
+  return true;
+}
+
+ED_MQTT::Encoding MQTTdispatcher::encodingFor(const char *topic) {
+  ED_MQTT::Encoding enc = ED_MQTT::Encoding::JSON;
+  SemaphoreHandle_t mutex = get_disp_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < s_topic_enc_count; ++i)
+    if (ED_MQTT::TopicRouter::matches(s_topic_enc[i].filter, topic,
+                                      (int)strlen(topic))) {
+      enc = s_topic_enc[i].enc;
+      break;
     }
+  xSemaphoreGive(mutex);
+  return enc;
+}
+
+void MQTTdispatcher::setDiagDelta(bool enabled, uint16_t keyframeEvery) {
+  SemaphoreHandle_t diag = get_diag_mutex();
+  xSemaphoreTake(diag, portMAX_DELAY);
+  s_diag_delta = enabled;
+  s_diag_keyframe_every = keyframeEvery ? keyframeEvery : 1;
+  xSemaphoreGive(diag);
+  requestKeyframe();
+}
+
+void MQTTdispatcher::requestKeyframe() {
+  s_diag_key_requested = true;
+  notifyInfo(INFO_NOTIFY_PUBLISH);
 }
 
 void MQTTdispatcher::T_info_timer_callback(TimerHandle_t /*handle*/) {
-  if (s_info_task_handle)
-    xTaskNotifyGive(s_info_task_handle);
+  notifyInfo(INFO_NOTIFY_PUBLISH);
+}
+
+void MQTTdispatcher::T_hist_timer_callback(TimerHandle_t /*handle*/) {
+  notifyInfo(INFO_NOTIFY_HISTORY);
 }
 
-void MQTTdispatcher::info_publisher_task(void *) {
-  for (;;) {
-    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+// Requests are coalesced: while a job is queued, more bits only join it, so a
+// slow publish never piles up jobs on the supervisor queue.
+void MQTTdispatcher::notifyInfo(uint32_t bits) {
+  taskENTER_CRITICAL(&s_info_mux);
+  const bool queued = s_info_pending != 0;
+  s_info_pending |= bits;
+  taskEXIT_CRITICAL(&s_info_mux);
+  if (queued || ED_MQTT::Supervisor::post(info_job))
+    return;
+  taskENTER_CRITICAL(&s_info_mux);   // not queued: the next request retries
+  s_info_pending = 0;
+  taskEXIT_CRITICAL(&s_info_mux);
+}
+
+void MQTTdispatcher::info_job(uint32_t /*arg*/) {
+  ED_MQTT::AllocScope allocScope("disp.diag", ED_MQTT::AllocScope::HOT);
+  taskENTER_CRITICAL(&s_info_mux);
+  const uint32_t bits = s_info_pending;
+  s_info_pending = 0;
+  taskEXIT_CRITICAL(&s_info_mux);
+  if (bits & INFO_NOTIFY_HISTORY)
+    recordHistory();
+  if (bits & INFO_NOTIFY_PUBLISH)
     publishInfo();
+  if (bits & INFO_NOTIFY_BOOT)
+    publishBootReport();
+}
+
+// Snapshot every provider into the history ring. Same encoding as the diag
+// topic, so the fragment cache is shared with the publisher. Runs while
+// disconnected too: that is when history matters.
+void MQTTdispatcher::recordHistory() {
+  SemaphoreHandle_t diag = get_diag_mutex();
+  xSemaphoreTake(diag, portMAX_DELAY);
+  const ED_MQTT::Encoding enc = encodingFor(diagTopic());
+  refreshStaleProviders(enc);
+
+  auto build = [](ED_MQTT::FieldWriter &w) {
+    w.beginObject();
+    w.addString("d_UPT", ED_SYS::ESP_std::Runtime::uptime());
+    w.beginArray("diagnostics");
+    for (uint8_t i = 0; i < s_json_provider_count; ++i) {
+      const ProviderSlot &p = s_json_providers[i];
+      if (p.valid && p.fragEnc == w.encoding())
+        w.raw(p.frag, p.fragLen);
+    }
+    w.endArray();
+    w.endObject();
+    return w.overflow() ? (size_t)0 : w.length();
+  };
+  size_t len;
+  if (enc == ED_MQTT::Encoding::CBOR) {
+    ED_MQTT::CborWriter w(reinterpret_cast<uint8_t *>(s_diag_buf), sizeof s_diag_buf);
+    len = build(w);
+  } else {
+    ED_MQTT::JsonWriter w(s_diag_buf, sizeof s_diag_buf);
+    len = build(w);
   }
+  if (len > 0)
+    DiagHistory::record(reinterpret_cast<const uint8_t *>(s_diag_buf), len, enc);
+  else
+    ESP_LOGW(TAG, "history snapshot overflow");
+  xSemaphoreGive(diag);
 }
 
-void MQTTdispatcher::publishInfo() {
-    SemaphoreHandle_t mutex = get_disp_mutex();
-    xSemaphoreTake(mutex, portMAX_DELAY);
-    esp_mqtt_client_handle_t cl = s_clHandle;
-    xSemaphoreGive(mutex);
-    if (!cl) return;
+void MQTTdispatcher::T_boot_timer_callback(TimerHandle_t /*handle*/) {
+  notifyInfo(INFO_NOTIFY_BOOT);
+}
 
-    static char topic_info[64];
-    static bool built = false;
-    if (!built) {
-        snprintf(topic_info, sizeof topic_info, "devices/%s/diag", s_mqtt_id);
-        built = true;
-    }
+// Once per boot: the startup milestones, in ms since boot (null: not reached),
+// retained on devices/<id>/boot.
+void MQTTdispatcher::publishBootReport() {
+  if (s_boot_reported || !s_mqtt || !getClientHandle())
+    return;
+  using ED_MQTT::BootTimeline;
+  char buf[256];
+  ED_MQTT::JsonWriter w(buf, sizeof buf);
+  w.beginObject();
+  for (uint8_t i = 0; i < BootTimeline::STAGE_COUNT; ++i) {
+    char key[24];
+    snprintf(key, sizeof key, "%s_ms", BootTimeline::name((BootTimeline::Stage)i));
+    int64_t t = BootTimeline::at((BootTimeline::Stage)i);
+    if (t > 0)
+      w.addInt(key, t / 1000);
+    else
+      w.addNull(key);
+  }
+  w.endObject();
+  if (w.overflow())
+    return;
+
+  char topic[64];
+  snprintf(topic, sizeof topic, "devices/%s/boot", s_mqtt_id);
+  ED_MQTT::PublishOptions opts;
+  opts.contentType = ED_MQTT::contentType(ED_MQTT::Encoding::JSON);
+  if (s_mqtt->publishWithId(topic, buf, (int)w.length(),
+                            ED_MQTT::MqttClient::MqttQoS::QOS1, true, &opts) >= 0) {
+    s_boot_reported = true;
+    ESP_LOGI(TAG, "boot timeline: %s", buf);
+    // Startup is over: from here the hot paths must not allocate.
+    ED_MQTT::AllocAudit::bootComplete();
+  }
+}
+
+bool MQTTdispatcher::publishHistoryChunk(const uint8_t *chunk, size_t len,
+                                         void * /*ctx*/) {
+  if (!s_mqtt)
+    return false;
+  // Records are compressed already: no second LZSS pass.
+  ED_MQTT::PublishOptions opts;
+  opts.contentType = "application/octet-stream";
+  return s_mqtt->publishWithId(historyTopic(), reinterpret_cast<const char *>(chunk),
+                               (int)len, ED_MQTT::MqttClient::MqttQoS::QOS1, false,
+                               &opts) >= 0;
+}
+
+void MQTTdispatcher::setHistoryInterval(uint32_t ms) {
+  if (!s_hist_timer)
+    return;
+  if (ms == 0) {
+    xTimerStop(s_hist_timer, 0);
+    ESP_LOGI(TAG, "diag history sampling stopped");
+    return;
+  }
+  TickType_t ticks;
+  if (!period_ticks(ms, ticks)) {
+    ESP_LOGE(TAG, "diag history period %lu ms too long", (unsigned long)ms);
+    return;
+  }
+  xTimerChangePeriod(s_hist_timer, ticks, 0);   // also starts it
+  ESP_LOGI(TAG, "diag history every %lu ms", (unsigned long)ms);
+}
 
-    static char buf[JSON_BUFFER_SIZE];
-    build_ping_json(buf, sizeof buf);
+void MQTTdispatcher::publishInfo() {
+    if (!getClientHandle()) return;
+
+    SemaphoreHandle_t diag = get_diag_mutex();
+    xSemaphoreTake(diag, portMAX_DELAY);
+    bool keyframe = !s_diag_delta || s_diag_key_requested ||
+                    s_diag_since_key + 1 >= s_diag_keyframe_every;
+    s_diag_key_requested = false;
+    const char *topic = keyframe ? diagTopic() : diagDeltaTopic();
+    ED_MQTT::Encoding enc = encodingFor(topic);
+    size_t len = build_diag(keyframe, enc);
+    if (len == 0) {   // delta with no change
+        xSemaphoreGive(diag);
+        return;
+    }
 
-    // Use MqttClient wrapper to get client‑id property automatically
-    bool ok = s_mqtt->publish(topic_info, buf, 0, true);   // QoS0, retain
+    // Use MqttClient wrapper to get client‑id property automatically.
+    // Keyframes: QoS0, retained. Deltas: QoS0, not retained.
+    ED_MQTT::PublishOptions opts;
+    opts.contentType = ED_MQTT::contentType(enc);
+    bool ok = s_mqtt->publishWithId(topic, s_diag_buf, (int)len, 0, keyframe,
+                                    &opts) >= 0;
+    xSemaphoreGive(diag);
 
     if (!ok)
         ESP_LOGE(TAG, "publishInfo failed");
@@ -744,16 +1744,47 @@ esp_err_t MQTTdispatcher::initialize(esp_mqtt_client_config_t *config) {
   strncpy(s_mqtt_id, ED_SYS::ESP_std::Device::mqttName(), sizeof s_mqtt_id - 1);
   s_config = config;
 
+  // Publishing, history and the boot report run as supervisor jobs. Started
+  // before the timers that post them: post() does not start it.
+  if (ED_MQTT::Supervisor::start() != ESP_OK)
+    return ESP_FAIL;
+
   // ── 10-second timer (default) ─────────────────────────────────
-  s_info_timer = xTimerCreate("info_loop", pdMS_TO_TICKS(10000), pdTRUE,
-                              nullptr, T_info_timer_callback);
+  s_info_timer = xTimerCreateStatic("info_loop", pdMS_TO_TICKS(10000), pdTRUE,
+                                    nullptr, T_info_timer_callback, &s_info_timer_buf);
   if (!s_info_timer) {
-    ESP_LOGE(TAG, "xTimerCreate failed");
+    ESP_LOGE(TAG, "xTimerCreateStatic failed");
     return ESP_FAIL;
   }
 
-  xTaskCreate(info_publisher_task, "info_pub", 8192, nullptr, 5,
-              &s_info_task_handle);
+  // History sampling starts now, not on connect: it covers the offline time.
+  s_hist_timer = xTimerCreateStatic("diag_hist",
+                                    pdMS_TO_TICKS(ED_MQTT_HISTORY_INTERVAL_MS
+                                                      ? ED_MQTT_HISTORY_INTERVAL_MS
+                                                      : 10000),
+                                    pdTRUE, nullptr, T_hist_timer_callback,
+                                    &s_hist_timer_buf);
+  if (!s_hist_timer)
+    ESP_LOGW(TAG, "diag history timer not available");
+  else if (ED_MQTT_HISTORY_INTERVAL_MS > 0)
+    xTimerStart(s_hist_timer, 0);
+
+  s_boot_timer = xTimerCreateStatic("boot_report", pdMS_TO_TICKS(BOOT_REPORT_GRACE_MS),
+                                    pdFALSE, nullptr, T_boot_timer_callback,
+                                    &s_boot_timer_buf);
+
+  if (CmdFlowScheduler::start() != ESP_OK)
+    ESP_LOGW(TAG, "coroutine flow scheduler not available");
+
+  if (ED_MQTT::AllocAudit::enabled())
+    registerFieldProvider(ED_MQTT::AllocAudit::writeFields, 0, ProviderCost::CHEAP,
+                          "alloc");
+  registerFieldProvider(ED_MQTT::HookProfiler::writeFields, 0, ProviderCost::CHEAP, "prof");
+
+#if ED_MQTT_LOG_STREAM
+  if (ED_MQTT::LogStream::start() == ESP_OK)
+    registerFieldProvider(ED_MQTT::LogStream::writeFields, 0, ProviderCost::CHEAP, "log");
+#endif
 
   ESP_LOGI(TAG, "initialized, waiting for IP before starting MQTT");
   return ESP_OK;
@@ -766,42 +1797,92 @@ esp_err_t MQTTdispatcher::run() {
 }
 
 void MQTTdispatcher::on_ip_ready() {
+  ED_MQTT::BootTimeline::mark(ED_MQTT::BootTimeline::IP_READY);
    // Cache IP for later use in info publisher
     strncpy(s_cached_ip, ED_SYS::ESP_std::Device::curIP(), sizeof(s_cached_ip) - 1);
     s_cached_ip[sizeof(s_cached_ip) - 1] = '\0';
 
+  // Callbacks and subscriptions first: the client may connect (and receive)
+  // before create() returns. Once only, IP ready fires again after a drop.
+  static bool registered = false;
+  if (!registered) {
+    registered = true;
+    // Commands: cmd/<id> for this device, cmd/group/<name> for joined
+    // groups (subscribed by joinGroup()), and the fleet-wide "cmd", where the
+    // MQTT5 "target" property drops messages meant for other devices.
+    snprintf(s_cmd_topic, sizeof s_cmd_topic, "cmd/%s", s_mqtt_id);
+    ED_MQTT::MqttClient::addSubscription(s_cmd_topic, ED_MQTT::MqttClient::MqttQoS::QOS0);
+#if ED_MQTT_CMD_BROADCAST
+    ED_MQTT::MqttClient::addSubscription("cmd", ED_MQTT::MqttClient::MqttQoS::QOS0);
+    ED_MQTT::MqttClient::registerDataCallback("cmd", on_mqtt_data);
+#endif
+    ED_MQTT::MqttClient::registerDataCallback(s_cmd_topic, on_mqtt_data);
+    ED_MQTT::MqttClient::registerDataCallback("cmd/group/+", on_mqtt_data);
+    ED_MQTT::MqttClient::registerTargetFilter("cmd", targetMatches);
+    ED_MQTT::MqttClient::registerConnectedCallback(on_mqtt_connected);
+    ED_MQTT::MqttClient::registerDataCallback(on_mqtt_message);
+    ED_MQTT::MqttClient::registerPublishedCallback(on_mqtt_published);
+  }
+
   ESP_LOGI(TAG, "IP ready — creating MQTT client");
   s_mqtt = ED_MQTT::MqttClient::create(s_config);
   if (!s_mqtt) {
     ESP_LOGE(TAG, "MqttClient::create failed");
     return;
   }
-  s_clHandle = s_mqtt->getHandle();
-
-  ESP_LOGI(TAG, "Waiting 3 seconds for MQTT connection...");
-  vTaskDelay(pdMS_TO_TICKS(3000));
-
-  int sub_id = esp_mqtt_client_subscribe(s_clHandle, "cmd", 0);
-  ESP_LOGI(TAG, "Direct subscription to 'cmd', msg_id=%d", sub_id);
-
-  s_mqtt->registerConnectedCallback(on_mqtt_connected);
-  s_mqtt->registerDataCallback(on_mqtt_data);
-
   // ── Start the periodic timer ─────────────────────────────────
   if (s_info_timer)
     xTimerStart(s_info_timer, 0);
 }
 
-void MQTTdispatcher::registerJsonFieldProvider(JsonFieldProvider provider) {
+bool MQTTdispatcher::addProvider(const ProviderSlot &slot) {
+  SemaphoreHandle_t diag = get_diag_mutex();
+  xSemaphoreTake(diag, portMAX_DELAY);
+  if (s_json_provider_count >= MAX_JSON_PROVIDERS) {
+    xSemaphoreGive(diag);
+    ESP_LOGE(TAG, "Too many JSON providers, max=%d", MAX_JSON_PROVIDERS);
+    return false;
+  }
+  char label[16];
+  snprintf(label, sizeof label, "provider.%u", s_json_provider_count);
+  ProviderSlot &p = s_json_providers[s_json_provider_count++];
+  p = slot;
+  p.hook = ED_MQTT::HookProfiler::add(ED_MQTT::HookKind::PROVIDER,
+                                      slot.name ? slot.name : label);
+  xSemaphoreGive(diag);
+  return true;
+}
+
+bool MQTTdispatcher::registerJsonFieldProvider(JsonFieldProvider provider,
+                                               uint32_t refresh_ms,
+                                               ProviderCost cost,
+                                               const char *name) {
   if (!provider) {
     ESP_LOGW(TAG, "Null JSON provider ignored");
-    return;
+    return false;
   }
-  if (s_json_provider_count >= MAX_JSON_PROVIDERS) {
-    ESP_LOGE(TAG, "Too many JSON providers, max=%d", MAX_JSON_PROVIDERS);
-    return;
+  ProviderSlot p = {};
+  p.fn = provider;
+  p.name = name;
+  p.refreshMs = refresh_ms;
+  p.cost = cost;
+  return addProvider(p);
+}
+
+bool MQTTdispatcher::registerFieldProvider(FieldProvider provider,
+                                           uint32_t refresh_ms,
+                                           ProviderCost cost,
+                                           const char *name) {
+  if (!provider) {
+    ESP_LOGW(TAG, "Null field provider ignored");
+    return false;
   }
-  s_json_providers[s_json_provider_count++] = provider;
+  ProviderSlot p = {};
+  p.fieldFn = provider;
+  p.name = name;
+  p.refreshMs = refresh_ms;
+  p.cost = cost;
+  return addProvider(p);
 }
 
 } // namespace ED_MQTT_dispatcher
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ED_mqtt.h"
+#include "ED_MQTT_encode.h"
 #include "freertos/timers.h"
 #include "secrets.h"
 #include "ED_S_JSON.h"   // <-- ADDED: needed for JsonFieldProvider
@@ -8,16 +9,46 @@
 namespace ED_MQTT_dispatcher {
 
 // ── Compile-time limits ───────────────────────────────────────────────
-static constexpr uint8_t MAX_COMMANDS        = 16;
-static constexpr uint8_t MAX_OPT_PARAMS      = 8;
-static constexpr uint8_t MAX_CMD_SUBSCRIBERS = 4;
-static constexpr uint8_t MAX_REGISTRIES      = 8;
+// Table sizes are overridable from the build, see ED_MQTT_config.h.
+static constexpr uint8_t MAX_COMMANDS        = ED_MQTT_MAX_COMMANDS;   // default registry size
+static constexpr uint8_t MAX_OPT_PARAMS      = ED_MQTT_MAX_OPT_PARAMS;
+static constexpr uint8_t MAX_CMD_SUBSCRIBERS = ED_MQTT_MAX_CMD_SUBSCRIBERS;
+static constexpr uint8_t MAX_REGISTRIES      = ED_MQTT_MAX_REGISTRIES;
 
 static constexpr uint8_t CMD_ID_LEN          = 16;
 static constexpr uint8_t CMD_DEX_LEN         = 64;
 static constexpr uint8_t PARAM_KEY_LEN       = 16;
 static constexpr uint8_t PARAM_VAL_LEN       = 64;
-
+static constexpr size_t  CMD_DATA_LEN        = 256;   // rendered command data
+static constexpr uint8_t MAX_BATCH_CMDS      = ED_MQTT_MAX_BATCH_CMDS; // commands per JSON array
+static constexpr size_t  BATCH_ACK_LEN       = 2048;  // aggregated ack payload
+static constexpr size_t  MEM_REPORT_LEN      = 1024;  // ":MEM" reply
+static constexpr size_t  ALLOC_REPORT_LEN    = 3072;  // ":ALLOC" reply (audit builds)
+static constexpr size_t  PROF_REPORT_LEN     = 3072;  // ":PROF" reply
+static constexpr size_t  DIAG_BUFFER_LEN     = JSON_BUFFER_SIZE;          // diag message
+static constexpr size_t  DIAG_FRAGMENT_LEN   = ED_MQTT_DIAG_FRAGMENT_LEN; // cached provider output
+static constexpr uint16_t DIAG_KEYFRAME_EVERY = 30;   // delta mode: ticks between keyframes
+static constexpr uint8_t MAX_TOPIC_ENCODINGS = 4;     // per-topic encoding overrides
+static constexpr size_t  TOPIC_FILTER_LEN    = 64;
+static constexpr uint8_t MAX_CMD_GROUPS      = ED_MQTT_MAX_CMD_GROUPS;
+static constexpr size_t  CMD_GROUP_LEN       = 24;
+
+static_assert(ED_MQTT_MAX_COMMANDS > 0 && ED_MQTT_MAX_COMMANDS <= 255,
+              "ED_MQTT_MAX_COMMANDS must be 1..255");
+static_assert(ED_MQTT_MAX_OPT_PARAMS >= 4 && ED_MQTT_MAX_OPT_PARAMS <= 255,
+              "ED_MQTT_MAX_OPT_PARAMS must leave room for _msgID, _msgID_raw, _original "
+              "and _default");
+static_assert(ED_MQTT_MAX_CMD_SUBSCRIBERS > 0 && ED_MQTT_MAX_CMD_SUBSCRIBERS <= 255,
+              "ED_MQTT_MAX_CMD_SUBSCRIBERS must be 1..255");
+static_assert(ED_MQTT_MAX_REGISTRIES > 0 && ED_MQTT_MAX_REGISTRIES <= 255,
+              "ED_MQTT_MAX_REGISTRIES must be 1..255");
+static_assert(ED_MQTT_MAX_BATCH_CMDS > 0 && ED_MQTT_MAX_BATCH_CMDS <= 255,
+              "ED_MQTT_MAX_BATCH_CMDS must be 1..255");
+static_assert(ED_MQTT_MAX_CMD_GROUPS >= 0 && ED_MQTT_MAX_CMD_GROUPS <= 255,
+              "ED_MQTT_MAX_CMD_GROUPS must be 0..255");
+
+
+class CmdTask;
 
 // ── CmdParam ─────────────────────────────────────────────────────────
 struct CmdParam {
@@ -37,7 +68,12 @@ struct ctrlCommand {
     uint8_t     paramCount = 0;
 
     void (*funcPointer)(ctrlCommand*) = nullptr;
+    /// Coroutine handler (see ED_MQTT_coro.h). Takes precedence over funcPointer.
+    CmdTask (*coroPointer)(ctrlCommand*) = nullptr;
 
+    /// Copy the command name; false (and logged) when it does not fit
+    /// CMD_ID_LEN - 1 chars. Names are never truncated.
+    bool setID(const char* id);
     const char* getParam(const char* key) const;
     bool setParam(const char* key, const char* val);
     bool addParam(const char* key, const char* default_val = "");
@@ -45,19 +81,71 @@ struct ctrlCommand {
 };
 
 // ── CommandRegistry ──────────────────────────────────────────────────
-class CommandRegistry {
+/**
+ * Command table with a per-instance capacity.
+ *
+ * CommandRegistryBase holds the logic and works on storage owned by the
+ * derived CommandRegistryN<N>, so each registry only pays for the commands it
+ * declares. registerCommand() returns false and logs when the table is full
+ * or the name is empty or unterminated (longer than CMD_ID_LEN - 1 chars);
+ * registering a fixed array of commands checks the capacity at compile time.
+ */
+class CommandRegistryBase {
 public:
-    void registerCommand(const ctrlCommand& cmd);
+    bool registerCommand(const ctrlCommand& cmd);
+    template <size_t K>
+    bool registerCommands(const ctrlCommand (&cmds)[K]);
     ctrlCommand* getCommand(const char* cmdID) const;
     bool dispatch(const char* cmdID);
     void getHelpBrief(char* buf, size_t len) const;
     void getHelpDetail(const char* cmdID, char* buf, size_t len) const;
 
+    uint8_t size() const { return count; }
+    uint8_t capacity() const { return m_capacity; }
+    size_t  storageBytes() const { return (size_t)m_capacity * sizeof(ctrlCommand); }
+
+protected:
+    // storage is owned by the derived class and not constructed yet:
+    // only its address is kept here.
+    CommandRegistryBase(ctrlCommand* storage, uint8_t capacity)
+        : entries(storage), m_capacity(capacity) {}
+    CommandRegistryBase(const CommandRegistryBase&) = delete;
+    CommandRegistryBase& operator=(const CommandRegistryBase&) = delete;
+
 private:
-    ctrlCommand entries[MAX_COMMANDS] = {};
-    uint8_t     count = 0;
+    ctrlCommand* entries;
+    uint8_t      m_capacity;
+    uint8_t      count = 0;
 };
 
+template <uint8_t N>
+class CommandRegistryN : public CommandRegistryBase {
+    static_assert(N > 0, "a command registry needs at least one slot");
+public:
+    static constexpr uint8_t CAPACITY = N;
+    CommandRegistryN() : CommandRegistryBase(m_storage, N) {}
+
+    /// Compile-time checked bulk registration.
+    template <size_t K>
+    bool registerCommands(const ctrlCommand (&cmds)[K]) {
+        static_assert(K <= N, "more commands than this registry can hold");
+        return CommandRegistryBase::registerCommands(cmds);
+    }
+
+private:
+    ctrlCommand m_storage[N] = {};
+};
+
+template <size_t K>
+bool CommandRegistryBase::registerCommands(const ctrlCommand (&cmds)[K]) {
+    bool ok = true;
+    for (size_t i = 0; i < K; ++i)
+        ok = registerCommand(cmds[i]) && ok;
+    return ok;
+}
+
+using CommandRegistry = CommandRegistryN<MAX_COMMANDS>;
+
 // ── iCommandRunner ──────────────────────────────────────────────────
 class iCommandRunner {
 public:
@@ -65,30 +153,56 @@ public:
                              const char* commandData,
                              size_t      dataLen,
                              uint32_t     msgID) = 0;
+    /// Return false to be skipped for commands this runner does not own.
+    virtual bool handlesCommand(const char* commandID) const { return true; }
     virtual ~iCommandRunner() = default;
 };
 
 // ── CommandWithRegistry ──────────────────────────────────────────────
-class CommandWithRegistry : public iCommandRunner {
+class CommandWithRegistryBase : public iCommandRunner {
 public:
-    // Constructor that automatically registers this registry with GlobalCommandRegistry
-    CommandWithRegistry(const char* regID, const char* briefDesc = nullptr);
-
-    CommandRegistry registry;
-
     void grabCommand(const char* commandID,
                      const char* commandData,
                      size_t      dataLen,
                      uint32_t     msgID) override;
+    bool handlesCommand(const char* commandID) const override {
+        return m_registry.getCommand(commandID) != nullptr;
+    }
+
+    bool registerCommand(const ctrlCommand& cmd) { return m_registry.registerCommand(cmd); }
+    bool dispatchCommand(const char* cmdID)     { return m_registry.dispatch(cmdID); }
+
+protected:
+    // Registers `reg` with GlobalCommandRegistry. `reg` belongs to the derived
+    // class and is not constructed yet: only its address is stored here.
+    CommandWithRegistryBase(CommandRegistryBase& reg, const char* regID,
+                            const char* briefDesc);
+
+    CommandRegistryBase& m_registry;
+};
 
-    void registerCommand(const ctrlCommand& cmd) { registry.registerCommand(cmd); }
-    bool dispatchCommand(const char* cmdID)     { return registry.dispatch(cmdID); }
+/// Command runner with its own registry of N commands.
+template <uint8_t N>
+class CommandWithRegistryN : public CommandWithRegistryBase {
+public:
+    // Constructor that automatically registers this registry with GlobalCommandRegistry
+    CommandWithRegistryN(const char* regID, const char* briefDesc = nullptr)
+        : CommandWithRegistryBase(registry, regID, briefDesc) {}
+
+    template <size_t K>
+    bool registerCommands(const ctrlCommand (&cmds)[K]) {
+        return registry.registerCommands(cmds);
+    }
+
+    CommandRegistryN<N> registry;
 };
 
+using CommandWithRegistry = CommandWithRegistryN<MAX_COMMANDS>;
+
 // ── RegistryInfo (for GlobalCommandRegistry) ────────────────────────
 struct RegistryInfo {
     const char* regID;
-    CommandRegistry* registry;
+    CommandRegistryBase* registry;
     const char* briefDesc;
 };
 
@@ -102,10 +216,14 @@ public:
     }
 
     void setBaseUrl(const char* url);
-    bool registerRegistry(const char* regID, CommandRegistry* reg, const char* briefDesc = nullptr);
+    bool registerRegistry(const char* regID, CommandRegistryBase* reg, const char* briefDesc = nullptr);
     void getHelpOverview(char* buf, size_t len) const;
     void getRegistryHelp(const char* regID, char* buf, size_t len) const;
     void getCommandHelp(const char* regID, const char* cmdID, char* buf, size_t len) const;
+    /// First command named cmdID in any registry, or nullptr.
+    const ctrlCommand* findCommand(const char* cmdID) const;
+    /// Append one row per registry (commands used/capacity, bytes).
+    void memoryReport(ED_MQTT::MemoryReport& report) const;
 
 private:
     GlobalCommandRegistry() = default;
@@ -120,18 +238,73 @@ private:
 class MQTTdispatcher {
 public:
 
+    /// MqttClient::getHandle(): not borrowed, a teardown may destroy it at
+    /// any time. Publish through MqttClient::publishWithId() instead.
     static esp_mqtt_client_handle_t getClientHandle();
     enum ackType { OK, FAIL };
 
     // --- JSON field provider type and registration ---
     using JsonFieldProvider = void (*)(ED_S_JSON::StaticJson& json);
-    static void registerJsonFieldProvider(JsonFieldProvider provider);
+    /// EXPENSIVE providers are refreshed at most one per diag message, so
+    /// slow lookups are spread over ticks instead of piling up on one.
+    enum class ProviderCost : uint8_t { CHEAP, EXPENSIVE };
+    /// refresh_ms == 0 runs the provider for every diag message. Otherwise its
+    /// last output is cached and reused until it is refresh_ms old.
+    static bool registerJsonFieldProvider(JsonFieldProvider provider,
+                                          uint32_t refresh_ms = 0,
+                                          ProviderCost cost = ProviderCost::CHEAP,
+                                          const char* name = nullptr);
+
+    /// Encoding-agnostic provider: writes the same fields as JSON or CBOR,
+    /// depending on the encoding selected for the diag topic.
+    using FieldProvider = void (*)(ED_MQTT::FieldWriter& w);
+    static bool registerFieldProvider(FieldProvider provider,
+                                      uint32_t refresh_ms = 0,
+                                      ProviderCost cost = ProviderCost::CHEAP,
+                                      const char* name = nullptr);
+
+    /// Encode messages published on topics matching filter (+/# allowed) with
+    /// enc. Unmatched topics use JSON. The content type goes out as the MQTT5
+    /// content-type property. Also available as ":ENC <filter> JSON|CBOR".
+    static bool setTopicEncoding(const char* filter, ED_MQTT::Encoding enc);
+    static ED_MQTT::Encoding encodingFor(const char* topic);
 
     static esp_err_t initialize(esp_mqtt_client_config_t* config = nullptr);
     static esp_err_t run();
-    static void subscribe(iCommandRunner* subscriber);
+    static bool subscribe(iCommandRunner* subscriber);
     static void ackCommand(int64_t reqMsgID, const char* commandID,
                            ackType ackResult, const char* originalCommand);
+    /// Like ackCommand(), with an optional JSON result object. MQTT5 requests
+    /// that carried a response topic get a JSON response on that topic with
+    /// their correlation data echoed; others get the legacy text ack.
+    static void respondCommand(int64_t reqMsgID, const char* commandID,
+                               ackType ackResult, const char* originalCommand,
+                               const char* resultJson);
+    /// Dedup ticket of the command being dispatched, handed to the flow it
+    /// spawns so the flow's ack completes it. 0 inside a batch (the batch
+    /// ack completes it) and outside a dispatch.
+    static uint32_t handOffDedupTicket();
+
+    /// Delta mode: between keyframes only providers whose output changed are
+    /// published, on devices/<id>/diag/delta. Keyframes (full, retained) go to
+    /// devices/<id>/diag every keyframeEvery ticks, on connect and on ":KEYFRAME".
+    static void setDiagDelta(bool enabled, uint16_t keyframeEvery = DIAG_KEYFRAME_EVERY);
+    /// Publish a keyframe on the next diag tick (and wake the publisher).
+    static void requestKeyframe();
+
+    /// Command groups: commands published on cmd/group/<name> reach every
+    /// member. Also available as ":JOIN <name>" / ":LEAVE <name>". Not kept
+    /// across reboots.
+    static bool joinGroup(const char* name);
+    static bool leaveGroup(const char* name);
+
+    /// Diag history sampling period (see ED_MQTT_history.h); 0 stops it.
+    /// Also available as ":HISTRATE <period>|D".
+    static void setHistoryInterval(uint32_t ms);
+
+    /// Static RAM used by every table of the component (":MEM" command).
+    /// Returns the report length.
+    static size_t memoryReport(char* buf, size_t len);
 
     // --- Timer control (used by PFREQ) ---
     static TimerHandle_t s_info_timer;   // make accessible
@@ -140,36 +313,150 @@ private:
 static char s_cached_ip[16];   // enough for IPv4
 
     static void on_mqtt_connected(esp_mqtt_client_handle_t client);
+    // Every topic: feeds coroutine flows waiting in nextMessage().
+    static void on_mqtt_message(esp_mqtt_client_handle_t client,
+                                const char* topic, int topicLen,
+                                const char* data, size_t dataLen,
+                                uint32_t msgID);
+    // Command topics only (routed by filter).
     static void on_mqtt_data(esp_mqtt_client_handle_t client,
                              const char* topic, int topicLen,
                              const char* data, size_t dataLen,
                              uint32_t msgID);
+    static void on_mqtt_published(int msgID);
     static void on_ip_ready();
 
     static bool parseCommand(const char* input, size_t inputLen,
                              char* cmdID, size_t cmdIDLen,
                              char* payload, size_t payloadLen);
 
-    static void build_ping_json(char* buf, size_t len);
+    /// Returns the message length; 0 when a delta has nothing to report.
+    static size_t build_ping_json(ED_MQTT::FieldWriter& w, bool keyframe);
+    static size_t build_diag(bool keyframe, ED_MQTT::Encoding enc);
+    static const char* diagTopic();
+    static const char* diagDeltaTopic();
+    static const char* historyTopic();
     static void T_info_timer_callback(TimerHandle_t handle);
-    static void info_publisher_task(void* arg);
+    static void T_hist_timer_callback(TimerHandle_t handle);
+    static void T_boot_timer_callback(TimerHandle_t handle);
+    static void publishBootReport();
+    static void notifyInfo(uint32_t bits);
+    static void info_job(uint32_t arg);
     static void publishInfo();
+    static void recordHistory();
+    static bool publishHistoryChunk(const uint8_t* chunk, size_t len, void* ctx);
+
+    // Request bits of the info job (s_info_pending).
+    static constexpr uint32_t INFO_NOTIFY_PUBLISH = 1u << 0;
+    static constexpr uint32_t INFO_NOTIFY_HISTORY = 1u << 1;
+    static constexpr uint32_t INFO_NOTIFY_BOOT    = 1u << 2;
+    /// Boot timeline goes out after the first command, or this long after
+    /// the first connection.
+    static constexpr uint32_t BOOT_REPORT_GRACE_MS = 15000;
     static void handleCommandObject(const char* json, size_t jsonLen, uint32_t cmdID);
+    static bool dispatchToSubscribers(const char* cmdID, const char* data,
+                                      size_t dataLen, uint32_t msgID);
+    static void publishBatchAck(uint32_t msgID, bool parseError);
+    static const char* ackTopic();
+
+    // --- Redelivery check (registry commands only, see ED_MQTT_dedup.h) ---
+    /// False when the command is a duplicate (already re-acked or dropped).
+    static bool beginCommand(uint32_t msgID, const char* topic, int topicLen,
+                             const char* data, size_t dataLen);
+    /// Closes the entry if no ack completed it and no flow took it over.
+    static void endCommand();
+    static uint32_t takeDedupTicket();
+    static uint32_t     s_dedup_ticket;   // command being dispatched, 0: none
+    static TaskHandle_t s_dedup_task;     // task dispatching it
+
+    // --- MQTT5 request/response (response topic + correlation data) ---
+    static constexpr uint8_t MAX_PENDING_REQUESTS = ED_MQTT_MAX_PENDING_REQUESTS;
+    static_assert(ED_MQTT_MAX_PENDING_REQUESTS > 0 && ED_MQTT_MAX_PENDING_REQUESTS <= 255,
+                  "ED_MQTT_MAX_PENDING_REQUESTS must be 1..255");
+    struct PendingRequest {
+        uint32_t msgID;
+        bool     used;
+        char     responseTopic[ED_MQTT::MAX_RESPONSE_TOPIC_LEN];
+        uint8_t  correlation[ED_MQTT::MAX_CORRELATION_LEN];
+        uint16_t correlationLen;
+    };
+    static void rememberRequest(uint32_t msgID, const ED_MQTT::RequestContext& req);
+    static bool takeRequest(uint32_t msgID, PendingRequest& out);
+    static bool sendResponse(uint32_t msgID, const char* payload);
+    static PendingRequest s_pending[MAX_PENDING_REQUESTS];
+    static uint8_t        s_pending_next;
+    static uint32_t       s_pending_evicted;   // routes recycled before their reply
+
+    // --- Batch execution (JSON command arrays) ---
+    enum class BatchStatus : uint8_t { NOACK, OK, FAIL, UNKNOWN, ASYNC };
+    struct BatchResult {
+        char        cmdID[CMD_ID_LEN];
+        BatchStatus status;
+    };
+    static BatchResult  s_batch[MAX_BATCH_CMDS];
+    static uint8_t      s_batch_count;
+    static uint16_t     s_batch_dropped;
+    static uint8_t      s_batch_cur;
+    static TaskHandle_t s_batch_task;   // task whose ackCommand() calls are captured
 
     // --- Static members ---
     static iCommandRunner* s_subscribers[MAX_CMD_SUBSCRIBERS];
     static uint8_t         s_subscriber_count;
-    static esp_mqtt_client_handle_t s_clHandle;
-    static TaskHandle_t    s_info_task_handle;
+    static uint32_t        s_info_pending;    // INFO_NOTIFY_* bits, job queued if != 0
+    static TimerHandle_t   s_hist_timer;
+    static TimerHandle_t   s_boot_timer;
+    static bool            s_boot_reported;   // supervisor task only
     // s_info_timer is now public (declared above)
     static char            s_mqtt_id[18];
+    static char            s_cmd_topic[32];   // cmd/<mqttName>
+    // Joined groups, "" = free slot (guarded by the dispatcher mutex)
+    static char            s_groups[MAX_CMD_GROUPS > 0 ? MAX_CMD_GROUPS : 1][CMD_GROUP_LEN];
+    static bool targetMatches(const char* target);
     static ED_MQTT::MqttClient*   s_mqtt;
     static esp_mqtt_client_config_t* s_config;
 
-    // --- JSON provider storage ---
-    static constexpr uint8_t MAX_JSON_PROVIDERS = 8;
-    static JsonFieldProvider s_json_providers[MAX_JSON_PROVIDERS];
-    static uint8_t           s_json_provider_count;
+    // --- JSON provider storage (per-provider fragment cache) ---
+    static constexpr uint8_t MAX_JSON_PROVIDERS = ED_MQTT_MAX_JSON_PROVIDERS;
+    static_assert(ED_MQTT_MAX_JSON_PROVIDERS > 0 && ED_MQTT_MAX_JSON_PROVIDERS <= 255,
+                  "ED_MQTT_MAX_JSON_PROVIDERS must be 1..255");
+    struct ProviderSlot {
+        JsonFieldProvider fn;         // legacy: JSON only, embedded as text in CBOR
+        FieldProvider     fieldFn;
+        const char*       name;
+        uint32_t          refreshMs;
+        ProviderCost      cost;
+        bool              valid;      // frag holds a serialized object
+        ED_MQTT::Encoding fragEnc;
+        TickType_t        lastRun;
+        uint16_t          fragLen;
+        uint32_t          sentHash;   // hash of the fragment last published
+        int8_t            hook;       // HookProfiler slot, -1: not profiled
+        uint8_t           frag[DIAG_FRAGMENT_LEN];
+    };
+    static bool addProvider(const ProviderSlot& slot);
+    static bool providerStale(const ProviderSlot& p, TickType_t now,
+                              ED_MQTT::Encoding enc);
+    static void refreshStaleProviders(ED_MQTT::Encoding enc);
+    static void refreshProvider(ProviderSlot& p, TickType_t now,
+                                ED_MQTT::Encoding enc);
+    static ProviderSlot s_json_providers[MAX_JSON_PROVIDERS];
+    static uint8_t      s_json_provider_count;
+    static char         s_diag_buf[DIAG_BUFFER_LEN];   // guarded by the diag mutex
+
+    // --- Delta diag state (guarded by the diag mutex) ---
+    static uint32_t      s_diag_seq;
+    static bool          s_diag_delta;
+    static uint16_t      s_diag_keyframe_every;
+    static uint16_t      s_diag_since_key;
+    static volatile bool s_diag_key_requested;
+
+    // --- Per-topic encoding (guarded by the dispatcher mutex) ---
+    struct TopicEncoding {
+        char              filter[TOPIC_FILTER_LEN];
+        ED_MQTT::Encoding enc;
+    };
+    static TopicEncoding s_topic_enc[MAX_TOPIC_ENCODINGS];
+    static uint8_t       s_topic_enc_count;
 };
 
 } // namespace ED_MQTT_dispatcher
\ No newline at end of file
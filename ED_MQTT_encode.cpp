@@ -0,0 +1,259 @@
+#include "ED_MQTT_encode.h"
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+namespace ED_MQTT {
+
+const char *contentType(Encoding enc) {
+  return enc == Encoding::CBOR ? "application/cbor" : "application/json";
+}
+
+bool parseEncoding(const char *name, Encoding &out) {
+  if (!name)
+    return false;
+  char up[8] = {};
+  for (size_t i = 0; i < sizeof up - 1 && name[i]; ++i)
+    up[i] = (char)toupper((unsigned char)name[i]);
+  if (strcmp(up, "JSON") == 0) {
+    out = Encoding::JSON;
+    return true;
+  }
+  if (strcmp(up, "CBOR") == 0) {
+    out = Encoding::CBOR;
+    return true;
+  }
+  return false;
+}
+
+bool FieldWriter::put(const void *src, size_t n) {
+  if (m_overflow || n > m_len - m_pos) {
+    m_overflow = true;
+    return false;
+  }
+  memcpy(m_buf + m_pos, src, n);
+  m_pos += n;
+  return true;
+}
+
+// ── JsonWriter ───────────────────────────────────────────────────────────────
+JsonWriter::JsonWriter(char *buf, size_t len)
+    : FieldWriter(Encoding::JSON, reinterpret_cast<uint8_t *>(buf), len) {
+  // Keep one byte for the terminator.
+  if (m_len > 0) {
+    --m_len;
+    buf[0] = '\0';
+  } else {
+    m_overflow = true;
+  }
+}
+
+void JsonWriter::terminate() {
+  m_buf[m_pos] = '\0';
+}
+
+void JsonWriter::quoted(const char *s) {
+  putByte('"');
+  for (; s && *s; ++s) {
+    char ch = *s;
+    if (ch == '"' || ch == '\\') {
+      char esc[2] = {'\\', ch};
+      put(esc, 2);
+    } else if ((unsigned char)ch < 0x20) {
+      char esc[7];
+      snprintf(esc, sizeof esc, "\\u%04x", (unsigned)ch);
+      put(esc, 6);
+    } else {
+      putByte((uint8_t)ch);
+    }
+  }
+  putByte('"');
+}
+
+void JsonWriter::element(const char *key) {
+  uint16_t bit = (uint16_t)(1u << m_depth);
+  if (m_depth > 0 && (m_hasItems & bit))
+    putByte(',');
+  m_hasItems |= bit;
+  if (key && m_depth > 0) {
+    quoted(key);
+    putByte(':');
+  }
+}
+
+void JsonWriter::open(char ch, const char *key) {
+  element(key);
+  putByte((uint8_t)ch);
+  if (m_depth + 1 >= MAX_DEPTH) {
+    m_overflow = true;
+    return;
+  }
+  ++m_depth;
+  m_hasItems &= (uint16_t)~(1u << m_depth);
+  terminate();
+}
+
+void JsonWriter::close(char ch) {
+  if (m_depth > 0)
+    --m_depth;
+  putByte((uint8_t)ch);
+  terminate();
+}
+
+void JsonWriter::beginObject(const char *key) { open('{', key); }
+void JsonWriter::endObject() { close('}'); }
+void JsonWriter::beginArray(const char *key) { open('[', key); }
+void JsonWriter::endArray() { close(']'); }
+
+void JsonWriter::addString(const char *key, const char *val) {
+  element(key);
+  quoted(val ? val : "");
+  terminate();
+}
+
+void JsonWriter::addInt(const char *key, int64_t val) {
+  element(key);
+  char num[24];
+  int n = snprintf(num, sizeof num, "%lld", (long long)val);
+  put(num, n > 0 ? (size_t)n : 0);
+  terminate();
+}
+
+void JsonWriter::addFloat(const char *key, float val) {
+  element(key);
+  if (!std::isfinite(val)) {
+    put("null", 4);
+  } else {
+    char num[24];
+    int n = snprintf(num, sizeof num, "%.6g", (double)val);
+    put(num, n > 0 ? (size_t)n : 0);
+  }
+  terminate();
+}
+
+void JsonWriter::addBool(const char *key, bool val) {
+  element(key);
+  if (val)
+    put("true", 4);
+  else
+    put("false", 5);
+  terminate();
+}
+
+void JsonWriter::addNull(const char *key) {
+  element(key);
+  put("null", 4);
+  terminate();
+}
+
+void JsonWriter::raw(const void *data, size_t len) {
+  element(nullptr);
+  put(data, len);
+  terminate();
+}
+
+// ── CborWriter ───────────────────────────────────────────────────────────────
+void CborWriter::head(uint8_t major, uint64_t val) {
+  uint8_t b[9];
+  size_t n;
+  major = (uint8_t)(major << 5);
+  if (val < 24) {
+    b[0] = (uint8_t)(major | val);
+    n = 1;
+  } else if (val <= 0xFF) {
+    b[0] = (uint8_t)(major | 24);
+    b[1] = (uint8_t)val;
+    n = 2;
+  } else if (val <= 0xFFFF) {
+    b[0] = (uint8_t)(major | 25);
+    b[1] = (uint8_t)(val >> 8);
+    b[2] = (uint8_t)val;
+    n = 3;
+  } else if (val <= 0xFFFFFFFFu) {
+    b[0] = (uint8_t)(major | 26);
+    for (int i = 0; i < 4; ++i)
+      b[1 + i] = (uint8_t)(val >> (24 - 8 * i));
+    n = 5;
+  } else {
+    b[0] = (uint8_t)(major | 27);
+    for (int i = 0; i < 8; ++i)
+      b[1 + i] = (uint8_t)(val >> (56 - 8 * i));
+    n = 9;
+  }
+  put(b, n);
+}
+
+void CborWriter::text(const char *s, size_t n) {
+  head(3, n);
+  put(s, n);
+}
+
+void CborWriter::key(const char *k) {
+  if (m_depth > 0 && (m_inMap & (1u << m_depth)))
+    text(k ? k : "", k ? strlen(k) : 0);
+}
+
+void CborWriter::beginObject(const char *k) {
+  key(k);
+  putByte(0xBF);
+  if (++m_depth >= 16) {
+    m_overflow = true;
+    return;
+  }
+  m_inMap |= (uint16_t)(1u << m_depth);
+}
+
+void CborWriter::beginArray(const char *k) {
+  key(k);
+  putByte(0x9F);
+  if (++m_depth >= 16) {
+    m_overflow = true;
+    return;
+  }
+  m_inMap &= (uint16_t)~(1u << m_depth);
+}
+
+void CborWriter::endObject() {
+  if (m_depth > 0)
+    --m_depth;
+  putByte(0xFF);
+}
+
+void CborWriter::endArray() { endObject(); }
+
+void CborWriter::addString(const char *k, const char *val) {
+  key(k);
+  text(val ? val : "", val ? strlen(val) : 0);
+}
+
+void CborWriter::addInt(const char *k, int64_t val) {
+  key(k);
+  if (val >= 0)
+    head(0, (uint64_t)val);
+  else
+    head(1, (uint64_t)(-1 - val));
+}
+
+void CborWriter::addFloat(const char *k, float val) {
+  key(k);
+  uint32_t bits;
+  memcpy(&bits, &val, sizeof bits);
+  uint8_t b[5] = {0xFA, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16),
+                  (uint8_t)(bits >> 8), (uint8_t)bits};
+  put(b, sizeof b);
+}
+
+void CborWriter::addBool(const char *k, bool val) {
+  key(k);
+  putByte(val ? 0xF5 : 0xF4);
+}
+
+void CborWriter::addNull(const char *k) {
+  key(k);
+  putByte(0xF6);
+}
+
+void CborWriter::raw(const void *data, size_t len) { put(data, len); }
+
+} // namespace ED_MQTT
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_MQTT {
+
+/**
+ * Encoding-agnostic field writers for outbound payloads.
+ *
+ * A provider written against FieldWriter produces either JSON text or CBOR
+ * (RFC 8949) depending on the writer it is handed, so the same callback
+ * feeds both encodings. Writers fill a caller-owned buffer: no heap, no
+ * intermediate copy. On overflow the writer stops and reports overflow();
+ * the buffer content is then not a valid document.
+ *
+ * CBOR maps and arrays use the indefinite-length form, so nothing has to be
+ * counted up front and encoded fragments can be spliced with raw().
+ */
+
+enum class Encoding : uint8_t { JSON, CBOR };
+
+/// MQTT5 content-type announced for an encoding.
+const char *contentType(Encoding enc);
+/// "JSON" / "CBOR", case-insensitive. False on unknown names.
+bool parseEncoding(const char *name, Encoding &out);
+
+class FieldWriter {
+public:
+  /// key is ignored (may be nullptr) for values inside an array.
+  virtual void beginObject(const char *key = nullptr) = 0;
+  virtual void endObject() = 0;
+  virtual void beginArray(const char *key = nullptr) = 0;
+  virtual void endArray() = 0;
+  virtual void addString(const char *key, const char *val) = 0;
+  virtual void addInt(const char *key, int64_t val) = 0;
+  virtual void addFloat(const char *key, float val) = 0;
+  virtual void addBool(const char *key, bool val) = 0;
+  /// JSON null, CBOR simple value 22 (0xF6).
+  virtual void addNull(const char *key) = 0;
+  /// Splice an already encoded value (same encoding) as the next element.
+  virtual void raw(const void *data, size_t len) = 0;
+
+  Encoding encoding() const { return m_enc; }
+  size_t length() const { return m_pos; }
+  size_t remaining() const { return m_len - m_pos; }
+  bool overflow() const { return m_overflow; }
+  const uint8_t *data() const { return m_buf; }
+
+protected:
+  FieldWriter(Encoding enc, uint8_t *buf, size_t len)
+      : m_enc(enc), m_buf(buf), m_len(len) {}
+  ~FieldWriter() = default;
+
+  bool put(const void *src, size_t n);
+  bool putByte(uint8_t b) { return put(&b, 1); }
+
+  Encoding m_enc;
+  uint8_t *m_buf;
+  size_t m_len;
+  size_t m_pos = 0;
+  bool m_overflow = false;
+};
+
+// ── JSON ─────────────────────────────────────────────────────────────────────
+/// Compact JSON text. The output is NUL-terminated whenever it fits.
+class JsonWriter : public FieldWriter {
+public:
+  JsonWriter(char *buf, size_t len);
+
+  void beginObject(const char *key = nullptr) override;
+  void endObject() override;
+  void beginArray(const char *key = nullptr) override;
+  void endArray() override;
+  void addString(const char *key, const char *val) override;
+  void addInt(const char *key, int64_t val) override;
+  void addFloat(const char *key, float val) override;
+  void addBool(const char *key, bool val) override;
+  void addNull(const char *key) override;
+  void raw(const void *data, size_t len) override;
+
+  const char *c_str() const { return reinterpret_cast<const char *>(m_buf); }
+
+private:
+  static constexpr uint8_t MAX_DEPTH = 16;
+
+  void element(const char *key);   // separator + optional "key":
+  void quoted(const char *s);
+  void open(char ch, const char *key);
+  void close(char ch);
+  void terminate();
+
+  uint8_t m_depth = 0;
+  uint16_t m_hasItems = 0;   // bit per depth: a value was already written
+};
+
+// ── CBOR ─────────────────────────────────────────────────────────────────────
+class CborWriter : public FieldWriter {
+public:
+  CborWriter(uint8_t *buf, size_t len) : FieldWriter(Encoding::CBOR, buf, len) {}
+
+  void beginObject(const char *key = nullptr) override;
+  void endObject() override;
+  void beginArray(const char *key = nullptr) override;
+  void endArray() override;
+  void addString(const char *key, const char *val) override;
+  void addInt(const char *key, int64_t val) override;
+  void addFloat(const char *key, float val) override;
+  void addBool(const char *key, bool val) override;
+  void addNull(const char *key) override;
+  void raw(const void *data, size_t len) override;
+
+  /// Text string item of n bytes (used to embed legacy JSON fragments).
+  void text(const char *s, size_t n);
+
+private:
+  void head(uint8_t major, uint64_t val);
+  void key(const char *k);
+
+  uint8_t m_depth = 0;
+  uint16_t m_inMap = 0;   // bit per depth: container is a map (keys required)
+};
+
+} // namespace ED_MQTT
@@ -0,0 +1,189 @@
+#include "ED_MQTT_history.h"
+#include "ED_MQTT_lzss.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <cstring>
+#include <freertos/semphr.h>
+
+static StaticSemaphore_t s_history_mutex_buffer;
+static SemaphoreHandle_t s_history_mutex = nullptr;
+
+static SemaphoreHandle_t get_history_mutex() {
+    if (s_history_mutex == nullptr) {
+        s_history_mutex = xSemaphoreCreateMutexStatic(&s_history_mutex_buffer);
+        configASSERT(s_history_mutex);
+    }
+    return s_history_mutex;
+}
+
+namespace ED_MQTT_dispatcher {
+
+static const char *TAG = "MQTThist";
+
+// ── Static members ───────────────────────────────────────────────────
+uint8_t DiagHistory::s_ring[HISTORY_LEN] = {};
+uint8_t DiagHistory::s_scratch[HISTORY_RECORD_MAX] = {};
+uint8_t DiagHistory::s_chunk[HISTORY_CHUNK_LEN] = {};
+size_t DiagHistory::s_head = 0;
+size_t DiagHistory::s_used = 0;
+uint16_t DiagHistory::s_records = 0;
+uint32_t DiagHistory::s_seq = 0;
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; ++i)
+        p[i] = (uint8_t)(v >> (24 - 8 * i));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+uint32_t DiagHistory::uptimeS() {
+    return (uint32_t)(esp_timer_get_time() / 1000000LL);
+}
+
+// ── Ring access (records may wrap around the end) ────────────────────
+void DiagHistory::copyIn(size_t pos, const uint8_t *src, size_t n) {
+    pos %= HISTORY_LEN;
+    size_t first = n < HISTORY_LEN - pos ? n : HISTORY_LEN - pos;
+    memcpy(s_ring + pos, src, first);
+    memcpy(s_ring, src + first, n - first);
+}
+
+void DiagHistory::copyOut(size_t pos, uint8_t *dst, size_t n) {
+    pos %= HISTORY_LEN;
+    size_t first = n < HISTORY_LEN - pos ? n : HISTORY_LEN - pos;
+    memcpy(dst, s_ring + pos, first);
+    memcpy(dst + first, s_ring, n - first);
+}
+
+size_t DiagHistory::recordSize(size_t pos) {
+    uint8_t len[2];
+    copyOut(pos + 9, len, 2);
+    return RECORD_HEADER + (((size_t)len[0] << 8) | len[1]);
+}
+
+void DiagHistory::dropOldest() {
+    size_t n = recordSize(s_head);
+    s_head = (s_head + n) % HISTORY_LEN;
+    s_used -= n;
+    --s_records;
+}
+
+// ── DiagHistory ──────────────────────────────────────────────────────
+bool DiagHistory::record(const uint8_t *data, size_t len, ED_MQTT::Encoding enc) {
+    if (!data || len == 0)
+        return false;
+
+    SemaphoreHandle_t mutex = get_history_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    uint8_t flags = enc == ED_MQTT::Encoding::CBOR ? FLAG_CBOR : 0;
+    const uint8_t *body = data;
+    size_t n = ED_MQTT::Lzss::compress(data, len, s_scratch, sizeof s_scratch);
+    if (n > 0) {
+        body = s_scratch;
+        flags |= FLAG_LZSS;
+    } else {
+        n = len;
+    }
+    if (n > HISTORY_RECORD_MAX) {
+        xSemaphoreGive(mutex);
+        ESP_LOGW(TAG, "snapshot of %u bytes does not fit a record, skipped",
+                 (unsigned)len);
+        return false;
+    }
+
+    const size_t need = RECORD_HEADER + n;
+    while (s_used + need > HISTORY_LEN)
+        dropOldest();
+
+    uint8_t hdr[RECORD_HEADER];
+    put_u32(hdr, s_seq++);
+    put_u32(hdr + 4, uptimeS());
+    hdr[8] = flags;
+    put_u16(hdr + 9, (uint16_t)n);
+    size_t tail = s_head + s_used;
+    copyIn(tail, hdr, sizeof hdr);
+    copyIn(tail + sizeof hdr, body, n);
+    s_used += need;
+    ++s_records;
+
+    xSemaphoreGive(mutex);
+    ESP_LOGD(TAG, "snapshot %u -> %u bytes, %u records held", (unsigned)len,
+             (unsigned)n, s_records);
+    return true;
+}
+
+uint16_t DiagHistory::exportRange(uint32_t fromS, uint32_t toS, ChunkSink sink,
+                                  void *ctx) {
+    if (!sink)
+        return 0;
+
+    SemaphoreHandle_t mutex = get_history_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    const uint32_t now = uptimeS();
+    uint16_t chunk = 0, inChunk = 0, exported = 0;
+    size_t w = CHUNK_HEADER;
+    bool ok = true;
+
+    auto flush = [&](bool last) {
+        s_chunk[0] = 1;
+        put_u16(s_chunk + 1, chunk++);
+        s_chunk[3] = last ? 1 : 0;
+        put_u32(s_chunk + 4, now);
+        put_u16(s_chunk + 8, inChunk);
+        ok = sink(s_chunk, w, ctx);
+        w = CHUNK_HEADER;
+        inChunk = 0;
+    };
+
+    size_t pos = s_head;
+    for (uint16_t r = 0; r < s_records && ok; ++r) {
+        uint8_t hdr[RECORD_HEADER];
+        copyOut(pos, hdr, sizeof hdr);
+        const size_t n = recordSize(pos);
+        const uint32_t t = get_u32(hdr + 4);
+        if (t >= fromS && t <= toS) {
+            if (w + n > sizeof s_chunk)
+                flush(false);
+            if (!ok)
+                break;
+            copyOut(pos, s_chunk + w, n);
+            w += n;
+            ++inChunk;
+            ++exported;
+        }
+        pos = (pos + n) % HISTORY_LEN;
+    }
+    if (ok)
+        flush(true);
+
+    xSemaphoreGive(mutex);
+    if (!ok)
+        ESP_LOGW(TAG, "export aborted after %u records", exported);
+    return exported;
+}
+
+void DiagHistory::clear() {
+    SemaphoreHandle_t mutex = get_history_mutex();
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    s_head = 0;
+    s_used = 0;
+    s_records = 0;
+    xSemaphoreGive(mutex);
+}
+
+void DiagHistory::memoryReport(ED_MQTT::MemoryReport &report) {
+    report.row("hist.ring", (unsigned)s_used, HISTORY_LEN, sizeof s_ring);   // bytes
+    report.row("hist.scratch", 0, 0, sizeof s_scratch + sizeof s_chunk);
+}
+
+} // namespace ED_MQTT_dispatcher
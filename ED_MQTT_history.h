@@ -0,0 +1,80 @@
+#pragma once
+
+#include "ED_MQTT_config.h"
+#include "ED_MQTT_encode.h"
+#include "ED_mqtt.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_MQTT_dispatcher {
+
+/**
+ * In-RAM ring of past diag snapshots.
+ *
+ * Snapshots are sampled on their own timer, independent of the publish rate,
+ * so the periodic diag can be slowed down (":PFREQ 10m") while the recent
+ * past stays retrievable after an incident (":HIST"). Each snapshot is stored
+ * in the encoding of the diag topic and LZSS-compressed when that is smaller;
+ * the oldest records are evicted to make room. Fixed byte ring, no heap.
+ *
+ * Record, as stored and as exported (big endian):
+ *   [seq u32][t u32 uptime s][flags u8][len u16][len bytes]
+ *   flags: FLAG_CBOR (else JSON), FLAG_LZSS (body is an ED_MQTT::Lzss stream)
+ *
+ * Export chunk (one MQTT message, records never straddle chunks):
+ *   [ver u8 = 1][chunk u16][last u8][now u32 uptime s][records u16][records…]
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr size_t HISTORY_LEN        = ED_MQTT_HISTORY_LEN;
+static constexpr size_t HISTORY_RECORD_MAX = ED_MQTT_HISTORY_RECORD_MAX;
+static constexpr size_t HISTORY_CHUNK_LEN  = ED_MQTT_HISTORY_CHUNK_LEN;
+
+class DiagHistory {
+public:
+    static constexpr uint8_t FLAG_CBOR = 0x01;
+    static constexpr uint8_t FLAG_LZSS = 0x02;
+    static constexpr size_t  RECORD_HEADER = 11;
+    static constexpr size_t  CHUNK_HEADER  = 10;
+
+    /// Store one snapshot, stamped with the current uptime. Returns false
+    /// when it does not fit HISTORY_RECORD_MAX even compressed.
+    static bool record(const uint8_t* data, size_t len, ED_MQTT::Encoding enc);
+
+    /// Called once per chunk; return false to abort the export.
+    using ChunkSink = bool (*)(const uint8_t* chunk, size_t len, void* ctx);
+    /// Export the records stamped fromS..toS (uptime seconds, inclusive) in
+    /// chunks of at most HISTORY_CHUNK_LEN bytes. The last chunk is flagged,
+    /// and always sent, even with no records. Returns the records exported.
+    static uint16_t exportRange(uint32_t fromS, uint32_t toS,
+                                ChunkSink sink, void* ctx);
+
+    static uint32_t uptimeS();
+    static void clear();
+    static void memoryReport(ED_MQTT::MemoryReport& report);
+
+private:
+    static void   copyIn(size_t pos, const uint8_t* src, size_t n);
+    static void   copyOut(size_t pos, uint8_t* dst, size_t n);
+    static size_t recordSize(size_t pos);
+    static void   dropOldest();
+
+    static uint8_t  s_ring[HISTORY_LEN];
+    static uint8_t  s_scratch[HISTORY_RECORD_MAX];   // compressor output
+    static uint8_t  s_chunk[HISTORY_CHUNK_LEN];      // export staging
+    static size_t   s_head;       // offset of the oldest record
+    static size_t   s_used;       // bytes held
+    static uint16_t s_records;
+    static uint32_t s_seq;        // seq of the next record
+};
+
+static_assert(ED_MQTT_HISTORY_RECORD_MAX >= 64 && ED_MQTT_HISTORY_RECORD_MAX <= 0xFFFF,
+              "ED_MQTT_HISTORY_RECORD_MAX must be 64..65535");
+static_assert(ED_MQTT_HISTORY_LEN >= DiagHistory::RECORD_HEADER + ED_MQTT_HISTORY_RECORD_MAX,
+              "ED_MQTT_HISTORY_LEN must hold at least one full record");
+static_assert(ED_MQTT_HISTORY_CHUNK_LEN >= DiagHistory::CHUNK_HEADER +
+                                               DiagHistory::RECORD_HEADER +
+                                               ED_MQTT_HISTORY_RECORD_MAX,
+              "ED_MQTT_HISTORY_CHUNK_LEN must hold at least one full record");
+
+} // namespace ED_MQTT_dispatcher
@@ -0,0 +1,388 @@
+#include "ED_MQTT_logstream.h"
+#include "ED_MQTT_alloc.h"
+#include "ED_MQTT_supervisor.h"
+#include "esp_timer.h"
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+
+namespace ED_MQTT {
+
+static const char *TAG = "MQTTlog";
+
+// Serializes rule writers and start/stop; producers never take it.
+static portMUX_TYPE s_log_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Set while this task captures a line or drains the ring: whatever it logs
+// meanwhile goes to the console only.
+static thread_local bool t_busy = false;
+
+static bool s_running = false;   // hook installed (or being installed)
+
+static const char kLevelChars[] = "NEWIDV";   // by esp_log_level_t
+
+// ── Static members ───────────────────────────────────────────────────
+vprintf_like_t LogStream::s_prev = nullptr;
+LogStream::Slot LogStream::s_slots[LOG_SLOTS] = {};
+std::atomic<uint32_t> LogStream::s_head{0};
+std::atomic<uint32_t> LogStream::s_tail{0};
+std::atomic<uint8_t> LogStream::s_level{ED_MQTT_LOG_STREAM_LEVEL};
+std::atomic<uint8_t> LogStream::s_max_level{ED_MQTT_LOG_STREAM_LEVEL};
+std::atomic<uint32_t> LogStream::s_rules_seq{0};
+LogStream::TagRule LogStream::s_rules[LOG_TAG_RULES] = {};
+std::atomic<uint32_t> LogStream::s_dropped{0};
+std::atomic<bool> LogStream::s_drain_pending{false};
+uint32_t LogStream::s_dropped_reported = 0;
+uint32_t LogStream::s_sent = 0;
+uint32_t LogStream::s_batches = 0;
+uint32_t LogStream::s_throttled = 0;
+int64_t LogStream::s_tokens = 0;
+int64_t LogStream::s_refill_us = 0;
+char LogStream::s_batch[LOG_BATCH_LEN] = {};
+TimerHandle_t LogStream::s_flush_timer = nullptr;
+StaticTimer_t LogStream::s_flush_timer_buf;
+
+// ── Helpers ──────────────────────────────────────────────────────────
+// Skips an ANSI colour sequence ("\033[0;31m") at p.
+static const char *skip_color(const char *p) {
+  if (p[0] != '\033' || p[1] != '[')
+    return p;
+  const char *m = strchr(p, 'm');
+  return m ? m + 1 : p;
+}
+
+// Level of an ESP_LOGx format ("E (%lu) %s: …", maybe coloured); lines that
+// do not look like one count as INFO.
+static uint8_t format_level(const char *fmt) {
+  const char *p = skip_color(fmt);
+  if (p[0] && p[1] == ' ')
+    if (const char *c = strchr(kLevelChars + 1, p[0]))
+      return (uint8_t)(c - kLevelChars);
+  return ESP_LOG_INFO;
+}
+
+// ── Lifecycle ────────────────────────────────────────────────────────
+esp_err_t LogStream::start() {
+  static bool created = false;
+  taskENTER_CRITICAL(&s_log_mux);
+  const bool first = !created;
+  created = true;
+  const bool running = s_running;
+  s_running = true;
+  taskEXIT_CRITICAL(&s_log_mux);
+  if (running)
+    return ESP_OK;
+
+  if (first) {
+    for (uint8_t i = 0; i < LOG_SLOTS; ++i)
+      s_slots[i].seq.store(i, std::memory_order_relaxed);
+    s_refill_us = esp_timer_get_time();
+    s_tokens = LOG_BATCH_LEN;
+    s_flush_timer = xTimerCreateStatic("log_flush", pdMS_TO_TICKS(LOG_FLUSH_MS), pdTRUE,
+                                       nullptr, flush_timer_cb, &s_flush_timer_buf);
+  }
+  if (Supervisor::start() != ESP_OK || !s_flush_timer ||
+      xTimerStart(s_flush_timer, 0) != pdPASS) {
+    ESP_LOGE(TAG, "log stream not started (timer or supervisor)");
+    s_running = false;
+    return ESP_FAIL;
+  }
+  s_prev = esp_log_set_vprintf(hook);
+  ESP_LOGI(TAG, "log stream started (level %c, %u slots, %lu B/s)",
+           kLevelChars[level()], LOG_SLOTS, (unsigned long)LOG_RATE_BPS);
+  return ESP_OK;
+}
+
+void LogStream::stop() {
+  if (!s_running || !s_prev)
+    return;
+  vprintf_like_t current = esp_log_set_vprintf(s_prev);
+  if (current != hook) {
+    esp_log_set_vprintf(current);   // someone hooked in after us: leave the chain alone
+    ESP_LOGW(TAG, "vprintf hook replaced by another component, not removed");
+    return;
+  }
+  xTimerStop(s_flush_timer, 0);
+  s_running = false;
+}
+
+// ── Filter ───────────────────────────────────────────────────────────
+void LogStream::updateMaxLevel() {
+  uint8_t max = s_level.load(std::memory_order_relaxed);
+  for (const TagRule &r : s_rules)
+    if (r.tag[0] && r.level > max)
+      max = r.level;
+  s_max_level.store(max, std::memory_order_relaxed);
+}
+
+void LogStream::setLevel(esp_log_level_t level) {
+  taskENTER_CRITICAL(&s_log_mux);
+  s_level.store((uint8_t)level, std::memory_order_relaxed);
+  updateMaxLevel();
+  taskEXIT_CRITICAL(&s_log_mux);
+}
+
+bool LogStream::setTagLevel(const char *tag, esp_log_level_t level) {
+  if (!tag || !tag[0] || strlen(tag) >= LOG_TAG_LEN)
+    return false;
+  bool ok = false;
+  taskENTER_CRITICAL(&s_log_mux);
+  TagRule *rule = nullptr;
+  for (TagRule &r : s_rules) {
+    if (strcmp(r.tag, tag) == 0) {
+      rule = &r;
+      break;
+    }
+    if (!rule && !r.tag[0])
+      rule = &r;
+  }
+  if (rule) {
+    // Seqlock: readers retry while the count is odd or has moved.
+    s_rules_seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    strcpy(rule->tag, tag);
+    rule->level = (uint8_t)level;
+    s_rules_seq.fetch_add(1, std::memory_order_release);
+    updateMaxLevel();
+    ok = true;
+  }
+  taskEXIT_CRITICAL(&s_log_mux);
+  return ok;
+}
+
+bool LogStream::clearTagLevel(const char *tag) {
+  if (!tag)
+    return false;
+  bool found = false;
+  taskENTER_CRITICAL(&s_log_mux);
+  for (TagRule &r : s_rules)
+    if (r.tag[0] && strcmp(r.tag, tag) == 0) {
+      s_rules_seq.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      r.tag[0] = '\0';
+      s_rules_seq.fetch_add(1, std::memory_order_release);
+      found = true;
+    }
+  if (found)
+    updateMaxLevel();
+  taskEXIT_CRITICAL(&s_log_mux);
+  return found;
+}
+
+bool LogStream::parseLevel(const char *name, esp_log_level_t &out) {
+  static const struct {
+    const char *name;
+    esp_log_level_t level;
+  } kNames[] = {
+      {"NONE", ESP_LOG_NONE},   {"OFF", ESP_LOG_NONE},      {"E", ESP_LOG_ERROR},
+      {"ERROR", ESP_LOG_ERROR}, {"W", ESP_LOG_WARN},        {"WARN", ESP_LOG_WARN},
+      {"I", ESP_LOG_INFO},      {"INFO", ESP_LOG_INFO},     {"D", ESP_LOG_DEBUG},
+      {"DEBUG", ESP_LOG_DEBUG}, {"V", ESP_LOG_VERBOSE},     {"VERBOSE", ESP_LOG_VERBOSE},
+  };
+  if (!name)
+    return false;
+  for (const auto &n : kNames)
+    if (strcasecmp(name, n.name) == 0) {
+      out = n.level;
+      return true;
+    }
+  return false;
+}
+
+bool LogStream::accepts(uint8_t level, const char *tag, size_t tagLen) {
+  uint8_t limit;
+  uint32_t seq;
+  do {
+    seq = s_rules_seq.load(std::memory_order_acquire);
+    limit = s_level.load(std::memory_order_relaxed);
+    if (tagLen < LOG_TAG_LEN)
+      for (const TagRule &r : s_rules)
+        if (r.tag[0] && memcmp(r.tag, tag, tagLen) == 0 && r.tag[tagLen] == '\0') {
+          limit = r.level;
+          break;
+        }
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((seq & 1) || seq != s_rules_seq.load(std::memory_order_relaxed));
+  return level != ESP_LOG_NONE && level <= limit;
+}
+
+// ── Capture (any task) ───────────────────────────────────────────────
+int LogStream::hook(const char *fmt, va_list args) {
+  if (!t_busy) {
+    t_busy = true;
+    va_list copy;
+    va_copy(copy, args);
+    capture(fmt, copy);
+    va_end(copy);
+    t_busy = false;
+  }
+  return s_prev ? s_prev(fmt, args) : vprintf(fmt, args);
+}
+
+void LogStream::capture(const char *fmt, va_list args) {
+  const uint8_t level = format_level(fmt);
+  if (level > s_max_level.load(std::memory_order_relaxed))
+    return;   // nothing forwards this level: skip the formatting
+
+  char buf[LOG_LINE_LEN + 8];   // + colour prefix
+  int n = vsnprintf(buf, sizeof buf, fmt, args);
+  if (n <= 0)
+    return;
+  char *line = const_cast<char *>(skip_color(buf));
+  size_t len = strnlen(line, sizeof buf - (line - buf));
+  while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    --len;
+  if (len >= 4 && memcmp(line + len - 4, "\033[0m", 4) == 0)
+    len -= 4;
+  if (len == 0)
+    return;
+  if (len > LOG_LINE_LEN)
+    len = LOG_LINE_LEN;
+
+  // "E (1234) TAG: text": the tag sits between ") " and ": ".
+  const char *tag = "";
+  size_t tagLen = 0;
+  if (const char *open = (const char *)memchr(line, ')', len)) {
+    tag = open + 2;
+    const char *end = tag < line + len ? strstr(tag, ": ") : nullptr;
+    tagLen = end ? (size_t)(end - tag) : 0;
+  }
+  if (accepts(level, tag, tagLen))
+    push(line, len);
+}
+
+void LogStream::push(const char *line, size_t len) {
+  uint32_t pos = s_head.load(std::memory_order_relaxed);
+  Slot *slot;
+  for (;;) {
+    slot = &s_slots[pos & (LOG_SLOTS - 1)];
+    const int32_t diff =
+        (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+    if (diff == 0) {
+      if (s_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;   // slot claimed
+    } else if (diff < 0) {
+      s_dropped.fetch_add(1, std::memory_order_relaxed);   // full: drop the newest
+      return;
+    } else {
+      pos = s_head.load(std::memory_order_relaxed);   // another producer got it
+    }
+  }
+  memcpy(slot->text, line, len);
+  slot->len = (uint8_t)len;
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+// ── Drain (supervisor) ───────────────────────────────────────────────
+void LogStream::flush_timer_cb(TimerHandle_t /*handle*/) {
+  if (s_head.load(std::memory_order_relaxed) == s_tail.load(std::memory_order_relaxed) &&
+      s_dropped.load(std::memory_order_relaxed) == s_dropped_reported)
+    return;   // nothing queued (unlocked read of s_dropped_reported is a hint)
+  if (!s_drain_pending.exchange(true) && !Supervisor::post(drain_job))
+    s_drain_pending.store(false);
+}
+
+void LogStream::drain_job(uint32_t /*arg*/) {
+  s_drain_pending.store(false);
+  AllocScope scope("log.drain", AllocScope::HOT);
+  t_busy = true;
+
+  const int64_t now = esp_timer_get_time();
+  s_tokens += (now - s_refill_us) * (int64_t)LOG_RATE_BPS / 1000000;
+  s_refill_us = now;
+  if (s_tokens > (int64_t)LOG_BATCH_LEN)
+    s_tokens = LOG_BATCH_LEN;
+
+  PublishOptions opts;
+  opts.contentType = "text/plain";
+  MqttClient *mqtt = MqttClient::getInstance();
+  bool more = mqtt != nullptr;
+  while (more) {
+    size_t n = 0;
+    const uint32_t dropped = s_dropped.load(std::memory_order_relaxed);
+    if (dropped != s_dropped_reported)
+      n = (size_t)snprintf(s_batch, sizeof s_batch, "-- %lu lines dropped --\n",
+                           (unsigned long)(dropped - s_dropped_reported));
+
+    // Lines stay in their slots until the publish went out.
+    const uint32_t tail = s_tail.load(std::memory_order_relaxed);
+    uint32_t pos = tail;
+    more = false;
+    for (;;) {
+      const Slot &slot = s_slots[pos & (LOG_SLOTS - 1)];
+      if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+        break;   // empty
+      const size_t need = slot.len + 1u;
+      if (n + need > sizeof s_batch) {
+        more = true;   // batch full, next message
+        break;
+      }
+      if ((int64_t)(n + need) > s_tokens) {
+        ++s_throttled;   // over the rate: wait for the next drain
+        break;
+      }
+      memcpy(s_batch + n, slot.text, slot.len);
+      n += slot.len;
+      s_batch[n++] = '\n';
+      ++pos;
+    }
+    if (n == 0)
+      break;
+
+    if (mqtt->publishWithId("log", s_batch, (int)(n - 1), 0, false, &opts) < 0)
+      break;   // not connected: everything waits
+    s_tokens -= (int64_t)n;
+    s_dropped_reported = dropped;
+    s_sent += pos - tail;
+    ++s_batches;
+    for (uint32_t p = tail; p != pos; ++p)
+      s_slots[p & (LOG_SLOTS - 1)].seq.store(p + LOG_SLOTS, std::memory_order_release);
+    s_tail.store(pos, std::memory_order_relaxed);
+  }
+  t_busy = false;
+}
+
+// ── Reporting ────────────────────────────────────────────────────────
+LogStream::Stats LogStream::stats() {
+  return {s_sent, s_dropped.load(std::memory_order_relaxed), s_batches, s_throttled};
+}
+
+size_t LogStream::writeStatus(FieldWriter &w) {
+  char lvl[2] = {kLevelChars[level()], '\0'};
+  w.beginObject();
+  w.addString("level", lvl);
+  w.beginObject("tags");
+  taskENTER_CRITICAL(&s_log_mux);
+  TagRule rules[LOG_TAG_RULES];
+  memcpy(rules, s_rules, sizeof rules);
+  taskEXIT_CRITICAL(&s_log_mux);
+  for (const TagRule &r : rules)
+    if (r.tag[0]) {
+      lvl[0] = kLevelChars[r.level];
+      w.addString(r.tag, lvl);
+    }
+  w.endObject();
+  const Stats s = stats();
+  w.addInt("sent", s.sent);
+  w.addInt("dropped", s.dropped);
+  w.addInt("batches", s.batches);
+  w.addInt("throttled", s.throttled);
+  w.addInt("queued", s_head.load() - s_tail.load());
+  w.addBool("active", s_running);
+  w.endObject();
+  return w.overflow() ? 0 : w.length();
+}
+
+void LogStream::writeFields(FieldWriter &w) {
+  w.addInt("d_LOGS", s_sent);
+  w.addInt("d_LOGD", s_dropped.load(std::memory_order_relaxed));
+}
+
+void LogStream::memoryReport(MemoryReport &report) {
+  report.row("log.ring", (unsigned)(s_head.load() - s_tail.load()), LOG_SLOTS,
+             sizeof s_slots);
+  report.row("log.batch", 0, 0, sizeof s_batch);
+}
+
+} // namespace ED_MQTT
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "ED_MQTT_config.h"
+#include "ED_MQTT_encode.h"
+#include "ED_mqtt.h"
+#include <atomic>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <esp_log.h>
+#include <freertos/timers.h>
+
+namespace ED_MQTT {
+
+/**
+ * Log lines forwarded to the broker.
+ *
+ * start() installs an esp_log_set_vprintf() hook in front of the current
+ * one (the serial console keeps getting every line). The hook formats the
+ * line on the logging task's stack (LOG_LINE_LEN bytes) and, if it passes
+ * the filter, copies it into a slot of a static ring: a bounded
+ * multi-producer queue (Vyukov), one CAS per line, no lock, any task.
+ * A full ring drops the new line and counts it. Lines below the most
+ * verbose level in use are rejected from the format string, before any
+ * formatting.
+ *
+ * Every LOG_FLUSH_MS a supervisor job drains the ring: as many lines as fit
+ * LOG_BATCH_LEN go out as one QoS0 text message on "log", one line per row,
+ * with a "-- n lines dropped --" row when lines were lost. A token bucket
+ * caps the stream at LOG_RATE_BPS bytes/s; lines over the budget wait in
+ * the ring. While disconnected they wait as well.
+ *
+ * Logs raised while a line is captured, and by the drain job itself (the
+ * publish path), are printed but not captured.
+ *
+ * Filter: a global level (ED_MQTT_LOG_STREAM_LEVEL) plus up to
+ * LOG_TAG_RULES per-tag levels, changed with ":LOG" (see the dispatcher).
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint8_t  LOG_SLOTS     = ED_MQTT_LOG_SLOTS;
+static constexpr size_t   LOG_LINE_LEN  = ED_MQTT_LOG_LINE_LEN;
+static constexpr size_t   LOG_BATCH_LEN = ED_MQTT_LOG_BATCH_LEN;
+static constexpr uint32_t LOG_FLUSH_MS  = ED_MQTT_LOG_FLUSH_MS;
+static constexpr uint32_t LOG_RATE_BPS  = ED_MQTT_LOG_RATE_BPS;
+static constexpr uint8_t  LOG_TAG_RULES = 4;
+static constexpr size_t   LOG_TAG_LEN   = 16;
+static_assert(ED_MQTT_LOG_SLOTS >= 4 && ED_MQTT_LOG_SLOTS <= 128 &&
+                  (ED_MQTT_LOG_SLOTS & (ED_MQTT_LOG_SLOTS - 1)) == 0,
+              "ED_MQTT_LOG_SLOTS must be a power of two, 4..128");
+static_assert(ED_MQTT_LOG_LINE_LEN >= 32 && ED_MQTT_LOG_LINE_LEN <= 255,
+              "ED_MQTT_LOG_LINE_LEN must be 32..255");
+static_assert(ED_MQTT_LOG_BATCH_LEN >= ED_MQTT_LOG_LINE_LEN + 32,
+              "ED_MQTT_LOG_BATCH_LEN must hold a line and the drop notice");
+static_assert(ED_MQTT_LOG_RATE_BPS > 0, "ED_MQTT_LOG_RATE_BPS must be > 0");
+
+class LogStream {
+public:
+  struct Stats {
+    uint32_t sent;        // lines published
+    uint32_t dropped;     // lines lost, ring full
+    uint32_t batches;     // messages published
+    uint32_t throttled;   // drains cut short by the rate limit
+  };
+
+  /// Install the hook and the flush timer (first call).
+  static esp_err_t start();
+  /// Restore the previous vprintf hook; queued lines stay queued.
+  static void stop();
+
+  static void setLevel(esp_log_level_t level);
+  static esp_log_level_t level() { return (esp_log_level_t)s_level.load(); }
+  /// Level for one tag, overriding the global one; false when the rule
+  /// table is full.
+  static bool setTagLevel(const char *tag, esp_log_level_t level);
+  static bool clearTagLevel(const char *tag);
+  /// Exactly NONE|OFF|E|ERROR|W|WARN|I|INFO|D|DEBUG|V|VERBOSE,
+  /// case-insensitive; anything else is rejected.
+  static bool parseLevel(const char *name, esp_log_level_t &out);
+
+  static Stats stats();
+  /// {"level":"W","tags":{"wifi":"D"},"sent":…,"dropped":…,…}; 0 on overflow.
+  static size_t writeStatus(FieldWriter &w);
+  /// Diag fields: d_LOGS lines sent, d_LOGD lines dropped.
+  static void writeFields(FieldWriter &w);
+  static void memoryReport(MemoryReport &report);
+
+private:
+  struct Slot {
+    std::atomic<uint32_t> seq;   // == position: free, == position + 1: filled
+    uint8_t len;
+    char text[LOG_LINE_LEN];
+  };
+  struct TagRule {
+    char tag[LOG_TAG_LEN];   // "": unused
+    uint8_t level;
+  };
+
+  static int hook(const char *fmt, va_list args);
+  static void capture(const char *fmt, va_list args);
+  static bool accepts(uint8_t level, const char *tag, size_t tagLen);
+  static void push(const char *line, size_t len);
+  static void updateMaxLevel();
+  static void flush_timer_cb(TimerHandle_t handle);
+  static void drain_job(uint32_t arg);
+
+  static vprintf_like_t s_prev;
+  static Slot s_slots[LOG_SLOTS];
+  static std::atomic<uint32_t> s_head;   // next position to fill (producers)
+  static std::atomic<uint32_t> s_tail;   // next position to drain (supervisor)
+  static std::atomic<uint8_t> s_level;
+  static std::atomic<uint8_t> s_max_level;   // most verbose of level and rules
+  static std::atomic<uint32_t> s_rules_seq;  // odd while a rule is written
+  static TagRule s_rules[LOG_TAG_RULES];
+  static std::atomic<uint32_t> s_dropped;
+  static std::atomic<bool> s_drain_pending;
+  static uint32_t s_dropped_reported;   // supervisor only
+  static uint32_t s_sent;
+  static uint32_t s_batches;
+  static uint32_t s_throttled;
+  static int64_t s_tokens;              // bytes the bucket allows now
+  static int64_t s_refill_us;
+  static char s_batch[LOG_BATCH_LEN];
+  static TimerHandle_t s_flush_timer;
+  static StaticTimer_t s_flush_timer_buf;
+};
+
+} // namespace ED_MQTT
@@ -0,0 +1,153 @@
+#include "ED_MQTT_lzss.h"
+#include <cstring>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+static StaticSemaphore_t s_lzss_mutex_buffer;
+static SemaphoreHandle_t s_lzss_mutex = nullptr;
+
+static SemaphoreHandle_t get_lzss_mutex() {
+  if (s_lzss_mutex == nullptr) {
+    s_lzss_mutex = xSemaphoreCreateMutexStatic(&s_lzss_mutex_buffer);
+    configASSERT(s_lzss_mutex);
+  }
+  return s_lzss_mutex;
+}
+
+namespace ED_MQTT {
+
+// ── Compressor working set (static, single user) ─────────────────────
+static constexpr size_t   HASH_BITS = 9;
+static constexpr size_t   HASH_SIZE = 1u << HASH_BITS;
+static constexpr uint16_t NO_POS = 0xFFFF;
+static constexpr uint8_t  MAX_CHAIN = 32;
+
+static uint16_t s_head[HASH_SIZE];
+static uint16_t s_prev[Lzss::WINDOW];
+
+static inline size_t hash3(const uint8_t *p) {
+  return ((p[0] << 6) ^ (p[1] << 3) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+size_t Lzss::compress(const uint8_t *in, size_t n, uint8_t *out, size_t outLen) {
+  if (!in || !out || n < MIN_MATCH || n > 0xFFFF || outLen < 3)
+    return 0;
+  SemaphoreHandle_t mutex = get_lzss_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  size_t r = compressLocked(in, n, out, outLen);
+  xSemaphoreGive(mutex);
+  return r;
+}
+
+size_t Lzss::compressLocked(const uint8_t *in, size_t n, uint8_t *out,
+                            size_t outLen) {
+  // Never produce more than the input: the caller then sends it raw.
+  size_t cap = outLen < n ? outLen : n;
+
+  for (size_t i = 0; i < HASH_SIZE; ++i)
+    s_head[i] = NO_POS;
+
+  auto insert = [&](size_t pos) {
+    if (pos + MIN_MATCH > n)
+      return;
+    size_t h = hash3(in + pos);
+    s_prev[pos & (WINDOW - 1)] = s_head[h];
+    s_head[h] = (uint16_t)pos;
+  };
+
+  out[0] = (uint8_t)(n >> 8);
+  out[1] = (uint8_t)n;
+  size_t w = 2;
+  size_t flagPos = 0;
+  uint8_t bit = 8;
+
+  size_t i = 0;
+  while (i < n) {
+    if (bit == 8) {
+      if (w >= cap)
+        return 0;
+      flagPos = w++;
+      out[flagPos] = 0;
+      bit = 0;
+    }
+
+    size_t bestLen = 0, bestOff = 0;
+    if (i + MIN_MATCH <= n) {
+      size_t maxLen = n - i < MAX_MATCH ? n - i : MAX_MATCH;
+      uint16_t cand = s_head[hash3(in + i)];
+      for (uint8_t chain = 0; cand != NO_POS && chain < MAX_CHAIN; ++chain) {
+        if (cand >= i || i - cand > WINDOW)
+          break;
+        size_t len = 0;
+        while (len < maxLen && in[cand + len] == in[i + len])
+          ++len;
+        if (len > bestLen) {
+          bestLen = len;
+          bestOff = i - cand;
+          if (len == maxLen)
+            break;
+        }
+        uint16_t next = s_prev[cand & (WINDOW - 1)];
+        if (next != NO_POS && next >= cand)
+          break;   // slot reused by a newer position
+        cand = next;
+      }
+    }
+
+    if (bestLen >= MIN_MATCH) {
+      if (w + 2 > cap)
+        return 0;
+      uint16_t code = (uint16_t)(((bestOff - 1) << 6) | (bestLen - MIN_MATCH));
+      out[w++] = (uint8_t)(code >> 8);
+      out[w++] = (uint8_t)code;
+      for (size_t k = 0; k < bestLen; ++k)
+        insert(i + k);
+      i += bestLen;
+    } else {
+      if (w + 1 > cap)
+        return 0;
+      out[flagPos] |= (uint8_t)(1u << bit);
+      out[w++] = in[i];
+      insert(i);
+      ++i;
+    }
+    ++bit;
+  }
+  return w < n ? w : 0;
+}
+
+size_t Lzss::decompress(const uint8_t *in, size_t n, uint8_t *out, size_t outLen) {
+  if (!in || !out || n < 2)
+    return 0;
+  size_t total = ((size_t)in[0] << 8) | in[1];
+  if (total > outLen)
+    return 0;
+
+  size_t r = 2, w = 0;
+  while (w < total) {
+    if (r >= n)
+      return 0;
+    uint8_t flags = in[r++];
+    for (uint8_t bit = 0; bit < 8 && w < total; ++bit) {
+      if (flags & (1u << bit)) {
+        if (r >= n)
+          return 0;
+        out[w++] = in[r++];
+        continue;
+      }
+      if (r + 2 > n)
+        return 0;
+      uint16_t code = (uint16_t)((in[r] << 8) | in[r + 1]);
+      r += 2;
+      size_t off = (size_t)(code >> 6) + 1;
+      size_t len = (size_t)(code & 0x3F) + MIN_MATCH;
+      if (off > w || w + len > total)
+        return 0;
+      for (size_t k = 0; k < len; ++k, ++w)   // may overlap: byte by byte
+        out[w] = out[w - off];
+    }
+  }
+  return total;
+}
+
+} // namespace ED_MQTT
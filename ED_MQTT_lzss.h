@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_MQTT {
+
+/**
+ * Small LZSS codec for MQTT payloads (heatshrink-class working set).
+ *
+ * Stream format ("lzss" in the MQTT5 "enc" user property):
+ *   [len_hi][len_lo]              original length, big endian (max 65535)
+ *   then groups of one flag byte followed by up to 8 items, LSB first:
+ *     flag bit 1  literal   1 byte
+ *     flag bit 0  match     2 bytes, big endian: (offset-1) << 6 | (length-3)
+ *                           offset 1..1024, length 3..66
+ *
+ * The compressor keeps a hash-chain index in static tables (~3 KB) behind a
+ * mutex, so concurrent callers (publish path, diag history) take turns. The
+ * decompressor has no state beyond the output buffer.
+ */
+class Lzss {
+public:
+  static constexpr size_t WINDOW = 1024;
+  static constexpr size_t MIN_MATCH = 3;
+  static constexpr size_t MAX_MATCH = 66;
+  static constexpr const char *NAME = "lzss";
+
+  /// Returns the compressed size, or 0 when the output would not be smaller
+  /// than the input (or does not fit out).
+  static size_t compress(const uint8_t *in, size_t n, uint8_t *out, size_t outLen);
+
+  /// Returns the decompressed size, or 0 on a malformed stream or when the
+  /// result does not fit out.
+  static size_t decompress(const uint8_t *in, size_t n, uint8_t *out, size_t outLen);
+
+private:
+  static size_t compressLocked(const uint8_t *in, size_t n, uint8_t *out, size_t outLen);
+};
+
+} // namespace ED_MQTT
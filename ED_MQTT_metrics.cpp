@@ -0,0 +1,253 @@
+#include "ED_MQTT_metrics.h"
+#include "esp_log.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <freertos/FreeRTOS.h>
+
+// Short float updates: a spinlock, not a mutex.
+static portMUX_TYPE s_metrics_mux = portMUX_INITIALIZER_UNLOCKED;
+
+namespace ED_MQTT_dispatcher {
+
+static const char *TAG = "MQTTmetrics";
+
+// ── Static members ───────────────────────────────────────────────────
+MetricAggregator::Metric MetricAggregator::s_metrics[MAX_METRICS] = {};
+uint8_t MetricAggregator::s_count = 0;
+MetricAggregator::IsrSlot MetricAggregator::s_isr_slots[METRIC_ISR_SLOTS] = {};
+std::atomic<uint32_t> MetricAggregator::s_isr_head{0};
+uint32_t MetricAggregator::s_isr_tail = 0;
+std::atomic<uint32_t> MetricAggregator::s_isr_dropped{0};
+uint32_t MetricAggregator::s_isr_dropped_reported = 0;
+
+// ── P² quantile estimator ────────────────────────────────────────────
+void MetricAggregator::P2::reset() { count = 0; }
+
+void MetricAggregator::P2::add(float x, float p) {
+    if (count < 5) {
+        q[count++] = x;
+        if (count == 5) {
+            for (int i = 1; i < 5; ++i)   // insertion sort of the first five
+                for (int j = i; j > 0 && q[j] < q[j - 1]; --j) {
+                    float t = q[j];
+                    q[j] = q[j - 1];
+                    q[j - 1] = t;
+                }
+            for (int i = 0; i < 5; ++i) n[i] = i + 1;
+            np[0] = 1;
+            np[1] = 1 + 2 * p;
+            np[2] = 1 + 4 * p;
+            np[3] = 3 + 2 * p;
+            np[4] = 5;
+        }
+        return;
+    }
+
+    int k;
+    if (x < q[0]) {
+        q[0] = x;
+        k = 0;
+    } else if (x < q[1]) {
+        k = 0;
+    } else if (x < q[2]) {
+        k = 1;
+    } else if (x < q[3]) {
+        k = 2;
+    } else if (x <= q[4]) {
+        k = 3;
+    } else {
+        q[4] = x;
+        k = 3;
+    }
+    for (int i = k + 1; i < 5; ++i) ++n[i];
+    const float dn[5] = {0, p / 2, p, (1 + p) / 2, 1};
+    for (int i = 0; i < 5; ++i) np[i] += dn[i];
+
+    for (int i = 1; i < 4; ++i) {
+        float d = np[i] - (float)n[i];
+        if ((d >= 1 && n[i + 1] - n[i] > 1) || (d <= -1 && n[i - 1] - n[i] < -1)) {
+            int s = d > 0 ? 1 : -1;
+            // Piecewise-parabolic prediction, linear if it leaves the bracket.
+            float qp = q[i] + (float)s / (float)(n[i + 1] - n[i - 1]) *
+                                  ((float)(n[i] - n[i - 1] + s) * (q[i + 1] - q[i]) /
+                                       (float)(n[i + 1] - n[i]) +
+                                   (float)(n[i + 1] - n[i] - s) * (q[i] - q[i - 1]) /
+                                       (float)(n[i] - n[i - 1]));
+            if (q[i - 1] < qp && qp < q[i + 1])
+                q[i] = qp;
+            else
+                q[i] += (float)s * (q[i + s] - q[i]) / (float)(n[i + s] - n[i]);
+            n[i] += s;
+        }
+    }
+}
+
+float MetricAggregator::P2::value(float p) const {
+    if (count >= 5)
+        return q[2];
+    if (count == 0)
+        return NAN;
+    float v[5];
+    memcpy(v, q, count * sizeof(float));
+    for (int i = 1; i < count; ++i)
+        for (int j = i; j > 0 && v[j] < v[j - 1]; --j) {
+            float t = v[j];
+            v[j] = v[j - 1];
+            v[j - 1] = t;
+        }
+    return v[(int)lroundf(p * (float)(count - 1))];
+}
+
+// ── MetricAggregator ─────────────────────────────────────────────────
+MetricId MetricAggregator::define(const char *name, float quantile, float isrScale) {
+    if (!name || !name[0])
+        return -1;
+    if (quantile <= 0.0f || quantile >= 1.0f)
+        quantile = 0.0f;
+
+    MetricId id = -1;
+    taskENTER_CRITICAL(&s_metrics_mux);
+    // No ISR can push before it holds an id: the ring is set up here.
+    if (s_count == 0 && s_isr_head.load(std::memory_order_relaxed) == 0)
+        for (uint8_t i = 0; i < METRIC_ISR_SLOTS; ++i)
+            s_isr_slots[i].seq.store(i, std::memory_order_relaxed);
+    for (uint8_t i = 0; i < s_count; ++i)
+        if (strncmp(s_metrics[i].name, name, METRIC_NAME_LEN - 1) == 0) {
+            id = (MetricId)i;
+            break;
+        }
+    if (id < 0 && s_count < MAX_METRICS) {
+        Metric &m = s_metrics[s_count];
+        m = {};
+        strncpy(m.name, name, METRIC_NAME_LEN - 1);
+        m.quantile = quantile;
+        m.isrScale = std::isfinite(isrScale) ? isrScale : 1.0f;
+        id = (MetricId)s_count++;
+    }
+    taskEXIT_CRITICAL(&s_metrics_mux);
+
+    if (id < 0)
+        ESP_LOGE(TAG, "metric table full (max %d), '%s' dropped", MAX_METRICS, name);
+    return id;
+}
+
+void MetricAggregator::accumulate(Metric &m, float v) {
+    if (m.n == 0) {
+        m.min = m.max = v;
+        m.sum = 0;
+    } else {
+        if (v < m.min) m.min = v;
+        if (v > m.max) m.max = v;
+    }
+    m.sum += v;
+    m.last = v;
+    ++m.n;
+    if (m.quantile > 0.0f)
+        m.p2.add(v, m.quantile);
+}
+
+void MetricAggregator::push(MetricId id, float value) {
+    if (id < 0 || id >= (MetricId)s_count || !std::isfinite(value))
+        return;
+    taskENTER_CRITICAL(&s_metrics_mux);
+    accumulate(s_metrics[id], value);
+    taskEXIT_CRITICAL(&s_metrics_mux);
+}
+
+void MetricAggregator::pushFromISR(MetricId id, int32_t value) {
+    if (id < 0 || id >= (MetricId)s_count)
+        return;
+    uint32_t pos = s_isr_head.load(std::memory_order_relaxed);
+    IsrSlot *slot;
+    for (;;) {
+        slot = &s_isr_slots[pos & (METRIC_ISR_SLOTS - 1)];
+        const int32_t diff =
+            (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (s_isr_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;   // slot claimed
+        } else if (diff < 0) {
+            s_isr_dropped.fetch_add(1, std::memory_order_relaxed);   // full
+            return;
+        } else {
+            pos = s_isr_head.load(std::memory_order_relaxed);   // another ISR got it
+        }
+    }
+    slot->id = id;
+    slot->value = value;
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+// Moves queued ISR samples into their metrics. Diag builder only.
+void MetricAggregator::drainISR() {
+    for (;;) {
+        IsrSlot &slot = s_isr_slots[s_isr_tail & (METRIC_ISR_SLOTS - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != s_isr_tail + 1)
+            break;   // empty
+        const MetricId id = slot.id;
+        const int32_t value = slot.value;
+        slot.seq.store(s_isr_tail + METRIC_ISR_SLOTS, std::memory_order_release);
+        ++s_isr_tail;
+
+        taskENTER_CRITICAL(&s_metrics_mux);
+        Metric &m = s_metrics[id];
+        accumulate(m, (float)value * m.isrScale);
+        taskEXIT_CRITICAL(&s_metrics_mux);
+    }
+    const uint32_t dropped = s_isr_dropped.load(std::memory_order_relaxed);
+    if (dropped != s_isr_dropped_reported) {
+        ESP_LOGW(TAG, "%lu ISR samples dropped, raise ED_MQTT_METRIC_ISR_SLOTS",
+                 (unsigned long)(dropped - s_isr_dropped_reported));
+        s_isr_dropped_reported = dropped;
+    }
+}
+
+bool MetricAggregator::pending() {
+    drainISR();
+    bool any = false;
+    taskENTER_CRITICAL(&s_metrics_mux);
+    for (uint8_t i = 0; i < s_count && !any; ++i)
+        any = s_metrics[i].n > 0;
+    taskEXIT_CRITICAL(&s_metrics_mux);
+    return any;
+}
+
+void MetricAggregator::writeFields(ED_MQTT::FieldWriter &w) {
+    if (s_count == 0)
+        return;
+    drainISR();
+    w.beginObject("metrics");
+    for (uint8_t i = 0; i < s_count; ++i) {
+        // Snapshot and reset under the lock, format outside it.
+        taskENTER_CRITICAL(&s_metrics_mux);
+        Metric m = s_metrics[i];
+        s_metrics[i].n = 0;
+        s_metrics[i].p2.reset();
+        taskEXIT_CRITICAL(&s_metrics_mux);
+
+        w.beginObject(m.name);
+        w.addInt("n", m.n);
+        if (m.n > 0) {
+            w.addFloat("min", m.min);
+            w.addFloat("max", m.max);
+            w.addFloat("avg", m.sum / (float)m.n);
+            w.addFloat("last", m.last);
+            if (m.quantile > 0.0f) {
+                char key[8];
+                snprintf(key, sizeof key, "p%d", (int)lroundf(m.quantile * 100.0f));
+                w.addFloat(key, m.p2.value(m.quantile));
+            }
+        }
+        w.endObject();
+    }
+    w.endObject();
+}
+
+void MetricAggregator::memoryReport(ED_MQTT::MemoryReport &report) {
+    report.row("metrics", s_count, MAX_METRICS, sizeof s_metrics);
+    report.row("metrics.isr", s_isr_head.load() - s_isr_tail, METRIC_ISR_SLOTS,
+               sizeof s_isr_slots);
+}
+
+} // namespace ED_MQTT_dispatcher
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "ED_MQTT_config.h"
+#include "ED_MQTT_encode.h"
+#include "ED_mqtt.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_MQTT_dispatcher {
+
+/**
+ * Windowed aggregation of numeric telemetry.
+ *
+ * Producers push samples at any rate from any task; each metric keeps
+ * count/min/max/mean/last and, optionally, one streaming quantile (P²
+ * estimator, Jain & Chlamtac 1985: five markers, O(1) per sample, no sample
+ * storage). Every diag message carries the aggregates of the window since
+ * the previous one, next to "diagnostics", and starts a new window:
+ *
+ *   "metrics":{"rssi":{"n":120,"min":-71,"max":-58,"avg":-62.4,"last":-60,"p95":-59}}
+ *
+ * Fixed table, no heap. A push is a few float operations inside a critical
+ * section. ISRs push an integer sample instead: one CAS into a small
+ * lock-free ring (METRIC_ISR_SLOTS), scaled and aggregated in task context
+ * when the diag message is built. A full ring drops the sample (logged
+ * then).
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint8_t MAX_METRICS     = ED_MQTT_MAX_METRICS;
+static constexpr uint8_t METRIC_NAME_LEN = 16;
+static constexpr uint8_t METRIC_ISR_SLOTS = ED_MQTT_METRIC_ISR_SLOTS;
+static_assert(ED_MQTT_MAX_METRICS > 0 && ED_MQTT_MAX_METRICS <= 127,
+              "ED_MQTT_MAX_METRICS must be 1..127");
+static_assert(ED_MQTT_METRIC_ISR_SLOTS >= 4 && ED_MQTT_METRIC_ISR_SLOTS <= 128 &&
+                  (ED_MQTT_METRIC_ISR_SLOTS & (ED_MQTT_METRIC_ISR_SLOTS - 1)) == 0,
+              "ED_MQTT_METRIC_ISR_SLOTS must be a power of two, 4..128");
+
+using MetricId = int8_t;   // -1: not defined
+
+class MetricAggregator {
+public:
+    /// Declare a metric. quantile in (0,1) adds a streaming quantile
+    /// (e.g. 0.95 → "p95"); 0 disables it. pushFromISR() samples are
+    /// multiplied by isrScale (e.g. 0.001 for mV → V). Returns -1 when the
+    /// table is full.
+    static MetricId define(const char* name, float quantile = 0.0f,
+                           float isrScale = 1.0f);
+
+    static void push(MetricId id, float value);
+    /// ISR-safe: no float math, no lock. Aggregated at the next diag tick.
+    static void pushFromISR(MetricId id, int32_t value);
+
+    /// True when any metric received a sample in the current window.
+    static bool pending();
+    /// Emit every metric as a "metrics" object and start a new window.
+    static void writeFields(ED_MQTT::FieldWriter& w);
+
+    static void memoryReport(ED_MQTT::MemoryReport& report);
+
+private:
+    /// P² single-quantile estimator.
+    struct P2 {
+        float   q[5];    // marker heights
+        float   np[5];   // desired marker positions
+        int32_t n[5];    // actual marker positions (1-based)
+        uint8_t count;   // samples seen, saturates at 5
+        void    reset();
+        void    add(float x, float p);
+        float   value(float p) const;
+    };
+
+    struct Metric {
+        char     name[METRIC_NAME_LEN];
+        float    quantile;   // 0: none
+        float    isrScale;
+        uint32_t n;
+        float    min, max, sum, last;
+        P2       p2;
+    };
+
+    struct IsrSlot {
+        std::atomic<uint32_t> seq;   // == position: free, == position + 1: filled
+        MetricId id;
+        int32_t  value;
+    };
+
+    static void accumulate(Metric& m, float v);
+    static void drainISR();
+
+    static Metric  s_metrics[MAX_METRICS];
+    static uint8_t s_count;
+    static IsrSlot s_isr_slots[METRIC_ISR_SLOTS];
+    static std::atomic<uint32_t> s_isr_head;   // next position to fill (ISRs)
+    static uint32_t s_isr_tail;                // next position to drain (diag builder)
+    static std::atomic<uint32_t> s_isr_dropped;
+    static uint32_t s_isr_dropped_reported;
+};
+
+} // namespace ED_MQTT_dispatcher
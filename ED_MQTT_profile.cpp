@@ -0,0 +1,195 @@
+#include "ED_MQTT_profile.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include <cstring>
+
+namespace ED_MQTT {
+
+static const char *TAG = "MQTTprof";
+
+// Guards the hook table: record() runs in the MQTT event task, the
+// supervisor and the command paths; only short copies happen inside.
+static portMUX_TYPE s_prof_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *const kKindNames[] = {"data", "route", "connected", "provider",
+                                         "command"};
+
+// ── Static members ───────────────────────────────────────────────────
+HookProfiler::Hook HookProfiler::s_hooks[MAX_HOOKS] = {};
+uint8_t HookProfiler::s_count = 0;
+uint32_t HookProfiler::s_over = 0;
+HookProfiler::Id HookProfiler::s_last_over = -1;
+uint32_t HookProfiler::s_last_over_us = 0;
+
+// ── Slots ────────────────────────────────────────────────────────────
+HookProfiler::Id HookProfiler::addLocked(HookKind kind, const char *name) {
+  if (s_count >= MAX_HOOKS)
+    return -1;
+  Hook &h = s_hooks[s_count];
+  h = {};
+  strncpy(h.name, name ? name : "?", sizeof h.name - 1);
+  h.kind = kind;
+  return (Id)s_count++;
+}
+
+HookProfiler::Id HookProfiler::add(HookKind kind, const char *name) {
+  taskENTER_CRITICAL(&s_prof_mux);
+  const Id id = addLocked(kind, name);
+  taskEXIT_CRITICAL(&s_prof_mux);
+  if (id < 0)
+    ESP_LOGW(TAG, "hook table full (max %d, raise ED_MQTT_MAX_HOOKS), '%s' not profiled",
+             MAX_HOOKS, name ? name : "?");
+  return id;
+}
+
+HookProfiler::Id HookProfiler::lookup(HookKind kind, const char *name) {
+  if (!name)
+    return -1;
+  Id id = -1;
+  bool full = false;
+  taskENTER_CRITICAL(&s_prof_mux);
+  for (uint8_t i = 0; i < s_count; ++i)
+    if (s_hooks[i].kind == kind && strncmp(s_hooks[i].name, name, HOOK_NAME_LEN - 1) == 0) {
+      id = (Id)i;
+      break;
+    }
+  if (id < 0) {
+    id = addLocked(kind, name);
+    full = id < 0;
+  }
+  taskEXIT_CRITICAL(&s_prof_mux);
+  if (full)
+    ESP_LOGD(TAG, "hook table full, '%s' not profiled", name);
+  return id;
+}
+
+bool HookProfiler::setBudget(const char *name, uint32_t budgetUs) {
+  if (!name)
+    return false;
+  bool found = false;
+  taskENTER_CRITICAL(&s_prof_mux);
+  for (uint8_t i = 0; i < s_count; ++i)
+    if (strncmp(s_hooks[i].name, name, HOOK_NAME_LEN - 1) == 0) {
+      s_hooks[i].budgetUs = budgetUs;
+      found = true;
+    }
+  taskEXIT_CRITICAL(&s_prof_mux);
+  return found;
+}
+
+void HookProfiler::reset() {
+  taskENTER_CRITICAL(&s_prof_mux);
+  for (uint8_t i = 0; i < s_count; ++i) {
+    Hook &h = s_hooks[i];
+    h.calls = h.migrated = h.maxUs = h.over = 0;
+    h.totalUs = 0;
+    memset(h.hist, 0, sizeof h.hist);
+  }
+  s_over = 0;
+  s_last_over = -1;
+  s_last_over_us = 0;
+  taskEXIT_CRITICAL(&s_prof_mux);
+}
+
+// ── Recording ────────────────────────────────────────────────────────
+uint32_t HookProfiler::cyclesPerUs() {
+  // Kept current by the clock driver, so it follows frequency changes.
+  const uint32_t mhz = esp_rom_get_cpu_ticks_per_us();
+  return mhz > 0 ? mhz : 1;
+}
+
+void HookProfiler::record(Id id, uint32_t startCycles, int startCore) {
+  if (id < 0 || id >= (Id)MAX_HOOKS)
+    return;
+  const uint32_t cycles = (uint32_t)esp_cpu_get_cycle_count() - startCycles;   // wraps
+  const bool migrated = esp_cpu_get_core_id() != startCore;
+  const uint32_t us = cycles / cyclesPerUs();
+  uint8_t bucket = 0;
+  for (uint32_t edge = 64; bucket < HOOK_BUCKETS - 1 && us >= edge; edge <<= 2)
+    ++bucket;
+
+  bool firstOver = false;
+  taskENTER_CRITICAL(&s_prof_mux);
+  Hook &h = s_hooks[id];
+  if (migrated) {
+    ++h.migrated;
+  } else {
+    ++h.calls;
+    h.totalUs += us;
+    if (us > h.maxUs)
+      h.maxUs = us;
+    ++h.hist[bucket];
+    if (us > (h.budgetUs ? h.budgetUs : HOOK_BUDGET_US)) {
+      firstOver = h.over++ == 0;
+      ++s_over;
+      s_last_over = id;
+      s_last_over_us = us;
+    }
+  }
+  taskEXIT_CRITICAL(&s_prof_mux);
+
+  if (firstOver)
+    ESP_LOGW(TAG, "%s hook '%s' took %lu us (budget %lu us)",
+             kKindNames[(uint8_t)h.kind], h.name, (unsigned long)us,
+             (unsigned long)(h.budgetUs ? h.budgetUs : HOOK_BUDGET_US));
+}
+
+HookTimer::HookTimer(HookProfiler::Id id)
+    : m_id(id), m_core(esp_cpu_get_core_id()),
+      m_start((uint32_t)esp_cpu_get_cycle_count()) {}
+
+HookTimer::~HookTimer() { HookProfiler::record(m_id, m_start, m_core); }
+
+// ── Reporting ────────────────────────────────────────────────────────
+void HookProfiler::writeFields(FieldWriter &w) {
+  char name[HOOK_NAME_LEN] = "";
+  taskENTER_CRITICAL(&s_prof_mux);
+  const uint32_t over = s_over;
+  const uint32_t us = s_last_over_us;
+  if (s_last_over >= 0)
+    memcpy(name, s_hooks[s_last_over].name, sizeof name);
+  taskEXIT_CRITICAL(&s_prof_mux);
+  w.addInt("d_HOOKV", over);
+  w.addString("d_HOOKN", name);
+  w.addInt("d_HOOKUS", us);
+}
+
+size_t HookProfiler::writeReport(FieldWriter &w) {
+  w.beginObject();
+  w.addInt("budget_us", HOOK_BUDGET_US);
+  w.beginArray("hooks");
+  for (uint8_t i = 0; i < MAX_HOOKS; ++i) {
+    taskENTER_CRITICAL(&s_prof_mux);
+    const bool valid = i < s_count;
+    const Hook h = valid ? s_hooks[i] : Hook{};
+    taskEXIT_CRITICAL(&s_prof_mux);
+    if (!valid)
+      break;
+    w.beginObject();
+    w.addString("name", h.name);
+    w.addString("kind", kKindNames[(uint8_t)h.kind]);
+    w.addInt("n", h.calls);
+    w.addInt("avg_us", h.calls ? (int64_t)(h.totalUs / h.calls) : 0);
+    w.addInt("max_us", h.maxUs);
+    if (h.budgetUs)
+      w.addInt("budget_us", h.budgetUs);
+    w.addInt("over", h.over);
+    if (h.migrated)
+      w.addInt("migrated", h.migrated);
+    w.beginArray("hist");
+    for (uint8_t b = 0; b < HOOK_BUCKETS; ++b)
+      w.addInt(nullptr, h.hist[b]);
+    w.endArray();
+    w.endObject();
+  }
+  w.endArray();
+  w.endObject();
+  return w.overflow() ? 0 : w.length();
+}
+
+void HookProfiler::memoryReport(MemoryReport &report) {
+  report.row("prof.hooks", s_count, MAX_HOOKS, sizeof s_hooks);
+}
+
+} // namespace ED_MQTT
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "ED_MQTT_config.h"
+#include "ED_MQTT_encode.h"
+#include "ED_mqtt.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_MQTT {
+
+/**
+ * Execution time of user hooks: data, routed and connected callbacks, diag
+ * providers and command functions.
+ *
+ * Each hook gets a slot when it is registered, named after the registration
+ * (the name given, the route filter, the provider name, the command id). A
+ * HookTimer around the call reads the CPU cycle counter on entry and exit,
+ * no system call. Per slot: call count, total and worst time, a histogram
+ * (x4 buckets from 64 us) and the calls over budget. The budget is
+ * ED_MQTT_HOOK_BUDGET_US unless setBudget() says otherwise.
+ *
+ * The first overrun of a hook is logged; diag carries the count and the last
+ * offender (d_HOOKV, d_HOOKN, d_HOOKUS) and ":PROF" publishes the table.
+ * A call that migrates to the other core is not timed (the counters are per
+ * core) and shows as "migrated". Fixed table, no heap.
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint8_t  MAX_HOOKS       = ED_MQTT_MAX_HOOKS;
+static constexpr uint32_t HOOK_BUDGET_US  = ED_MQTT_HOOK_BUDGET_US;
+static constexpr size_t   HOOK_NAME_LEN   = 24;
+static constexpr uint8_t  HOOK_BUCKETS    = 8;   // <64us, <256us, … , >=262ms
+static_assert(ED_MQTT_MAX_HOOKS > 0 && ED_MQTT_MAX_HOOKS <= 127,
+              "ED_MQTT_MAX_HOOKS must be 1..127");
+
+enum class HookKind : uint8_t { DATA, ROUTE, CONNECTED, PROVIDER, COMMAND };
+
+class HookProfiler {
+public:
+  using Id = int8_t;   // -1: not profiled (table full)
+
+  /// Slot for a hook being registered; name is copied (truncated).
+  static Id add(HookKind kind, const char *name);
+  /// Slot of (kind, name), added on first use: for hooks found by name at
+  /// call time (commands).
+  static Id lookup(HookKind kind, const char *name);
+
+  /// Budget of the hooks called name (any kind); 0 restores the default.
+  static bool setBudget(const char *name, uint32_t budgetUs);
+  static void reset();   // counters only, slots and budgets stay
+
+  /// Records a call of id that started at startCycles on core startCore.
+  static void record(Id id, uint32_t startCycles, int startCore);
+
+  /// Diag fields: d_HOOKV calls over budget, d_HOOKN / d_HOOKUS last offender.
+  static void writeFields(FieldWriter &w);
+  /// {"budget_us":…,"hooks":[{"name":…,"kind":…,"n":…,"avg_us":…,"max_us":…,
+  ///   "over":…,"hist":[…]}]}; 0 on overflow.
+  static size_t writeReport(FieldWriter &w);
+  static void memoryReport(MemoryReport &report);
+
+private:
+  struct Hook {
+    char name[HOOK_NAME_LEN];
+    HookKind kind;
+    uint32_t budgetUs;   // 0: default
+    uint32_t calls;
+    uint32_t migrated;
+    uint64_t totalUs;
+    uint32_t maxUs;
+    uint32_t over;
+    uint32_t hist[HOOK_BUCKETS];
+  };
+  static Id addLocked(HookKind kind, const char *name);
+  static uint32_t cyclesPerUs();
+
+  static Hook s_hooks[MAX_HOOKS];
+  static uint8_t s_count;
+  static uint32_t s_over;       // all hooks
+  static Id s_last_over;        // last offender, -1: none
+  static uint32_t s_last_over_us;
+};
+
+/// Times the enclosing scope as one call of hook id.
+class HookTimer {
+public:
+  explicit HookTimer(HookProfiler::Id id);
+  ~HookTimer();
+  HookTimer(const HookTimer &) = delete;
+  HookTimer &operator=(const HookTimer &) = delete;
+
+private:
+  HookProfiler::Id m_id;
+  int m_core;
+  uint32_t m_start;
+};
+
+} // namespace ED_MQTT
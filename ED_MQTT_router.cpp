@@ -0,0 +1,227 @@
+#include "ED_MQTT_router.h"
+#include "esp_log.h"
+#include <cstring>
+#include <freertos/semphr.h>
+
+// Guards the trie: routes are added from any task, matched in the MQTT
+// event task.
+static StaticSemaphore_t s_router_mutex_buffer;
+static SemaphoreHandle_t s_router_mutex = nullptr;
+
+static SemaphoreHandle_t get_router_mutex() {
+  if (s_router_mutex == nullptr) {
+    s_router_mutex = xSemaphoreCreateMutexStatic(&s_router_mutex_buffer);
+    configASSERT(s_router_mutex);
+  }
+  return s_router_mutex;
+}
+
+namespace ED_MQTT {
+
+static const char *TAG = "MQTTroute";
+
+// ── Static members ───────────────────────────────────────────────────
+TopicRouter::Node TopicRouter::s_nodes[ROUTE_NODES] = {};
+uint8_t TopicRouter::s_node_count = 0;
+int8_t TopicRouter::s_root = -1;
+char TopicRouter::s_text[ROUTE_TEXT_LEN] = {};
+uint16_t TopicRouter::s_text_used = 0;
+MqttDataCallback TopicRouter::s_routes[MAX_DATA_ROUTES] = {};
+uint8_t TopicRouter::s_route_count = 0;
+
+// ── Trie construction ────────────────────────────────────────────────
+bool TopicRouter::segmentEquals(const Node &n, const char *seg, size_t len) {
+  return n.kind == LITERAL && n.textLen == len &&
+         memcmp(s_text + n.textOff, seg, len) == 0;
+}
+
+// Node for one filter level among the siblings starting at *head; appended
+// when missing. Returns -1 when a pool is full.
+int8_t TopicRouter::findOrAdd(int8_t *head, const char *seg, size_t len) {
+  const Kind kind = (len == 1 && seg[0] == '+')   ? PLUS
+                    : (len == 1 && seg[0] == '#') ? HASH
+                                                  : LITERAL;
+  int8_t *link = head;
+  for (int8_t i = *head; i >= 0; i = s_nodes[i].sibling) {
+    const Node &n = s_nodes[i];
+    if (n.kind == kind && (kind != LITERAL || segmentEquals(n, seg, len)))
+      return i;
+    link = &s_nodes[i].sibling;
+  }
+  if (s_node_count >= ROUTE_NODES) {
+    ESP_LOGE(TAG, "node pool full (max %d, raise ED_MQTT_ROUTE_NODES)", ROUTE_NODES);
+    return -1;
+  }
+  if (kind == LITERAL && (len > 255 || s_text_used + len > ROUTE_TEXT_LEN)) {
+    ESP_LOGE(TAG, "text pool full (%u bytes, raise ED_MQTT_ROUTE_TEXT_LEN)",
+             (unsigned)ROUTE_TEXT_LEN);
+    return -1;
+  }
+  const int8_t id = (int8_t)s_node_count++;
+  Node &n = s_nodes[id];
+  n = {};
+  n.kind = kind;
+  n.child = -1;
+  n.sibling = -1;
+  if (kind == LITERAL) {
+    memcpy(s_text + s_text_used, seg, len);
+    n.textOff = s_text_used;
+    n.textLen = (uint8_t)len;
+    s_text_used = (uint16_t)(s_text_used + len);
+  }
+  *link = id;
+  return id;
+}
+
+int TopicRouter::add(const char *filter, MqttDataCallback callback) {
+  if (!filter || !filter[0] || !callback) {
+    ESP_LOGE(TAG, "route needs a filter and a callback");
+    return -1;
+  }
+  // '+' and '#' must fill their level, '#' must be the last one.
+  for (const char *p = filter; *p; ++p) {
+    const bool levelStart = p == filter || p[-1] == '/';
+    const bool levelEnd = p[1] == '\0' || p[1] == '/';
+    if ((*p == '+' && !(levelStart && levelEnd)) ||
+        (*p == '#' && !(levelStart && p[1] == '\0'))) {
+      ESP_LOGE(TAG, "malformed filter '%s'", filter);
+      return -1;
+    }
+  }
+
+  SemaphoreHandle_t mutex = get_router_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  if (s_route_count >= MAX_DATA_ROUTES) {
+    xSemaphoreGive(mutex);
+    ESP_LOGE(TAG, "route table full (max %d, raise ED_MQTT_MAX_DATA_ROUTES), '%s' dropped",
+             MAX_DATA_ROUTES, filter);
+    return -1;
+  }
+  // Nodes created before a pool runs out stay, without routes: harmless.
+  int8_t *head = &s_root;
+  int8_t node = -1;
+  for (const char *seg = filter;;) {
+    const char *end = strchr(seg, '/');
+    const size_t len = end ? (size_t)(end - seg) : strlen(seg);
+    node = findOrAdd(head, seg, len);
+    if (node < 0 || !end)
+      break;
+    head = &s_nodes[node].child;
+    seg = end + 1;
+  }
+  int id = -1;
+  if (node >= 0) {
+    id = s_route_count++;
+    s_routes[id] = callback;
+    s_nodes[node].routes |= 1u << id;
+  }
+  xSemaphoreGive(mutex);
+  if (id >= 0)
+    ESP_LOGD(TAG, "route %d: %s (%u nodes)", id, filter, s_node_count);
+  return id;
+}
+
+// ── Matching ─────────────────────────────────────────────────────────
+uint32_t TopicRouter::match(const char *topic, int topicLen) {
+  if (!topic || topicLen < 0)
+    return 0;
+  const size_t len = (size_t)topicLen;
+  const bool dollar = len > 0 && topic[0] == '$';
+
+  // Depth-first over the trie: each frame is a sibling list to try against
+  // the topic level starting at pos.
+  struct Frame {
+    int8_t first;
+    uint16_t pos;
+  };
+  Frame stack[ROUTE_STACK];
+  uint8_t sp = 0;
+  uint32_t hits = 0;
+  bool truncated = false;
+
+  SemaphoreHandle_t mutex = get_router_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  if (s_root >= 0)
+    stack[sp++] = {s_root, 0};
+  while (sp > 0) {
+    const Frame f = stack[--sp];
+    size_t end = f.pos;
+    while (end < len && topic[end] != '/')
+      ++end;
+    const bool last = end >= len;
+    const bool noWildcard = dollar && f.pos == 0;
+
+    for (int8_t i = f.first; i >= 0; i = s_nodes[i].sibling) {
+      const Node &n = s_nodes[i];
+      if (n.kind == HASH) {
+        if (!noWildcard)
+          hits |= n.routes;
+        continue;
+      }
+      if (n.kind == PLUS ? noWildcard
+                         : !segmentEquals(n, topic + f.pos, end - f.pos))
+        continue;
+      if (last) {
+        hits |= n.routes;
+        // "a/#" also matches "a".
+        for (int8_t c = n.child; c >= 0; c = s_nodes[c].sibling)
+          if (s_nodes[c].kind == HASH)
+            hits |= s_nodes[c].routes;
+      } else if (n.child >= 0) {
+        if (sp < ROUTE_STACK)
+          stack[sp++] = {n.child, (uint16_t)(end + 1)};
+        else
+          truncated = true;
+      }
+    }
+  }
+  xSemaphoreGive(mutex);
+  if (truncated)
+    ESP_LOGW(TAG, "match of '%.*s' truncated (> %d branches)", topicLen, topic,
+             ROUTE_STACK);
+  return hits;
+}
+
+bool TopicRouter::matches(const char *filter, const char *topic, int topicLen) {
+  if (!filter || !topic || topicLen < 0)
+    return false;
+  const size_t len = (size_t)topicLen;
+  const bool dollar = len > 0 && topic[0] == '$';
+  size_t pos = 0;
+  bool more = true;   // the topic has a level at pos
+  for (const char *f = filter;;) {
+    const char *fend = strchr(f, '/');
+    const size_t flen = fend ? (size_t)(fend - f) : strlen(f);
+    const bool noWildcard = dollar && pos == 0;
+    if (flen == 1 && f[0] == '#')
+      return !noWildcard;   // the rest, parent level included ("a/#" ~ "a")
+    if (!more)
+      return false;
+    size_t end = pos;
+    while (end < len && topic[end] != '/')
+      ++end;
+    if (flen == 1 && f[0] == '+') {
+      if (noWildcard)
+        return false;
+    } else if (flen != end - pos || memcmp(f, topic + pos, flen) != 0) {
+      return false;
+    }
+    more = end < len;
+    pos = end + 1;
+    if (!fend)
+      return !more;
+    f = fend + 1;
+  }
+}
+
+MqttDataCallback TopicRouter::callback(uint8_t route) {
+  return route < s_route_count ? s_routes[route] : nullptr;
+}
+
+void TopicRouter::memoryReport(MemoryReport &report) {
+  report.row("route.callbacks", s_route_count, MAX_DATA_ROUTES, sizeof s_routes);
+  report.row("route.nodes", s_node_count, ROUTE_NODES, sizeof s_nodes);
+  report.row("route.text", s_text_used, ROUTE_TEXT_LEN, sizeof s_text);   // bytes
+}
+
+} // namespace ED_MQTT
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "ED_MQTT_config.h"
+#include "ED_mqtt.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace ED_MQTT {
+
+/**
+ * Topic-filter routing of incoming messages to data callbacks.
+ *
+ * Filters ('+' one level, '#' the rest, as in MQTT) are compiled into a trie
+ * of topic levels when a callback is registered:
+ *
+ *   MqttClient::registerDataCallback("sensors/+/set", on_set);
+ *   MqttClient::registerDataCallback("cmd/#", on_cmd);
+ *
+ * A message walks the trie once, whatever the number of routes, and yields
+ * the set of matching routes; each callback is then called once, in
+ * registration order. As in MQTT, wildcards at the first level do not match
+ * topics starting with '$'. Filters sharing a prefix share its nodes.
+ *
+ * Fixed node pool and segment text pool, no heap. Routes cannot be removed.
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint8_t MAX_DATA_ROUTES  = ED_MQTT_MAX_DATA_ROUTES;
+static constexpr uint8_t ROUTE_NODES      = ED_MQTT_ROUTE_NODES;
+static constexpr size_t  ROUTE_TEXT_LEN   = ED_MQTT_ROUTE_TEXT_LEN;
+static constexpr uint8_t ROUTE_STACK      = 16;   // pending branches per match
+static_assert(ED_MQTT_MAX_DATA_ROUTES > 0 && ED_MQTT_MAX_DATA_ROUTES <= 32,
+              "ED_MQTT_MAX_DATA_ROUTES must be 1..32 (route set is a 32-bit mask)");
+static_assert(ED_MQTT_ROUTE_NODES > 0 && ED_MQTT_ROUTE_NODES <= 127,
+              "ED_MQTT_ROUTE_NODES must be 1..127");
+static_assert(ED_MQTT_ROUTE_TEXT_LEN >= 16 && ED_MQTT_ROUTE_TEXT_LEN <= 0xFFFF,
+              "ED_MQTT_ROUTE_TEXT_LEN must be 16..65535");
+
+class TopicRouter {
+public:
+  /// Compile filter into the trie. Returns the route id, -1 when the filter
+  /// is malformed or a pool is full.
+  static int add(const char *filter, MqttDataCallback callback);
+
+  /// Bit i set: route i matches topic (topicLen bytes, not null-terminated).
+  static uint32_t match(const char *topic, int topicLen);
+  /// Single-filter test with the same semantics as match(), for code that
+  /// keeps its own filters (coroutine flows, topic encodings).
+  static bool matches(const char *filter, const char *topic, int topicLen);
+  static MqttDataCallback callback(uint8_t route);
+
+  static void memoryReport(MemoryReport &report);
+
+private:
+  enum Kind : uint8_t { LITERAL, PLUS, HASH };
+  struct Node {
+    uint16_t textOff;   // LITERAL: segment in s_text
+    uint8_t textLen;
+    Kind kind;
+    int8_t child;       // first child, -1: none
+    int8_t sibling;     // next node of the same level, -1: none
+    uint32_t routes;    // routes whose filter ends here
+  };
+
+  static bool segmentEquals(const Node &n, const char *seg, size_t len);
+  static int8_t findOrAdd(int8_t *head, const char *seg, size_t len);
+
+  static Node s_nodes[ROUTE_NODES];
+  static uint8_t s_node_count;
+  static int8_t s_root;   // first node of level 0
+  static char s_text[ROUTE_TEXT_LEN];
+  static uint16_t s_text_used;
+  static MqttDataCallback s_routes[MAX_DATA_ROUTES];
+  static uint8_t s_route_count;
+};
+
+} // namespace ED_MQTT
@@ -0,0 +1,302 @@
+#include "ED_MQTT_sensors.h"
+#include "ED_MQTT_encode.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <cstdio>
+#include <cstring>
+#include <freertos/semphr.h>
+
+// Guards the batch table: the handler runs in the event loop task,
+// configureTopic() in the caller's.
+static StaticSemaphore_t s_sensor_mutex_buffer;
+static SemaphoreHandle_t s_sensor_mutex = nullptr;
+
+static SemaphoreHandle_t get_sensor_mutex() {
+  if (s_sensor_mutex == nullptr) {
+    s_sensor_mutex = xSemaphoreCreateMutexStatic(&s_sensor_mutex_buffer);
+    configASSERT(s_sensor_mutex);
+  }
+  return s_sensor_mutex;
+}
+
+namespace ED_MQTT {
+
+static const char *TAG = "MQTTsensors";
+
+// Posted by the latency timer only; not part of the public event ids.
+static constexpr int32_t SENSOR_EVENT_TICK = 0x7F00;
+
+// Encoded size bounds, so a batch never overflows s_buf.
+static constexpr size_t BATCH_HEADER_BYTES = 48;   // {"t0":…,"n":…,"s":[…]}
+static constexpr size_t ROW_BYTES = 32;            // [dt,"",value], + key
+
+// ── Static members ───────────────────────────────────────────────────
+esp_event_loop_handle_t SensorBridge::s_loop = nullptr;
+TimerHandle_t SensorBridge::s_tick_timer = nullptr;
+StaticTimer_t SensorBridge::s_tick_timer_buf;
+uint16_t SensorBridge::s_open = 0;
+BatchPolicy SensorBridge::s_default;
+SensorBridge::Batch SensorBridge::s_batches[MAX_SENSOR_TOPICS] = {};
+uint8_t SensorBridge::s_batch_count = 0;
+char SensorBridge::s_buf[SENSOR_BATCH_BUF_LEN] = {};
+uint32_t SensorBridge::s_published = 0;
+uint32_t SensorBridge::s_dropped = 0;
+
+static BatchPolicy clamp(const BatchPolicy &in) {
+  BatchPolicy p = in;
+  if (p.maxSamples == 0 || p.maxSamples > SENSOR_BATCH_SAMPLES)
+    p.maxSamples = SENSOR_BATCH_SAMPLES;
+  if (p.maxBytes < BATCH_HEADER_BYTES + ROW_BYTES + SENSOR_KEY_LEN ||
+      p.maxBytes > SENSOR_BATCH_BUF_LEN)
+    p.maxBytes = (uint16_t)SENSOR_BATCH_BUF_LEN;
+  if (p.qos > 2)
+    p.qos = 1;
+  return p;
+}
+
+// ── Public API ───────────────────────────────────────────────────────
+esp_err_t SensorBridge::start(esp_event_loop_handle_t loop) {
+  if (s_tick_timer) {
+    ESP_LOGW(TAG, "already started");
+    return ESP_ERR_INVALID_STATE;
+  }
+  s_loop = loop;
+  esp_err_t err =
+      loop ? esp_event_handler_instance_register_with(loop, ED_MQTT_SENSOR_EVENTS,
+                                                      ESP_EVENT_ANY_ID, event_handler,
+                                                      nullptr, nullptr)
+           : esp_event_handler_instance_register(ED_MQTT_SENSOR_EVENTS,
+                                                 ESP_EVENT_ANY_ID, event_handler,
+                                                 nullptr, nullptr);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "handler registration failed: %s", esp_err_to_name(err));
+    return err;
+  }
+  s_tick_timer = xTimerCreateStatic("sensor_batch", pdMS_TO_TICKS(SENSOR_TICK_MS),
+                                    pdTRUE, nullptr, tick_timer_cb,
+                                    &s_tick_timer_buf);
+  if (!s_tick_timer || xTimerStart(s_tick_timer, 0) != pdPASS) {
+    ESP_LOGE(TAG, "latency timer not started");
+    return ESP_FAIL;
+  }
+  ESP_LOGI(TAG, "sensor bridge started (%u topics x %u samples)",
+           MAX_SENSOR_TOPICS, SENSOR_BATCH_SAMPLES);
+  return ESP_OK;
+}
+
+bool SensorBridge::configureTopic(const char *topic, const BatchPolicy &policy) {
+  if (!topic || !topic[0] || strlen(topic) >= SENSOR_TOPIC_LEN)
+    return false;
+  SemaphoreHandle_t mutex = get_sensor_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  Batch *b = findBatch(topic, true);
+  if (b) {
+    b->policy = clamp(policy);
+    b->configured = true;
+  }
+  xSemaphoreGive(mutex);
+  return b != nullptr;
+}
+
+void SensorBridge::setDefaultPolicy(const BatchPolicy &policy) {
+  SemaphoreHandle_t mutex = get_sensor_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  s_default = clamp(policy);
+  for (uint8_t i = 0; i < s_batch_count; ++i)
+    if (!s_batches[i].configured)
+      s_batches[i].policy = s_default;
+  xSemaphoreGive(mutex);
+}
+
+esp_err_t SensorBridge::post(const char *topic, const char *key, float value,
+                             TickType_t wait) {
+  SensorSample s = {};
+  strncpy(s.topic, topic ? topic : "", sizeof s.topic - 1);
+  strncpy(s.key, key ? key : "", sizeof s.key - 1);
+  s.value = value;
+  s.timestampUs = esp_timer_get_time();
+  return s_loop ? esp_event_post_to(s_loop, ED_MQTT_SENSOR_EVENTS,
+                                    ED_MQTT_SENSOR_EVENT_DATA_READY, &s, sizeof s, wait)
+                : esp_event_post(ED_MQTT_SENSOR_EVENTS,
+                                 ED_MQTT_SENSOR_EVENT_DATA_READY, &s, sizeof s, wait);
+}
+
+void SensorBridge::memoryReport(MemoryReport &report) {
+  report.row("sensor.batches", s_batch_count, MAX_SENSOR_TOPICS, sizeof s_batches);
+  report.row("sensor.buf", 0, 0, sizeof s_buf);
+}
+
+// ── Event handling (event loop task) ─────────────────────────────────
+void SensorBridge::tick_timer_cb(TimerHandle_t /*handle*/) {
+  if (s_open == 0)
+    return;   // nothing waiting, keep the loop quiet
+  if (s_loop)
+    esp_event_post_to(s_loop, ED_MQTT_SENSOR_EVENTS, SENSOR_EVENT_TICK, nullptr, 0, 0);
+  else
+    esp_event_post(ED_MQTT_SENSOR_EVENTS, SENSOR_EVENT_TICK, nullptr, 0, 0);
+}
+
+void SensorBridge::event_handler(void * /*arg*/, esp_event_base_t /*base*/,
+                                 int32_t id, void *data) {
+  const SensorSample *s = static_cast<const SensorSample *>(data);
+  SemaphoreHandle_t mutex = get_sensor_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+
+  switch (id) {
+  case ED_MQTT_SENSOR_EVENT_DATA_READY:
+    if (s)
+      add(*s);
+    break;
+  case ED_MQTT_SENSOR_EVENT_ERROR:
+    if (s) {
+      if (Batch *b = findBatch(s->topic, false))
+        flush(*b);   // samples before the error go out first
+      publishError(*s);
+    }
+    break;
+  case ED_MQTT_SENSOR_EVENT_FLUSH:
+    if (s && s->topic[0]) {
+      if (Batch *b = findBatch(s->topic, false))
+        flush(*b);
+    } else {
+      for (uint8_t i = 0; i < s_batch_count; ++i)
+        flush(s_batches[i]);
+    }
+    break;
+  case SENSOR_EVENT_TICK:
+    flushExpired(esp_timer_get_time());
+    break;
+  default:
+    break;
+  }
+
+  xSemaphoreGive(mutex);
+}
+
+SensorBridge::Batch *SensorBridge::findBatch(const char *topic, bool create) {
+  for (uint8_t i = 0; i < s_batch_count; ++i)
+    if (strncmp(s_batches[i].topic, topic, SENSOR_TOPIC_LEN) == 0)
+      return &s_batches[i];
+  if (!create)
+    return nullptr;
+  if (s_batch_count >= MAX_SENSOR_TOPICS) {
+    ESP_LOGE(TAG, "topic table full (max %d), '%s' dropped", MAX_SENSOR_TOPICS,
+             topic);
+    return nullptr;
+  }
+  Batch &b = s_batches[s_batch_count++];
+  b = {};
+  strncpy(b.topic, topic, SENSOR_TOPIC_LEN - 1);
+  b.policy = s_default;
+  return &b;
+}
+
+void SensorBridge::add(const SensorSample &s) {
+  if (!s.topic[0]) {
+    ++s_dropped;
+    return;
+  }
+  Batch *b = findBatch(s.topic, true);
+  if (!b) {
+    ++s_dropped;
+    return;
+  }
+
+  const int64_t now = esp_timer_get_time();
+  const int64_t ts = s.timestampUs ? s.timestampUs : now;
+  const size_t keyLen = strnlen(s.key, SENSOR_KEY_LEN - 1);
+  const size_t row = ROW_BYTES + keyLen;
+  if (b->count > 0 && b->bytes + row > b->policy.maxBytes)
+    flush(*b);
+
+  if (b->count == 0) {
+    b->t0Us = ts;
+    b->openedUs = now;
+    b->bytes = BATCH_HEADER_BYTES;
+    ++s_open;
+  }
+  int64_t dt = (ts - b->t0Us) / 1000;
+  if (dt > INT32_MAX) dt = INT32_MAX;
+  if (dt < INT32_MIN) dt = INT32_MIN;
+
+  Entry &e = b->samples[b->count++];
+  memcpy(e.key, s.key, keyLen);
+  e.key[keyLen] = '\0';
+  e.value = s.value;
+  e.dtMs = (int32_t)dt;
+  b->bytes = (uint16_t)(b->bytes + row);
+
+  if (b->count >= b->policy.maxSamples)
+    flush(*b);
+}
+
+void SensorBridge::flushExpired(int64_t nowUs) {
+  for (uint8_t i = 0; i < s_batch_count; ++i) {
+    Batch &b = s_batches[i];
+    if (b.count > 0 &&
+        nowUs - b.openedUs >= (int64_t)b.policy.maxLatencyMs * 1000)
+      flush(b);
+  }
+}
+
+void SensorBridge::flush(Batch &b) {
+  if (b.count == 0)
+    return;
+
+  JsonWriter w(s_buf, sizeof s_buf);
+  w.beginObject();
+  w.addInt("t0", b.t0Us / 1000);
+  w.addInt("n", b.count);
+  w.beginArray("s");
+  for (uint8_t i = 0; i < b.count; ++i) {
+    w.beginArray();
+    w.addInt(nullptr, b.samples[i].dtMs);
+    w.addString(nullptr, b.samples[i].key);
+    w.addFloat(nullptr, b.samples[i].value);
+    w.endArray();
+  }
+  w.endArray();
+  w.endObject();
+
+  const uint8_t n = b.count;
+  b.count = 0;
+  b.bytes = 0;
+  if (s_open)
+    --s_open;
+
+  MqttClient *mqtt = MqttClient::getInstance();
+  if (w.overflow() || !mqtt) {
+    s_dropped += n;
+    ESP_LOGW(TAG, "%s: batch of %u dropped (%s)", b.topic, n,
+             mqtt ? "overflow" : "no client");
+    return;
+  }
+  PublishOptions opts;
+  opts.contentType = contentType(Encoding::JSON);
+  if (mqtt->publishWithId(b.topic, s_buf, (int)w.length(), b.policy.qos, false,
+                          &opts) < 0) {
+    s_dropped += n;
+    ESP_LOGW(TAG, "%s: publish of %u samples failed", b.topic, n);
+    return;
+  }
+  s_published += n;
+}
+
+void SensorBridge::publishError(const SensorSample &s) {
+  MqttClient *mqtt = MqttClient::getInstance();
+  if (!mqtt || !s.topic[0])
+    return;
+  char topic[SENSOR_TOPIC_LEN + 8];
+  snprintf(topic, sizeof topic, "%s/error", s.topic);
+  char msg[96];
+  JsonWriter w(msg, sizeof msg);
+  w.beginObject();
+  w.addString("src", s.key);
+  w.addFloat("code", s.value);
+  w.endObject();
+  if (!w.overflow())
+    mqtt->publishWithId(topic, msg, (int)w.length(), MqttClient::MqttQoS::QOS1,
+                        false, nullptr);
+}
+
+} // namespace ED_MQTT
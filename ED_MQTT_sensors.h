@@ -0,0 +1,123 @@
+#pragma once
+
+#include "ED_MQTT_config.h"
+#include "ED_mqtt.h"
+#include <cstddef>
+#include <cstdint>
+#include <esp_event.h>
+
+namespace ED_MQTT {
+
+/**
+ * Bridge from ED_MQTT_SENSOR_EVENTS to batched publishing.
+ *
+ * Sensor code posts a SensorSample from any task and never touches the MQTT
+ * API:
+ *
+ *   SensorBridge::post("sensors/boiler", "temp", 61.5f);
+ *
+ * The bridge (an event handler, so it runs in the event loop task) groups the
+ * samples per topic and publishes one message per batch once a batch reaches
+ * its sample count, its byte budget or its maximum latency:
+ *
+ *   {"t0":123456,"n":3,"s":[[0,"temp",61.5],[1000,"temp",61.7],[2000,"flow",3.2]]}
+ *
+ * t0 is the first sample's time (ms since boot), each row is
+ * [dt ms, key, value]. ERROR events flush the topic's batch and publish
+ * {"src":key,"code":value} on <topic>/error (QoS1). FLUSH publishes the
+ * batch of the sample's topic, or every batch when posted without data.
+ *
+ * Fixed tables, no heap in the bridge (esp_event copies each posted sample).
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint8_t  MAX_SENSOR_TOPICS     = ED_MQTT_MAX_SENSOR_TOPICS;
+static constexpr uint8_t  SENSOR_BATCH_SAMPLES  = ED_MQTT_SENSOR_BATCH_SAMPLES;
+static constexpr size_t   SENSOR_TOPIC_LEN      = 48;
+static constexpr size_t   SENSOR_KEY_LEN        = 16;
+static constexpr size_t   SENSOR_BATCH_BUF_LEN  = ED_MQTT_SENSOR_BATCH_BUF_LEN;
+static constexpr uint32_t SENSOR_TICK_MS        = 250;   // latency check period
+static_assert(ED_MQTT_MAX_SENSOR_TOPICS > 0 && ED_MQTT_MAX_SENSOR_TOPICS <= 255,
+              "ED_MQTT_MAX_SENSOR_TOPICS must be 1..255");
+static_assert(ED_MQTT_SENSOR_BATCH_SAMPLES > 0 && ED_MQTT_SENSOR_BATCH_SAMPLES <= 255,
+              "ED_MQTT_SENSOR_BATCH_SAMPLES must be 1..255");
+static_assert(ED_MQTT_SENSOR_BATCH_BUF_LEN >= 128 && ED_MQTT_SENSOR_BATCH_BUF_LEN <= 0xFFFF,
+              "ED_MQTT_SENSOR_BATCH_BUF_LEN must be 128..65535");
+
+/// Event data of ED_MQTT_SENSOR_EVENT_DATA_READY / _ERROR / _FLUSH.
+struct SensorSample {
+  char topic[SENSOR_TOPIC_LEN];  // batch key and publish topic
+  char key[SENSOR_KEY_LEN];      // field name; ERROR: error source
+  float value;                   // ERROR: error code
+  int64_t timestampUs;           // esp_timer time, 0: time of arrival
+};
+
+/// When a batch is published: whichever limit is reached first.
+struct BatchPolicy {
+  uint8_t maxSamples = SENSOR_BATCH_SAMPLES;
+  uint16_t maxBytes = (uint16_t)SENSOR_BATCH_BUF_LEN;
+  uint32_t maxLatencyMs = 5000;
+  uint8_t qos = 0;
+};
+
+class SensorBridge {
+public:
+  /// Register the handler on loop (nullptr: default loop) and start the
+  /// latency timer. Call once, after the loop exists.
+  static esp_err_t start(esp_event_loop_handle_t loop = nullptr);
+
+  /// Policy for one topic; other topics use the default policy. Limits above
+  /// the static capacity are clamped.
+  static bool configureTopic(const char *topic, const BatchPolicy &policy);
+  static void setDefaultPolicy(const BatchPolicy &policy);
+
+  /// Convenience: fill a SensorSample and post DATA_READY. Returns the
+  /// esp_event_post result (ESP_ERR_TIMEOUT when the loop queue is full).
+  static esp_err_t post(const char *topic, const char *key, float value,
+                        TickType_t wait = 0);
+
+  /// Samples published / dropped (table full, overflow, publish error).
+  static uint32_t published() { return s_published; }
+  static uint32_t dropped() { return s_dropped; }
+
+  static void memoryReport(MemoryReport &report);
+
+private:
+  struct Entry {
+    char key[SENSOR_KEY_LEN];
+    float value;
+    int32_t dtMs;   // relative to Batch::t0Us
+  };
+  struct Batch {
+    char topic[SENSOR_TOPIC_LEN];
+    BatchPolicy policy;
+    bool configured;
+    uint8_t count;
+    uint16_t bytes;     // estimated encoded size
+    int64_t t0Us;       // first sample's timestamp
+    int64_t openedUs;   // arrival of the first sample (latency)
+    Entry samples[SENSOR_BATCH_SAMPLES];
+  };
+
+  static void event_handler(void *arg, esp_event_base_t base, int32_t id,
+                            void *data);
+  static void tick_timer_cb(TimerHandle_t handle);
+  static Batch *findBatch(const char *topic, bool create);
+  static void add(const SensorSample &s);
+  static void flush(Batch &b);
+  static void flushExpired(int64_t nowUs);
+  static void publishError(const SensorSample &s);
+
+  static esp_event_loop_handle_t s_loop;
+  static TimerHandle_t s_tick_timer;
+  static StaticTimer_t s_tick_timer_buf;
+  static uint16_t s_open;   // batches holding samples; unlocked read by the timer is a hint
+  static BatchPolicy s_default;
+  static Batch s_batches[MAX_SENSOR_TOPICS];
+  static uint8_t s_batch_count;
+  static char s_buf[SENSOR_BATCH_BUF_LEN];   // encoder output, loop task only
+  static uint32_t s_published;
+  static uint32_t s_dropped;
+};
+
+} // namespace ED_MQTT
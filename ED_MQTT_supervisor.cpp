@@ -0,0 +1,121 @@
+#include "ED_MQTT_supervisor.h"
+#include "esp_log.h"
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+namespace ED_MQTT {
+
+static const char *TAG = "MQTTsup";
+
+// Guards the start state only; posting goes through the queues.
+static portMUX_TYPE s_sup_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// ── Static members ───────────────────────────────────────────────────
+volatile uint8_t Supervisor::s_state = Supervisor::IDLE;
+TaskHandle_t Supervisor::s_task = nullptr;
+QueueHandle_t Supervisor::s_queue = nullptr;
+QueueHandle_t Supervisor::s_lifecycle = nullptr;
+uint8_t Supervisor::s_queue_storage[SUPERVISOR_QUEUE_LEN * sizeof(Job)] = {};
+uint8_t Supervisor::s_lifecycle_storage[SUPERVISOR_LIFECYCLE_LEN * sizeof(Job)] = {};
+uint32_t Supervisor::s_dropped = 0;
+
+static StaticQueue_t s_sup_queue_buf;
+static StaticQueue_t s_sup_lifecycle_buf;
+static StaticTask_t s_sup_task_buf;
+static StackType_t s_sup_task_stack[SUPERVISOR_STACK];
+
+esp_err_t Supervisor::start() {
+  taskENTER_CRITICAL(&s_sup_mux);
+  const bool first = s_state == IDLE;
+  if (first)
+    s_state = STARTING;
+  taskEXIT_CRITICAL(&s_sup_mux);
+
+  if (!first) {
+    // Another caller is creating them: a few ticks at most, once per boot.
+    while (s_state == STARTING)
+      vTaskDelay(1);
+    return s_state == RUNNING ? ESP_OK : ESP_FAIL;
+  }
+
+  s_queue = xQueueCreateStatic(SUPERVISOR_QUEUE_LEN, sizeof(Job), s_queue_storage,
+                               &s_sup_queue_buf);
+  s_lifecycle = xQueueCreateStatic(SUPERVISOR_LIFECYCLE_LEN, sizeof(Job),
+                                   s_lifecycle_storage, &s_sup_lifecycle_buf);
+  configASSERT(s_queue && s_lifecycle);
+  s_task = xTaskCreateStatic(task, "mqtt_sup", SUPERVISOR_STACK, nullptr, 5,
+                             s_sup_task_stack, &s_sup_task_buf);
+  if (!s_task) {
+    ESP_LOGE(TAG, "supervisor task creation failed");
+    s_state = FAILED;
+    return ESP_FAIL;
+  }
+  s_state = RUNNING;
+  return ESP_OK;
+}
+
+bool Supervisor::post(SupervisorJob job, uint32_t arg, Priority prio) {
+  if (!job)
+    return false;
+  if (s_state != RUNNING) {
+    // Never start() here: a timer callback must not wait for another caller.
+    ++s_dropped;
+    ESP_LOGW(TAG, "supervisor not started, job dropped (%lu so far)",
+             (unsigned long)s_dropped);
+    return false;
+  }
+  const Job j = {job, arg};
+  if (xQueueSend(prio == LIFECYCLE ? s_lifecycle : s_queue, &j, 0) != pdTRUE) {
+    ++s_dropped;
+    ESP_LOGW(TAG, "%s job queue full, job dropped (%lu so far)",
+             prio == LIFECYCLE ? "lifecycle" : "publish", (unsigned long)s_dropped);
+    return false;
+  }
+  xTaskNotifyGive(s_task);   // one wake-up per job; the task drains both queues
+  return true;
+}
+
+bool Supervisor::onSupervisor() {
+  return s_task && xTaskGetCurrentTaskHandle() == s_task;
+}
+
+uint32_t Supervisor::stackFree() {
+  return s_task ? (uint32_t)uxTaskGetStackHighWaterMark(s_task) : 0;
+}
+
+// Lifecycle jobs first, then one publish job at a time, looking at the
+// lifecycle queue again after each.
+void Supervisor::task(void * /*arg*/) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    Job j;
+    for (;;) {
+      if (xQueueReceive(s_lifecycle, &j, 0) == pdTRUE) {
+        if (j.fn) j.fn(j.arg);
+      } else if (xQueueReceive(s_queue, &j, 0) == pdTRUE) {
+        if (j.fn) j.fn(j.arg);
+      } else {
+        break;
+      }
+    }
+  }
+}
+
+void Supervisor::memoryReport(MemoryReport &report) {
+  report.row("sup.queue", s_queue ? (unsigned)uxQueueMessagesWaiting(s_queue) : 0,
+             SUPERVISOR_QUEUE_LEN, sizeof s_queue_storage);
+  report.row("sup.lifecycle",
+             s_lifecycle ? (unsigned)uxQueueMessagesWaiting(s_lifecycle) : 0,
+             SUPERVISOR_LIFECYCLE_LEN, sizeof s_lifecycle_storage);
+  reportTaskStack(report, "sup.stack", s_task, sizeof s_sup_task_stack);
+}
+
+void reportTaskStack(MemoryReport &report, const char *name, TaskHandle_t task,
+                     size_t stackBytes) {
+  // uxTaskGetStackHighWaterMark() counts bytes on ESP-IDF (StackType_t is a byte).
+  const size_t free = task ? (size_t)uxTaskGetStackHighWaterMark(task) : stackBytes;
+  report.row(name, (unsigned)(stackBytes - (free < stackBytes ? free : stackBytes)),
+             (unsigned)stackBytes, stackBytes);
+}
+
+} // namespace ED_MQTT
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "ED_MQTT_config.h"
+#include "ED_mqtt.h"
+#include <cstdint>
+
+namespace ED_MQTT {
+
+/**
+ * One task for the component's background work.
+ *
+ * Client teardown and reconnect, the health check and the periodic
+ * diag/history/boot publishing run as jobs on this task. The client and
+ * dispatcher timer callbacks only post; the work happens here, so teardown
+ * and reconnect can never interleave.
+ *
+ * Two queues: LIFECYCLE jobs (teardown, reconnect, health) always run
+ * before the next PUBLISH job, so a backlog of publishing work can neither
+ * delay nor drop them. Within a queue jobs run in the order they were posted.
+ *
+ * Static stack (ED_MQTT_SUPERVISOR_STACK bytes), static job queues, no heap.
+ * The stack high-water mark shows in the ":MEM" report.
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint32_t SUPERVISOR_STACK     = ED_MQTT_SUPERVISOR_STACK;
+static constexpr uint8_t  SUPERVISOR_QUEUE_LEN = ED_MQTT_SUPERVISOR_QUEUE_LEN;
+static constexpr uint8_t  SUPERVISOR_LIFECYCLE_LEN = ED_MQTT_SUPERVISOR_LIFECYCLE_LEN;
+static_assert(ED_MQTT_SUPERVISOR_STACK >= 2048, "ED_MQTT_SUPERVISOR_STACK below 2048 bytes");
+static_assert(ED_MQTT_SUPERVISOR_QUEUE_LEN >= 4 && ED_MQTT_SUPERVISOR_QUEUE_LEN <= 255,
+              "ED_MQTT_SUPERVISOR_QUEUE_LEN must be 4..255");
+static_assert(ED_MQTT_SUPERVISOR_LIFECYCLE_LEN >= 2 && ED_MQTT_SUPERVISOR_LIFECYCLE_LEN <= 255,
+              "ED_MQTT_SUPERVISOR_LIFECYCLE_LEN must be 2..255");
+
+using SupervisorJob = void (*)(uint32_t arg);
+
+class Supervisor {
+public:
+  enum Priority : uint8_t { PUBLISH, LIFECYCLE };
+
+  /// Create the task and queues (first call). Safe to call from several
+  /// tasks at once: a caller arriving while another one creates them waits
+  /// for that result, so never from a timer callback. Every component calls
+  /// it before creating the timers that post.
+  static esp_err_t start();
+
+  /// Queue job(arg). Any task or timer callback, not ISRs. Returns false
+  /// (and counts the drop) before start() or when the queue of that
+  /// priority is full; never waits.
+  static bool post(SupervisorJob job, uint32_t arg = 0, Priority prio = PUBLISH);
+
+  static bool onSupervisor();
+  /// Bytes of stack never used so far (0 before start()).
+  static uint32_t stackFree();
+  static uint32_t dropped() { return s_dropped; }
+
+  static void memoryReport(MemoryReport &report);
+
+private:
+  struct Job {
+    SupervisorJob fn;
+    uint32_t arg;
+  };
+  enum State : uint8_t { IDLE, STARTING, RUNNING, FAILED };
+  static void task(void *arg);
+
+  static volatile uint8_t s_state;   // State
+  static TaskHandle_t s_task;
+  static QueueHandle_t s_queue;       // PUBLISH
+  static QueueHandle_t s_lifecycle;   // LIFECYCLE, drained first
+  static uint8_t s_queue_storage[SUPERVISOR_QUEUE_LEN * sizeof(Job)];
+  static uint8_t s_lifecycle_storage[SUPERVISOR_LIFECYCLE_LEN * sizeof(Job)];
+  static uint32_t s_dropped;
+};
+
+/// Stack rows for memory reports: peak use / size of a static task stack.
+void reportTaskStack(MemoryReport &report, const char *name, TaskHandle_t task,
+                     size_t stackBytes);
+
+} // namespace ED_MQTT
@@ -0,0 +1,214 @@
+#include "ED_MQTT_work.h"
+#include "ED_MQTT_dispatcher.h"
+#include "ED_MQTT_supervisor.h"
+#include "ED_sys.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include <cstdio>
+#include <cstring>
+#include <freertos/task.h>
+
+namespace ED_MQTT_dispatcher {
+
+static const char *TAG = "MQTTwork";
+
+// ── Static members ───────────────────────────────────────────────────
+WorkHandler   WorkQueue::s_handler = nullptr;
+WorkPolicy    WorkQueue::s_policy;
+int           WorkQueue::s_qos = 1;
+char          WorkQueue::s_share[ED_MQTT::SUB_FILTER_LEN] = {};
+char          WorkQueue::s_ack_topic[WORK_TOPIC_LEN] = {};
+QueueHandle_t WorkQueue::s_queue = nullptr;
+uint8_t       WorkQueue::s_queue_storage[WORK_QUEUE_LEN * sizeof(Item)] = {};
+WorkQueue::Item WorkQueue::s_in = {};
+WorkQueue::Item WorkQueue::s_cur = {};
+volatile bool WorkQueue::s_off = false;
+uint8_t       WorkQueue::s_peak = 0;
+uint32_t      WorkQueue::s_done = 0;
+uint32_t      WorkQueue::s_failed = 0;
+uint32_t      WorkQueue::s_busy = 0;
+
+static StaticQueue_t s_work_queue_buf;
+static StaticTask_t  s_work_task_buf;
+static TaskHandle_t  s_work_task = nullptr;
+static StackType_t   s_work_task_stack[WORK_TASK_STACK];
+
+// ── Public API ───────────────────────────────────────────────────────
+bool WorkQueue::start(const char *group, const char *filter, WorkHandler handler,
+                      int qos, const WorkPolicy &policy) {
+    if (s_queue) {
+        ESP_LOGW(TAG, "already started (one pool per device)");
+        return false;
+    }
+    if (!group || !group[0] || strpbrk(group, "/+#") || !filter || !filter[0] ||
+        !handler) {
+        ESP_LOGE(TAG, "start needs a group name, a filter and a handler");
+        return false;
+    }
+    int n = snprintf(s_share, sizeof s_share, "$share/%s/%s", group, filter);
+    if (n < 0 || (size_t)n >= sizeof s_share ||
+        (size_t)snprintf(s_ack_topic, sizeof s_ack_topic, "work/%s/ack", group) >=
+            sizeof s_ack_topic) {
+        ESP_LOGE(TAG, "group/filter too long");
+        s_share[0] = '\0';
+        return false;
+    }
+    s_handler = handler;
+    s_qos = qos;
+    s_policy = policy;
+    if (s_policy.highWater == 0 || s_policy.highWater > WORK_QUEUE_LEN)
+        s_policy.highWater = WORK_QUEUE_LEN;
+    if (s_policy.lowWater >= s_policy.highWater)
+        s_policy.lowWater = s_policy.highWater - 1;
+
+    s_queue = xQueueCreateStatic(WORK_QUEUE_LEN, sizeof(Item), s_queue_storage,
+                                 &s_work_queue_buf);
+    configASSERT(s_queue);
+    s_work_task = xTaskCreateStatic(worker_task, "mqtt_work", WORK_TASK_STACK, nullptr,
+                                    WORK_TASK_PRIORITY, s_work_task_stack, &s_work_task_buf);
+    if (!s_work_task) {
+        ESP_LOGE(TAG, "worker task creation failed");
+        return false;
+    }
+
+    // Delivered with the plain topic: route the inner filter, keep what came
+    // through the share (subscription identifier).
+    ED_MQTT::MqttClient::registerDataCallback(filter, on_message);
+    MQTTdispatcher::registerFieldProvider(writeFields, 0,
+                                          MQTTdispatcher::ProviderCost::CHEAP, "work");
+    setShared(true);
+    ESP_LOGI(TAG, "worker in pool %s (queue %u)", s_share, WORK_QUEUE_LEN);
+    return true;
+}
+
+uint8_t WorkQueue::depth() {
+    return s_queue ? (uint8_t)uxQueueMessagesWaiting(s_queue) : 0;
+}
+
+void WorkQueue::setShared(bool subscribed) {
+    if (subscribed)
+        ED_MQTT::MqttClient::addSubscription(s_share, s_qos, WORK_SUBSCRIPTION_ID);
+    else
+        ED_MQTT::MqttClient::removeSubscription(s_share);
+    s_off = !subscribed;
+}
+
+// ── Intake (MQTT event task) ─────────────────────────────────────────
+void WorkQueue::on_message(esp_mqtt_client_handle_t /*client*/, const char *topic,
+                           int topicLen, const char *data, size_t dataLen,
+                           uint32_t msgID) {
+    const ED_MQTT::RequestContext &req = ED_MQTT::MqttClient::currentRequest();
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (req.subscriptionId != WORK_SUBSCRIPTION_ID) {
+        ESP_LOGD(TAG, "%.*s: not delivered through %s, ignored", topicLen, topic, s_share);
+        return;
+    }
+#endif
+    Item &it = s_in;
+    it.msgID = msgID;
+    size_t tl = (size_t)topicLen < sizeof it.topic - 1 ? (size_t)topicLen
+                                                       : sizeof it.topic - 1;
+    memcpy(it.topic, topic, tl);
+    it.topic[tl] = '\0';
+    it.responseTopic[0] = '\0';
+    it.correlationLen = 0;
+    if (req.correlationTruncated) {
+        // A cut correlation would come back unmatched: ack on the group topic.
+        ESP_LOGW(TAG, "%s: correlation data over %u bytes, acked on %s", it.topic,
+                 (unsigned)ED_MQTT::MAX_CORRELATION_LEN, s_ack_topic);
+    } else {
+        strncpy(it.responseTopic, req.responseTopic, sizeof it.responseTopic - 1);
+        it.responseTopic[sizeof it.responseTopic - 1] = '\0';
+        it.correlationLen = req.correlationLen;
+        memcpy(it.correlation, req.correlation, req.correlationLen);
+    }
+
+    if (dataLen > sizeof it.data) {
+        ESP_LOGW(TAG, "%s: item of %u bytes > %u, refused", it.topic,
+                 (unsigned)dataLen, (unsigned)sizeof it.data);
+        ++s_failed;
+        acknowledge(it, "FAIL", 0);
+        return;
+    }
+    memcpy(it.data, data, dataLen);
+    it.len = (uint16_t)dataLen;
+
+    if (xQueueSend(s_queue, &it, 0) != pdTRUE) {
+        ++s_busy;
+        acknowledge(it, "BUSY", 0);
+        return;
+    }
+    const uint8_t d = depth();
+    if (d > s_peak)
+        s_peak = d;
+    if (s_policy.unsubscribeOnOverload && !s_off && d >= s_policy.highWater) {
+        ESP_LOGW(TAG, "queue %u/%u, leaving %s", d, WORK_QUEUE_LEN, s_share);
+        setShared(false);
+    }
+}
+
+// ── Worker ───────────────────────────────────────────────────────────
+void WorkQueue::worker_task(void * /*arg*/) {
+    for (;;) {
+        if (xQueueReceive(s_queue, &s_cur, portMAX_DELAY) != pdTRUE)
+            continue;
+        const int64_t t0 = esp_timer_get_time();
+        const bool ok = s_handler(s_cur.topic, s_cur.data, s_cur.len);
+        const uint32_t ms = (uint32_t)((esp_timer_get_time() - t0) / 1000);
+        if (ok)
+            ++s_done;
+        else
+            ++s_failed;
+        acknowledge(s_cur, ok ? "DONE" : "FAIL", ms);
+
+        if (s_off && depth() <= s_policy.lowWater) {
+            ESP_LOGI(TAG, "queue %u/%u, rejoining %s", depth(), WORK_QUEUE_LEN, s_share);
+            setShared(true);
+        }
+    }
+}
+
+void WorkQueue::acknowledge(const Item &item, const char *status, uint32_t ms) {
+    ED_MQTT::MqttClient *mqtt = ED_MQTT::MqttClient::getInstance();
+    if (!mqtt)
+        return;
+    char msg[128];
+    ED_MQTT::JsonWriter w(msg, sizeof msg);
+    w.beginObject();
+    w.addInt("id", item.msgID);
+    w.addString("status", status);
+    w.addString("worker", ED_SYS::ESP_std::Device::mqttName());
+    w.addInt("ms", ms);
+    w.endObject();
+    if (w.overflow())
+        return;
+
+    ED_MQTT::PublishOptions opts;
+    opts.contentType = ED_MQTT::contentType(ED_MQTT::Encoding::JSON);
+    const char *topic = s_ack_topic;
+    if (item.responseTopic[0]) {
+        topic = item.responseTopic;
+        opts.correlation = item.correlationLen ? item.correlation : nullptr;
+        opts.correlationLen = item.correlationLen;
+    }
+    mqtt->publishWithId(topic, msg, (int)w.length(), ED_MQTT::MqttClient::MqttQoS::QOS1,
+                        false, &opts);
+}
+
+// ── Reporting ────────────────────────────────────────────────────────
+void WorkQueue::writeFields(ED_MQTT::FieldWriter &w) {
+    w.addInt("d_WQ", depth());
+    w.addInt("d_WQMAX", s_peak);
+    w.addInt("d_WQDONE", s_done);
+    w.addInt("d_WQFAIL", s_failed);
+    w.addInt("d_WQBUSY", s_busy);
+    w.addInt("d_WQOFF", s_off ? 1 : 0);
+}
+
+void WorkQueue::memoryReport(ED_MQTT::MemoryReport &report) {
+    report.row("work.queue", depth(), WORK_QUEUE_LEN, sizeof s_queue_storage);
+    report.row("work.items", 0, 0, sizeof s_in + sizeof s_cur);
+    ED_MQTT::reportTaskStack(report, "work.stack", s_work_task, sizeof s_work_task_stack);
+}
+
+} // namespace ED_MQTT_dispatcher
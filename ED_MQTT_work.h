@@ -0,0 +1,115 @@
+#pragma once
+
+#include "ED_MQTT_config.h"
+#include "ED_MQTT_encode.h"
+#include "ED_mqtt.h"
+#include <cstddef>
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+namespace ED_MQTT_dispatcher {
+
+/**
+ * Work distribution over an MQTT5 shared subscription.
+ *
+ * Interchangeable devices join the same pool:
+ *
+ *   WorkQueue::start("gw", "jobs/convert", convert_job);
+ *
+ * subscribes $share/gw/jobs/convert, so the broker hands each message to ONE
+ * member of the pool. Messages are not commands: each is a work item, queued
+ * (static queue) and run by one worker task, then acknowledged:
+ *
+ *   {"id":<msgID>,"status":"DONE"|"FAIL"|"BUSY","worker":"<mqttName>","ms":12}
+ *
+ * on the request's MQTT5 response topic (correlation data echoed) or, without
+ * one, on work/<group>/ack. BUSY means the queue was full and the item was
+ * dropped: the producer resends it. Depth and counters go out in diag
+ * (d_WQ…). With unsubscribeOnOverload the device leaves the share while its
+ * queue is above highWater and rejoins at lowWater, so the broker sends the
+ * load to the rest of the pool.
+ *
+ * The broker delivers shared messages under their plain topic, so a plain
+ * subscription of this device that matches the same topic would look the
+ * same. The share is subscribed with the MQTT5 subscription identifier
+ * WORK_SUBSCRIPTION_ID and only messages carrying it are work items.
+ * A request whose correlation data did not fit MAX_CORRELATION_LEN is acked
+ * on work/<group>/ack, never with a cut correlation.
+ *
+ * One pool per device. No heap.
+ */
+
+// ── Compile-time limits ───────────────────────────────────────────────
+static constexpr uint8_t  WORK_QUEUE_LEN   = ED_MQTT_WORK_QUEUE_LEN;
+static constexpr size_t   WORK_ITEM_LEN    = ED_MQTT_WORK_ITEM_LEN;   // payload
+static constexpr size_t   WORK_TOPIC_LEN   = 64;
+static constexpr uint32_t WORK_TASK_STACK  = ED_MQTT_WORK_STACK;
+static constexpr UBaseType_t WORK_TASK_PRIORITY = ED_MQTT_WORK_PRIORITY;
+static constexpr uint16_t WORK_SUBSCRIPTION_ID = 0x574B;   // "WK"
+static_assert(ED_MQTT_WORK_QUEUE_LEN >= 2 && ED_MQTT_WORK_QUEUE_LEN <= 255,
+              "ED_MQTT_WORK_QUEUE_LEN must be 2..255");
+static_assert(ED_MQTT_WORK_ITEM_LEN >= 16 && ED_MQTT_WORK_ITEM_LEN <= 0xFFFF,
+              "ED_MQTT_WORK_ITEM_LEN must be 16..65535");
+static_assert(ED_MQTT_WORK_STACK >= 2048, "ED_MQTT_WORK_STACK below 2048 bytes");
+static_assert(ED_MQTT_WORK_PRIORITY > 0 && ED_MQTT_WORK_PRIORITY < configMAX_PRIORITIES,
+              "ED_MQTT_WORK_PRIORITY must be 1..configMAX_PRIORITIES-1");
+
+/// Runs one work item on the worker task; true when done.
+using WorkHandler = bool (*)(const char* topic, const uint8_t* data, size_t len);
+
+struct WorkPolicy {
+    bool    unsubscribeOnOverload = false;
+    uint8_t highWater = WORK_QUEUE_LEN - WORK_QUEUE_LEN / 4;   // leave the share
+    uint8_t lowWater  = WORK_QUEUE_LEN / 4;                    // rejoin
+};
+
+class WorkQueue {
+public:
+    /// Subscribe $share/<group>/<filter> and start the worker. Call once,
+    /// before or after the client connects.
+    static bool start(const char* group, const char* filter, WorkHandler handler,
+                      int qos = 1, const WorkPolicy& policy = {});
+
+    static uint8_t depth();
+
+    /// Diag fields: d_WQ depth, d_WQMAX peak, d_WQDONE / d_WQFAIL / d_WQBUSY
+    /// counts, d_WQOFF 1 while out of the share.
+    static void writeFields(ED_MQTT::FieldWriter& w);
+    static void memoryReport(ED_MQTT::MemoryReport& report);
+
+private:
+    struct Item {
+        uint32_t msgID;
+        uint16_t len;
+        uint16_t correlationLen;
+        char     topic[WORK_TOPIC_LEN];
+        char     responseTopic[ED_MQTT::MAX_RESPONSE_TOPIC_LEN];
+        uint8_t  correlation[ED_MQTT::MAX_CORRELATION_LEN];
+        uint8_t  data[WORK_ITEM_LEN];
+    };
+
+    static void on_message(esp_mqtt_client_handle_t client, const char* topic,
+                           int topicLen, const char* data, size_t dataLen,
+                           uint32_t msgID);
+    static void worker_task(void* arg);
+    static void acknowledge(const Item& item, const char* status, uint32_t ms);
+    static void setShared(bool subscribed);
+
+    static WorkHandler   s_handler;
+    static WorkPolicy    s_policy;
+    static int           s_qos;
+    static char          s_share[ED_MQTT::SUB_FILTER_LEN];   // $share/<group>/<filter>
+    static char          s_ack_topic[WORK_TOPIC_LEN];
+    static QueueHandle_t s_queue;
+    static uint8_t       s_queue_storage[WORK_QUEUE_LEN * sizeof(Item)];
+    static Item          s_in;    // MQTT event task only
+    static Item          s_cur;   // worker task only
+    static volatile bool s_off;   // out of the share (overload)
+    static uint8_t       s_peak;
+    static uint32_t      s_done;
+    static uint32_t      s_failed;
+    static uint32_t      s_busy;
+};
+
+} // namespace ED_MQTT_dispatcher
@@ -1,4 +1,10 @@
 #include "ED_mqtt.h"
+#include "ED_MQTT_alloc.h"
+#include "ED_MQTT_encode.h"
+#include "ED_MQTT_lzss.h"
+#include "ED_MQTT_profile.h"
+#include "ED_MQTT_router.h"
+#include "ED_MQTT_supervisor.h"
 #include "ED_sys.h"
 #include "esp_crt_bundle.h"
 #include "esp_event_base.h"
@@ -32,15 +38,115 @@ static SemaphoreHandle_t get_mqtt_mutex() {
   return s_mqtt_mutex;
 }
 
+// ── Retained table lock ────────────────────────────────────────────────
+// A short critical section, never held across an esp-mqtt call: the PUBACK
+// handler runs on the esp-mqtt task, inside esp-mqtt's API lock, and must
+// not wait for publishers that hold the client mutex while they wait for
+// that lock.
+static portMUX_TYPE s_retained_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// ── Subscription locks ─────────────────────────────────────────────────
+// s_subs_mutex guards the subscription table and is never held across an
+// esp-mqtt call: the SUBACK handler takes it on the esp-mqtt task.
+// s_subscribe_mutex serializes the SUBSCRIBEs of the other tasks; the
+// esp-mqtt task never takes it.
+static StaticSemaphore_t s_subs_mutex_buffer;
+static SemaphoreHandle_t s_subs_mutex = nullptr;
+static StaticSemaphore_t s_subscribe_mutex_buffer;
+static SemaphoreHandle_t s_subscribe_mutex = nullptr;
+
+static SemaphoreHandle_t get_subs_mutex() {
+  if (s_subs_mutex == nullptr) {
+    s_subs_mutex = xSemaphoreCreateMutexStatic(&s_subs_mutex_buffer);
+    configASSERT(s_subs_mutex);
+  }
+  return s_subs_mutex;
+}
+
+static SemaphoreHandle_t get_subscribe_mutex() {
+  if (s_subscribe_mutex == nullptr) {
+    s_subscribe_mutex = xSemaphoreCreateMutexStatic(&s_subscribe_mutex_buffer);
+    configASSERT(s_subscribe_mutex);
+  }
+  return s_subscribe_mutex;
+}
+
+// SUBACK handled before sendSubscribe() stored its msg id (s_subs_mutex).
+static struct {
+  int msgId = -1;
+  int code = -1;
+} s_early_suback;
+// Subscription identifier another task set for its next SUBSCRIBE, 0: none.
+static std::atomic<uint16_t> s_armed_sub_id{0};
+
+// ── esp-mqtt task ──────────────────────────────────────────────────────
+// esp-mqtt runs event handlers holding its API lock: code on that task never
+// waits for a lock another task holds across an esp-mqtt call.
+static std::atomic<TaskHandle_t> s_event_task{nullptr};
+
+static bool on_event_task() {
+  return s_event_task.load() == xTaskGetCurrentTaskHandle();
+}
+
+// ── Publish-property slot ─────────────────────────────────────────────
+// The property set by a publisher holding the client mutex, armed from just
+// before it is set until its publish returns. A handler publishing on the
+// esp-mqtt task while that publisher waits for the API lock restores it.
+#ifdef CONFIG_MQTT_PROTOCOL_5
+static esp_mqtt5_publish_property_config_t s_armed_prop = {};
+static std::atomic<bool> s_prop_armed{false};
+#endif
+
+// Compressed-topic table: a short critical section (setTopicCompression()
+// runs from commands, on the esp-mqtt task).
+static portMUX_TYPE s_compress_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// ── Lifecycle mutex: start() and destroyClient() only ──────────────────
+// Publishers never take it; they borrow the handle through a ClientRef.
+static StaticSemaphore_t s_lifecycle_mutex_buffer;
+static SemaphoreHandle_t s_lifecycle_mutex = nullptr;
+
+static SemaphoreHandle_t get_lifecycle_mutex() {
+  if (s_lifecycle_mutex == nullptr) {
+    s_lifecycle_mutex = xSemaphoreCreateMutexStatic(&s_lifecycle_mutex_buffer);
+    configASSERT(s_lifecycle_mutex);
+  }
+  return s_lifecycle_mutex;
+}
+
 // ── Static member definitions ──────────────────────────────────────────
 TimerHandle_t MqttClient::mqtt_reconnect_timer = nullptr;
 TimerHandle_t MqttClient::s_health_timer = nullptr;
-uint8_t MqttClient::s_publish_fail_count = 0;
+static StaticTimer_t s_reconnect_timer_buf;
+static StaticTimer_t s_health_timer_buf;
+std::atomic<uint8_t> MqttClient::s_publish_fail_count{0};
+std::atomic<uint32_t> MqttClient::s_client_users{0};
 MqttClient::ReconnectCallback MqttClient::s_reconnect_callback = nullptr;
 char MqttClient::statusTopicBuf[64] = {};
+char MqttClient::s_birth_buf[BIRTH_MSG_LEN] = {};
+size_t MqttClient::s_birth_prefix_len = 0;
+uint32_t MqttClient::s_connect_count = 0;
+MqttClient::RetainedEntry MqttClient::s_retained[MAX_RETAINED_TOPICS] = {};
+uint8_t MqttClient::s_retained_next = 0;
+bool MqttClient::s_session_present = false;
+uint32_t MqttClient::s_retained_skipped = 0;
+MqttClient::Subscription MqttClient::s_subs[MAX_SUBSCRIPTIONS] = {};
+MqttClient::Subscription MqttClient::s_connect_subs[MAX_SUBSCRIPTIONS] = {};
+bool MqttClient::s_connected = false;
+
+static uint32_t fnv1a(const void *data, size_t len) {
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
 
 #ifdef CONFIG_MQTT_PROTOCOL_5
 mqtt5_user_property_handle_t MqttClient::s_publish_property = nullptr;
+mqtt5_user_property_handle_t MqttClient::s_publish_property_lzss = nullptr;
 #endif
 
 MqttClient *MqttClient::_instance = nullptr;
@@ -50,36 +156,48 @@ MqttConnectedCallback MqttClient::connected_callbacks[MAX_CONNECTED_CALLBACKS] =
 uint8_t MqttClient::connected_callback_count = 0;
 MqttDataCallback MqttClient::data_callbacks[MAX_DATA_CALLBACKS] = {};
 uint8_t MqttClient::data_callback_count = 0;
+int8_t MqttClient::connected_hooks[MAX_CONNECTED_CALLBACKS] = {};
+int8_t MqttClient::data_hooks[MAX_DATA_CALLBACKS] = {};
+int8_t MqttClient::route_hooks[ED_MQTT_MAX_DATA_ROUTES] = {};
+MqttPublishedCallback MqttClient::published_callbacks[MAX_PUBLISHED_CALLBACKS] = {};
+uint8_t MqttClient::published_callback_count = 0;
 
 char MqttClient::s_payload_buf[MAX_MQTT_PAYLOAD] = {};
+uint8_t MqttClient::s_deflate_buf[COMPRESS_BUF_LEN] = {};
+#if ED_MQTT_INFLATE_BUF_LEN > 0
+uint8_t MqttClient::s_inflate_buf[INFLATE_BUF_LEN] = {};
+#endif
 size_t MqttClient::s_payload_len = 0;
 size_t MqttClient::s_payload_expected = 0;
+bool MqttClient::s_payload_skip = false;
+MqttTargetFilter MqttClient::s_target_filter = nullptr;
+char MqttClient::s_target_topic[SUB_FILTER_LEN] = {};
+char MqttClient::s_compress_topics[MAX_COMPRESS_TOPICS][SUB_FILTER_LEN] = {};
+RequestContext MqttClient::s_request = {};
 
-TaskHandle_t MqttClient::teardown_task_handle = nullptr;
 int MqttClient::disconnect_count = 0;
 int64_t MqttClient::last_disconnect_time = 0;
 
-TaskHandle_t MqttClient::reconnect_task_handle = nullptr;
-QueueHandle_t MqttClient::reconnect_queue = nullptr;
-
-// ── Reconnect task (waits on queue) ────────────────────────────────────
-void MqttClient::reconnect_task(void *arg) {
-    while (true) {
-        uint32_t dummy;
-        if (xQueueReceive(reconnect_queue, &dummy, portMAX_DELAY) == pdTRUE) {
-            MqttClient *self = getInstance();
-            if (self == nullptr) {
-                ESP_LOGE(TAG, "Reconnect: no instance");
-                continue;
-            }
-            self->destroyClient();
-            vTaskDelay(pdMS_TO_TICKS(100));
-            esp_err_t err = self->start(mqttConfig);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Reconnect start failed: %s", esp_err_to_name(err));
-            }
-        }
-    }
+// ── Background jobs (Supervisor task) ──────────────────────────────────
+// Teardown and reconnect are queued on the same task, so a reconnect can
+// never start while a teardown is still running.
+void MqttClient::teardown_job(uint32_t /*arg*/) {
+  MqttClient *self = getInstance();
+  if (self) self->destroyClient();
+}
+
+void MqttClient::reconnect_job(uint32_t /*arg*/) {
+  MqttClient *self = getInstance();
+  if (self == nullptr) {
+    ESP_LOGE(TAG, "Reconnect: no instance");
+    return;
+  }
+  self->destroyClient();
+  vTaskDelay(pdMS_TO_TICKS(100));
+  esp_err_t err = self->start(mqttConfig);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Reconnect start failed: %s", esp_err_to_name(err));
+  }
 }
 
 // ── Event name table ───────────────────────────────────────────────────
@@ -93,19 +211,181 @@ const char *mqtt_event_names[] = {
 
 ESP_EVENT_DEFINE_BASE(ED_MQTT_SENSOR_EVENTS);
 
+// ── Boot timeline ─────────────────────────────────────────────────────
+static portMUX_TYPE s_boot_mux = portMUX_INITIALIZER_UNLOCKED;
+int64_t BootTimeline::s_at[STAGE_COUNT] = {};
+
+bool BootTimeline::mark(Stage stage) {
+  if (stage >= STAGE_COUNT)
+    return false;
+  int64_t now = esp_timer_get_time();
+  bool first = false;
+  taskENTER_CRITICAL(&s_boot_mux);
+  if (s_at[stage] == 0) {
+    s_at[stage] = now;
+    first = true;
+  }
+  taskEXIT_CRITICAL(&s_boot_mux);
+  return first;
+}
+
+int64_t BootTimeline::at(Stage stage) {
+  if (stage >= STAGE_COUNT)
+    return 0;
+  taskENTER_CRITICAL(&s_boot_mux);
+  int64_t t = s_at[stage];
+  taskEXIT_CRITICAL(&s_boot_mux);
+  return t;
+}
+
+const char *BootTimeline::name(Stage stage) {
+  static const char *const names[STAGE_COUNT] = {
+      "ip_ready", "dns_done", "connecting", "connack", "subscribed", "first_cmd"};
+  return stage < STAGE_COUNT ? names[stage] : "?";
+}
+
 // ── Public registration ────────────────────────────────────────────────
-void MqttClient::registerConnectedCallback(MqttConnectedCallback callback) {
-  if (connected_callback_count < MAX_CONNECTED_CALLBACKS)
+void MqttClient::registerConnectedCallback(MqttConnectedCallback callback,
+                                           const char *name) {
+  if (connected_callback_count < MAX_CONNECTED_CALLBACKS) {
+    char label[16];
+    snprintf(label, sizeof label, "conn.%u", connected_callback_count);
+    connected_hooks[connected_callback_count] =
+        HookProfiler::add(HookKind::CONNECTED, name ? name : label);
     connected_callbacks[connected_callback_count++] = callback;
-  else
-    ESP_LOGE(TAG, "Connected callback table full");
+  } else {
+    ESP_LOGE(TAG, "Connected callback table full (max %d, raise ED_MQTT_MAX_CONNECTED_CALLBACKS)",
+             MAX_CONNECTED_CALLBACKS);
+  }
 }
 
-void MqttClient::registerDataCallback(MqttDataCallback callback) {
-  if (data_callback_count < MAX_DATA_CALLBACKS)
+void MqttClient::registerDataCallback(MqttDataCallback callback, const char *name) {
+  if (data_callback_count < MAX_DATA_CALLBACKS) {
+    char label[16];
+    snprintf(label, sizeof label, "data.%u", data_callback_count);
+    data_hooks[data_callback_count] = HookProfiler::add(HookKind::DATA, name ? name : label);
     data_callbacks[data_callback_count++] = callback;
+  } else {
+    ESP_LOGE(TAG, "Data callback table full (max %d, raise ED_MQTT_MAX_DATA_CALLBACKS)",
+             MAX_DATA_CALLBACKS);
+  }
+}
+
+void MqttClient::registerTargetFilter(const char *topicFilter, MqttTargetFilter filter) {
+  if (filter && (!topicFilter || strlen(topicFilter) >= sizeof s_target_topic)) {
+    ESP_LOGE(TAG, "target filter needs a topic filter shorter than %u bytes",
+             (unsigned)sizeof s_target_topic);
+    return;
+  }
+  s_target_filter = nullptr;
+  if (filter)
+    strcpy(s_target_topic, topicFilter);
+  s_target_filter = filter;
+}
+
+bool MqttClient::setTopicCompression(const char *filter, bool enabled) {
+  if (!filter || !filter[0] || strlen(filter) >= SUB_FILTER_LEN)
+    return false;
+  taskENTER_CRITICAL(&s_compress_mux);
+  char *slot = nullptr;
+  char *free = nullptr;
+  for (uint8_t i = 0; i < MAX_COMPRESS_TOPICS; ++i) {
+    if (strcmp(s_compress_topics[i], filter) == 0)
+      slot = s_compress_topics[i];
+    else if (!free && !s_compress_topics[i][0])
+      free = s_compress_topics[i];
+  }
+  bool ok = true;
+  if (!enabled && slot)
+    slot[0] = '\0';
+  else if (enabled && !slot && free)
+    strcpy(free, filter);
+  else if (enabled && !slot)
+    ok = false;
+  taskEXIT_CRITICAL(&s_compress_mux);
+  if (!ok)
+    ESP_LOGE(TAG, "compressed topic table full (max %d)", MAX_COMPRESS_TOPICS);
+  else
+    ESP_LOGI(TAG, "%s: compression %s", filter, enabled ? "on" : "off");
+  return ok;
+}
+
+bool MqttClient::compressTopic(const char *topic) {
+  const int len = (int)strlen(topic);
+  bool hit = false;
+  taskENTER_CRITICAL(&s_compress_mux);
+  for (uint8_t i = 0; i < MAX_COMPRESS_TOPICS && !hit; ++i)
+    hit = s_compress_topics[i][0] && TopicRouter::matches(s_compress_topics[i], topic, len);
+  taskEXIT_CRITICAL(&s_compress_mux);
+  return hit;
+}
+
+bool MqttClient::registerDataCallback(const char *filter, MqttDataCallback callback,
+                                      const char *name) {
+  const int route = TopicRouter::add(filter, callback);
+  if (route < 0)
+    return false;
+  route_hooks[route] = HookProfiler::add(HookKind::ROUTE, name ? name : filter);
+  return true;
+}
+
+void MqttClient::registerPublishedCallback(MqttPublishedCallback callback) {
+  if (published_callback_count < MAX_PUBLISHED_CALLBACKS)
+    published_callbacks[published_callback_count++] = callback;
   else
-    ESP_LOGE(TAG, "Data callback table full");
+    ESP_LOGE(TAG, "Published callback table full (max %d, raise ED_MQTT_MAX_PUBLISHED_CALLBACKS)",
+             MAX_PUBLISHED_CALLBACKS);
+}
+
+// ── Static RAM report ─────────────────────────────────────────────────
+void MemoryReport::row(const char *name, unsigned inUse, unsigned capacity,
+                       size_t bytes) {
+  total += bytes;
+  if (used >= len)
+    return;
+  int n = capacity
+              ? snprintf(buf + used, len - used, "%-18s %4u/%-4u %6u\n", name,
+                         inUse, capacity, (unsigned)bytes)
+              : snprintf(buf + used, len - used, "%-18s %9s %6u\n", name, "",
+                         (unsigned)bytes);
+  if (n > 0)
+    used += ((size_t)n < len - used) ? (size_t)n : len - used - 1;
+}
+
+void MemoryReport::finish() {
+  if (used >= len)
+    return;
+  int n = snprintf(buf + used, len - used, "%-18s %9s %6u\n", "TOTAL", "",
+                   (unsigned)total);
+  if (n > 0)
+    used += ((size_t)n < len - used) ? (size_t)n : len - used - 1;
+}
+
+void MqttClient::memoryReport(MemoryReport &report) {
+  report.row("mqtt.connected_cb", connected_callback_count,
+             MAX_CONNECTED_CALLBACKS, sizeof connected_callbacks);
+  report.row("mqtt.data_cb", data_callback_count, MAX_DATA_CALLBACKS,
+             sizeof data_callbacks);
+  report.row("mqtt.published_cb", published_callback_count,
+             MAX_PUBLISHED_CALLBACKS, sizeof published_callbacks);
+  report.row("mqtt.payload", 0, 0, sizeof s_payload_buf);
+  report.row("mqtt.birth", 0, 0, sizeof s_birth_buf);
+  uint8_t retained = 0;
+  for (uint8_t i = 0; i < MAX_RETAINED_TOPICS; ++i)
+    retained += s_retained[i].used ? 1 : 0;
+  report.row("mqtt.retained", retained, MAX_RETAINED_TOPICS, sizeof s_retained);
+  uint8_t subs = 0;
+  for (uint8_t i = 0; i < MAX_SUBSCRIPTIONS; ++i)
+    subs += s_subs[i].used ? 1 : 0;
+  report.row("mqtt.subs", subs, MAX_SUBSCRIPTIONS, sizeof s_subs + sizeof s_connect_subs);
+  report.row("mqtt.request", 0, 0, sizeof s_request);
+  report.row("mqtt.deflate", 0, 0, sizeof s_deflate_buf);
+#if ED_MQTT_INFLATE_BUF_LEN > 0
+  report.row("mqtt.inflate", 0, 0, sizeof s_inflate_buf);
+#endif
+  TopicRouter::memoryReport(report);
+  Supervisor::memoryReport(report);
+  HookProfiler::memoryReport(report);
 }
 
 // ── URI resolution (no mutex) ─────────────────────────────────────────
@@ -156,25 +436,354 @@ snprintf(msgBuf, sizeof msgBuf, "offline");  mqttConfig = {};
 
 // ── Reconnect timer callback ──────────────────────────────────────────
 void MqttClient::mqtt_reconnect_timer_cb(TimerHandle_t xTimer) {
-  if (reconnect_queue) {
-    uint32_t signal = 1;
-    xQueueSend(reconnect_queue, &signal, 0);
+  Supervisor::post(reconnect_job, 0, Supervisor::LIFECYCLE);
+}
+
+// ── Birth message ─────────────────────────────────────────────────────
+// The firmware identity never changes at runtime: serialize it once and keep
+// the object open, so a connect only appends its dynamic fields.
+void MqttClient::buildBirthMessage() {
+  JsonWriter w(s_birth_buf, sizeof s_birth_buf);
+  w.beginObject();
+  w.addString("device", ED_SYS::ESP_std::Device::mqttName());
+  w.addString("project", ED_SYS::ESP_std::Firmware::prjName());
+  w.addString("version", ED_SYS::ESP_std::Firmware::version());
+  w.addString("tag", ED_SYS::ESP_std::Firmware::tag());
+  w.addInt("major", ED_SYS::ESP_std::Firmware::majorVersion());
+  w.addInt("minor", ED_SYS::ESP_std::Firmware::minorVersion());
+  w.addInt("patch", ED_SYS::ESP_std::Firmware::patchVersion());
+  w.addInt("build", ED_SYS::ESP_std::Firmware::buildNumber());
+  w.addString("hash_short", ED_SYS::ESP_std::Firmware::shortHash());
+  w.addString("hash_full", ED_SYS::ESP_std::Firmware::fullHash());
+  w.addString("build_id", ED_SYS::ESP_std::Firmware::buildId());
+  w.addBool("dirty", ED_SYS::ESP_std::Firmware::isDirty());
+  w.endObject();
+  if (w.overflow() || w.length() + BIRTH_DYNAMIC_LEN > sizeof s_birth_buf) {
+    ESP_LOGE(TAG, "birth message does not fit %u bytes", (unsigned)sizeof s_birth_buf);
+    s_birth_prefix_len = 0;
+    return;
+  }
+  s_birth_prefix_len = w.length() - 1;   // drop '}': dynamic fields follow
+}
+
+// Append the per-connect fields to the birth prefix. Returns the length.
+size_t MqttClient::birthMessage() {
+  if (s_birth_prefix_len == 0) {
+    s_birth_buf[0] = '\0';
+    return 0;
+  }
+  int n = snprintf(s_birth_buf + s_birth_prefix_len,
+                   sizeof s_birth_buf - s_birth_prefix_len,
+                   ",\"connects\":%lu,\"uptime_s\":%lld}",
+                   (unsigned long)s_connect_count,
+                   (long long)(esp_timer_get_time() / 1000000LL));
+  if (n < 0 || (size_t)n >= sizeof s_birth_buf - s_birth_prefix_len)
+    return 0;
+  return s_birth_prefix_len + (size_t)n;
+}
+
+// ── Retained-publish dedup ────────────────────────────────────────────
+// Caller holds s_retained_mux.
+MqttClient::RetainedEntry *MqttClient::retainedEntry(uint32_t topicHash, bool create) {
+  for (uint8_t i = 0; i < MAX_RETAINED_TOPICS; ++i)
+    if (s_retained[i].used && s_retained[i].topicHash == topicHash)
+      return &s_retained[i];
+  if (!create)
+    return nullptr;
+  RetainedEntry *e = nullptr;
+  for (uint8_t i = 0; i < MAX_RETAINED_TOPICS && !e; ++i)
+    if (!s_retained[i].used)
+      e = &s_retained[i];
+  if (!e) {
+    e = &s_retained[s_retained_next];
+    s_retained_next = (uint8_t)((s_retained_next + 1) % MAX_RETAINED_TOPICS);
+  }
+  *e = {};
+  e->topicHash = topicHash;
+  e->pendingMsgId = -1;
+  e->used = true;
+  return e;
+}
+
+void MqttClient::invalidateRetained(const char *topic) {
+  const uint32_t topicHash = topic ? fnv1a(topic, strlen(topic)) : 0;
+  taskENTER_CRITICAL(&s_retained_mux);
+  if (topic) {
+    if (RetainedEntry *e = retainedEntry(topicHash, false))
+      e->acked = false;
+  } else {
+    for (uint8_t i = 0; i < MAX_RETAINED_TOPICS; ++i)
+      s_retained[i].acked = false;
+  }
+  taskEXIT_CRITICAL(&s_retained_mux);
+}
+
+// ── Subscriptions ─────────────────────────────────────────────────────
+// The table changes under s_subs_mutex; SUBSCRIBE and UNSUBSCRIBE go out
+// after it is released.
+MqttClient::Subscription *MqttClient::findSubscription(const char *filter) {
+  for (uint8_t i = 0; i < MAX_SUBSCRIPTIONS; ++i)
+    if (s_subs[i].used && strncmp(s_subs[i].filter, filter, SUB_FILTER_LEN) == 0)
+      return &s_subs[i];
+  return nullptr;
+}
+
+bool MqttClient::addSubscription(const char *filter, int qos, uint16_t subscriptionId) {
+  if (!filter || !filter[0] || strlen(filter) >= SUB_FILTER_LEN || qos < 0 || qos > 2) {
+    ESP_LOGE(TAG, "invalid subscription '%s' (qos %d)", filter ? filter : "", qos);
+    return false;
+  }
+  SemaphoreHandle_t mutex = get_subs_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  Subscription *s = findSubscription(filter);
+  if (s && s->qos == qos && s->subId == subscriptionId) {
+    xSemaphoreGive(mutex);
+    return true;
+  }
+  for (uint8_t i = 0; i < MAX_SUBSCRIPTIONS && !s; ++i)
+    if (!s_subs[i].used) {
+      s = &s_subs[i];
+      *s = {};
+      strncpy(s->filter, filter, SUB_FILTER_LEN - 1);
+      s->used = true;
+    }
+  if (!s) {
+    xSemaphoreGive(mutex);
+    ESP_LOGE(TAG, "subscription table full (max %d, raise ED_MQTT_MAX_SUBSCRIPTIONS), '%s' dropped",
+             MAX_SUBSCRIPTIONS, filter);
+    return false;
+  }
+  s->qos = (uint8_t)qos;
+  s->subId = subscriptionId;
+  s->state = SubState::PENDING;
+  s->msgId = -1;
+  const bool send = s_connected;
+  xSemaphoreGive(mutex);
+  if (send)
+    sendSubscribe(filter, (uint8_t)qos, subscriptionId);
+  return true;
+}
+
+// One SUBSCRIBE at a time from the other tasks, so that a SUBACK handled
+// before the msg id is stored below is the one kept in s_early_suback.
+void MqttClient::sendSubscribe(const char *filter, uint8_t qos, uint16_t subId) {
+  ClientRef cl(_instance);
+  if (!cl)
+    return;
+  SemaphoreHandle_t serial = on_event_task() ? nullptr : get_subscribe_mutex();
+  if (serial)
+    xSemaphoreTake(serial, portMAX_DELAY);
+  SemaphoreHandle_t mutex = get_subs_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  s_early_suback.msgId = -1;
+  xSemaphoreGive(mutex);
+
+  const int msgId = subscribeOne(cl.get(), filter, qos, subId);
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  Subscription *s = findSubscription(filter);
+  if (s && s->state == SubState::PENDING && s->msgId < 0) {
+    if (msgId >= 0 && s_early_suback.msgId == msgId)
+      applySuback(*s, s_early_suback.code);
+    else
+      s->msgId = msgId;
+  }
+  s_early_suback.msgId = -1;
+  xSemaphoreGive(mutex);
+  if (serial)
+    xSemaphoreGive(serial);
+}
+
+bool MqttClient::removeSubscription(const char *filter) {
+  if (!filter)
+    return false;
+  SemaphoreHandle_t mutex = get_subs_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  Subscription *s = findSubscription(filter);
+  const bool found = s != nullptr;
+  const bool send = found && s_connected;
+  if (s)
+    s->used = false;
+  xSemaphoreGive(mutex);
+  if (send) {
+    ClientRef cl(_instance);
+    if (cl)
+      esp_mqtt_client_unsubscribe(cl.get(), filter);
   }
+  return found;
+}
+
+MqttClient::SubState MqttClient::subscriptionState(const char *filter, int *grantedQos) {
+  if (!filter)
+    return SubState::UNKNOWN;
+  SemaphoreHandle_t mutex = get_subs_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  const Subscription *s = findSubscription(filter);
+  SubState state = s ? s->state : SubState::UNKNOWN;
+  if (s && grantedQos && state == SubState::GRANTED)
+    *grantedQos = s->grantedQos;
+  xSemaphoreGive(mutex);
+  return state;
+}
+
+uint8_t MqttClient::subscriptionFailures() {
+  SemaphoreHandle_t mutex = get_subs_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < MAX_SUBSCRIPTIONS; ++i)
+    n += s_subs[i].used && s_subs[i].state == SubState::REFUSED ? 1 : 0;
+  xSemaphoreGive(mutex);
+  return n;
 }
 
-// ── Teardown task (releases mutex before destroying) ──────────────────
-void MqttClient::teardown_task(void *arg) {
-    while (true) {
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-        MqttClient *self = (arg != nullptr) ? static_cast<MqttClient *>(arg) : getInstance();
-        if (self == nullptr) continue;
-        self->destroyClient();
+// On connect: one SUBSCRIBE for every filter the broker does not hold. A
+// resumed session keeps the granted ones, a new session holds none. Runs on
+// the esp-mqtt task: no SUBACK is handled before the msg ids are stored.
+void MqttClient::subscribeAll(esp_mqtt_client_handle_t client) {
+  esp_mqtt_topic_t topics[MAX_SUBSCRIPTIONS];
+  int n = 0;
+  int single = 0;
+  uint8_t m = 0;
+  SemaphoreHandle_t mutex = get_subs_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < MAX_SUBSCRIPTIONS; ++i) {
+    Subscription &s = s_subs[i];
+    if (!s.used || (s_session_present && s.state == SubState::GRANTED))
+      continue;
+    s.state = SubState::PENDING;
+    s.msgId = -1;
+    s_connect_subs[m++] = s;   // slot order: the SUBACK reason-code order
+  }
+  xSemaphoreGive(mutex);
+
+  for (uint8_t i = 0; i < m; ++i) {
+    Subscription &s = s_connect_subs[i];
+    if (s.subId) {   // the identifier is a property of the whole SUBSCRIBE
+      s.msgId = subscribeOne(client, s.filter, s.qos, s.subId);
+      ++single;
+    } else {
+      topics[n++] = {s.filter, s.qos};
     }
+  }
+  const int msgId = n > 0 ? subscribeMany(client, topics, n) : -1;
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < m; ++i) {
+    const Subscription &c = s_connect_subs[i];
+    Subscription *s = findSubscription(c.filter);
+    if (s && s->state == SubState::PENDING && s->msgId < 0)
+      s->msgId = c.subId ? c.msgId : msgId;
+  }
+  xSemaphoreGive(mutex);
+
+  if (n == 0 && single == 0) {
+    ESP_LOGI(TAG, "session resumed, subscriptions kept");
+    BootTimeline::mark(BootTimeline::SUBSCRIBED);
+  } else if (n > 0 && msgId < 0) {
+    ESP_LOGE(TAG, "SUBSCRIBE of %d filters not sent", n);
+  } else {
+    ESP_LOGI(TAG, "SUBSCRIBE %d filters (+%d with an identifier), msg_id=%d", n,
+             single, msgId);
+  }
+}
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+static void set_subscribe_id(esp_mqtt_client_handle_t client, uint16_t id) {
+  esp_mqtt5_subscribe_property_config_t prop = {};
+  prop.subscribe_id = id;
+  esp_err_t err = esp_mqtt5_client_set_subscribe_property(client, &prop);
+  if (err != ESP_OK)
+    ESP_LOGW(TAG, "subscription identifier %u not set: %s", id, esp_err_to_name(err));
+}
+#endif
+
+// The subscribe property is consumed by the next SUBSCRIBE. Another task
+// arms s_armed_sub_id before setting it; the esp-mqtt task, which may run
+// between that task's two calls, sends its own identifier (0: none) and
+// then puts the other one back.
+int MqttClient::subscribeOne(esp_mqtt_client_handle_t client, const char *filter,
+                             uint8_t qos, uint16_t subId) {
+#ifdef CONFIG_MQTT_PROTOCOL_5
+  const bool eventTask = on_event_task();
+  const uint16_t other = eventTask ? s_armed_sub_id.load() : 0;
+  if (!eventTask)
+    s_armed_sub_id.store(subId);
+  if (subId || other)
+    set_subscribe_id(client, subId);
+  const int msgId = esp_mqtt_client_subscribe(client, filter, qos);
+  if (other)
+    set_subscribe_id(client, other);
+  if (!eventTask)
+    s_armed_sub_id.store(0);
+  return msgId;
+#else
+  return esp_mqtt_client_subscribe(client, filter, qos);
+#endif
+}
+
+// esp-mqtt task only (see subscribeOne()).
+int MqttClient::subscribeMany(esp_mqtt_client_handle_t client,
+                              const esp_mqtt_topic_t *topics, int n) {
+#ifdef CONFIG_MQTT_PROTOCOL_5
+  const uint16_t other = s_armed_sub_id.load();
+  if (other)
+    set_subscribe_id(client, 0);
+  const int msgId = esp_mqtt_client_subscribe_multiple(client, topics, n);
+  if (other)
+    set_subscribe_id(client, other);
+  return msgId;
+#else
+  return esp_mqtt_client_subscribe_multiple(client, topics, n);
+#endif
+}
+
+// code < 0: granted without a reason code, at the requested QoS.
+void MqttClient::applySuback(Subscription &s, int code) {
+  s.msgId = -1;
+  if (code >= 0x80) {
+    s.state = SubState::REFUSED;
+    ESP_LOGE(TAG, "subscription '%s' refused (0x%02x)", s.filter, code);
+  } else {
+    s.state = SubState::GRANTED;
+    s.grantedQos = code < 0 ? s.qos : (uint8_t)code;
+  }
+}
+
+// SUBACK: one reason code per filter, in SUBSCRIBE order; >= 0x80 refused.
+void MqttClient::handleSuback(const esp_mqtt_event_t *event) {
+  const uint8_t *codes = reinterpret_cast<const uint8_t *>(event->data);
+  const int nCodes = codes ? event->data_len : 0;
+  const bool failed = event->error_handle &&
+                      event->error_handle->error_type == MQTT_ERROR_TYPE_SUBSCRIBE_FAILED;
+  bool pending = false;
+  SemaphoreHandle_t mutex = get_subs_mutex();
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  int k = 0;
+  for (uint8_t i = 0; i < MAX_SUBSCRIPTIONS; ++i) {
+    Subscription &s = s_subs[i];
+    if (!s.used)
+      continue;
+    if (s.msgId == event->msg_id && s.state == SubState::PENDING) {
+      applySuback(s, k < nCodes ? codes[k] : (failed ? 0x80 : -1));
+      ++k;
+    }
+    pending |= s.state == SubState::PENDING;
+  }
+  if (k == 0) {   // sendSubscribe() has not stored its msg id yet
+    s_early_suback.msgId = event->msg_id;
+    s_early_suback.code = nCodes > 0 ? codes[0] : (failed ? 0x80 : -1);
+  }
+  xSemaphoreGive(mutex);
+
+  if (!pending && BootTimeline::mark(BootTimeline::SUBSCRIBED))
+    ESP_LOGI(TAG, "Subscriptions complete %lld ms after boot",
+             (long long)(BootTimeline::at(BootTimeline::SUBSCRIBED) / 1000));
 }
 
 // ── Singleton creation ────────────────────────────────────────────────
 MqttClient *MqttClient::create(esp_mqtt_client_config_t *config) {
   if (_instance) return _instance;
+  AllocScope allocScope("mqtt.create");
 
   if (config) mqttConfig = *config;
   else setDefaultConfig();
@@ -182,18 +791,21 @@ MqttClient *MqttClient::create(esp_mqtt_client_config_t *config) {
   // ✅ Ensure statusTopicBuf is always set (depends on device name, not on config)
   snprintf(statusTopicBuf, sizeof(statusTopicBuf), "devices/%s/status",
            ED_SYS::ESP_std::Device::mqttName());
+  buildBirthMessage();
+  addSubscription("devices/connection", 0);
+
+  // Before any timer that posts exists: post() does not start it.
+  if (Supervisor::start() != ESP_OK)
+    return nullptr;
 
   _instance = new MqttClient();
   if (!_instance) {
     ESP_LOGE(TAG, "Failed to allocate instance");
     return nullptr;
   }
-
-  xTaskCreate(teardown_task, "mqtt_teardown", 4096, _instance, tskIDLE_PRIORITY + 1, &teardown_task_handle);
   esp_err_t err = _instance->start(mqttConfig);
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "Start failed: %s", esp_err_to_name(err));
-    if (teardown_task_handle) vTaskDelete(teardown_task_handle);
     delete _instance;
     _instance = nullptr;
     return nullptr;
@@ -203,32 +815,50 @@ MqttClient *MqttClient::create(esp_mqtt_client_config_t *config) {
 }
 
 esp_mqtt_client_handle_t MqttClient::getHandle() {
-  return client;
+  return client.load();
+}
+
+// ── Client handle borrowing ───────────────────────────────────────────
+// Count first, then read the handle; destroyClient() clears the handle,
+// then reads the count. Both sequentially consistent: a borrower that still
+// sees the old handle is always seen in the count.
+MqttClient::ClientRef::ClientRef(MqttClient *owner) {
+  if (!owner)
+    return;
+  s_client_users.fetch_add(1);
+  handle = owner->client.load();
+  if (handle)
+    counted = true;
+  else
+    s_client_users.fetch_sub(1);
+}
+
+MqttClient::ClientRef::~ClientRef() {
+  if (counted)
+    s_client_users.fetch_sub(1);
 }
 
 void MqttClient::mqtt_event_trampoline(void *handler_args, esp_event_base_t base,
                                        int32_t event_id, void *event_data) {
+  s_event_task.store(xTaskGetCurrentTaskHandle());
   ((MqttClient *)handler_args)->handleEvent(base, event_id, event_data);
 }
 
-// ── Start (caller must hold mutex) ────────────────────────────────────
+// ── Start ─────────────────────────────────────────────────────────────
+// Serialized with destroyClient() by the lifecycle mutex. The handle is
+// published before esp_mqtt_client_start(), so CONNECTED callbacks can
+// already publish through it.
 esp_err_t MqttClient::start(esp_mqtt_client_config_t config) {
-    SemaphoreHandle_t mutex = get_mqtt_mutex();
+    AllocScope allocScope("mqtt.start");   // esp-mqtt allocates its client here
+    SemaphoreHandle_t mutex = get_lifecycle_mutex();
     xSemaphoreTake(mutex, portMAX_DELAY);
-    if (client != nullptr) {
+    if (client.load() != nullptr) {
         xSemaphoreGive(mutex);
         return ESP_OK;  // already started
     }
 
-    const char *uri = resolve_uri_with_fallback(config.broker.address.uri);
-    config.broker.address.uri = uri;
-    client = esp_mqtt_client_init(&config);
-    if (!client) {
-        xSemaphoreGive(mutex);
-        return ESP_FAIL;
-    }
-
 #ifdef CONFIG_MQTT_PROTOCOL_5
+    // No handle yet, so no publisher reads the property handles.
     // Create a user property handle with one item: "client-id"
     if (s_publish_property == nullptr) {
         esp_mqtt5_user_property_item_t prop_item = {
@@ -242,23 +872,44 @@ esp_err_t MqttClient::start(esp_mqtt_client_config_t config) {
             ESP_LOGI(TAG, "MQTT5 user property 'client-id' = %s", prop_item.value);
         }
     }
+    // Same list plus the compression marker, built once for compressed publishes.
+    if (s_publish_property_lzss == nullptr) {
+        esp_mqtt5_user_property_item_t items[2] = {
+            {.key = "client-id",
+             .value = const_cast<char*>(ED_SYS::ESP_std::Device::mqttName())},
+            {.key = "enc", .value = Lzss::NAME},
+        };
+        esp_err_t err = esp_mqtt5_client_set_user_property(&s_publish_property_lzss, items, 2);
+        if (err != ESP_OK)
+            ESP_LOGW(TAG, "Failed to create 'enc' user property: %s", esp_err_to_name(err));
+    }
 #endif
 
+    const char *uri = resolve_uri_with_fallback(config.broker.address.uri);
+    config.broker.address.uri = uri;
+    BootTimeline::mark(BootTimeline::DNS_DONE);
+    esp_mqtt_client_handle_t h = esp_mqtt_client_init(&config);
+    if (!h) {
+        xSemaphoreGive(mutex);
+        return ESP_FAIL;
+    }
+
     if (!eventsRegistered) {
-        esp_err_t err = esp_mqtt_client_register_event(client, MQTT_EVENT_ANY,
+        esp_err_t err = esp_mqtt_client_register_event(h, MQTT_EVENT_ANY,
                                                        mqtt_event_trampoline, this);
         if (err != ESP_OK) {
-            esp_mqtt_client_destroy(client);
-            client = nullptr;
+            esp_mqtt_client_destroy(h);
             xSemaphoreGive(mutex);
             return err;
         }
         eventsRegistered = true;
     }
-    esp_err_t ret = esp_mqtt_client_start(client);
+    client.store(h);
+    esp_err_t ret = esp_mqtt_client_start(h);
     if (ret != ESP_OK) {
-        esp_mqtt_client_destroy(client);
-        client = nullptr;
+        client.store(nullptr);
+        waitForClientUsers();
+        esp_mqtt_client_destroy(h);
         eventsRegistered = false;
     }
     xSemaphoreGive(mutex);
@@ -267,8 +918,9 @@ esp_err_t MqttClient::start(esp_mqtt_client_config_t config) {
 
 void MqttClient::scheduleReconnect(uint32_t delay_ms) {
   if (mqtt_reconnect_timer == nullptr) {
-    mqtt_reconnect_timer = xTimerCreate("mqtt_reconnect", pdMS_TO_TICKS(delay_ms), pdFALSE,
-                                        nullptr, mqtt_reconnect_timer_cb);
+    mqtt_reconnect_timer = xTimerCreateStatic("mqtt_reconnect", pdMS_TO_TICKS(delay_ms),
+                                              pdFALSE, nullptr, mqtt_reconnect_timer_cb,
+                                              &s_reconnect_timer_buf);
     configASSERT(mqtt_reconnect_timer);
   } else {
     xTimerStop(mqtt_reconnect_timer, 0);
@@ -278,20 +930,20 @@ void MqttClient::scheduleReconnect(uint32_t delay_ms) {
 }
 
 void MqttClient::health_timer_cb(TimerHandle_t xTimer) {
-    SemaphoreHandle_t mutex = get_mqtt_mutex();
-    xSemaphoreTake(mutex, portMAX_DELAY);
-    uint8_t fails = s_publish_fail_count;
-    if (fails >= MAX_CONSECUTIVE_FAILURES) {
-        // Reset early to avoid double-trigger
-        s_publish_fail_count = 0;
-        xSemaphoreGive(mutex);
+    Supervisor::post(health_job, 0, Supervisor::LIFECYCLE);
+}
 
-        ESP_LOGW(TAG, "%u publish failures, forcing reconnect", fails);
-        forceReconnect();
-        if (s_reconnect_callback) s_reconnect_callback();
-    } else {
-        xSemaphoreGive(mutex);
-    }
+// Lock-free: the failure count is atomic, so a publish stuck in the
+// network stack cannot hold up the health check.
+void MqttClient::health_job(uint32_t /*arg*/) {
+    const uint8_t fails = s_publish_fail_count.load();
+    if (fails < MAX_CONSECUTIVE_FAILURES)
+        return;
+    // Reset early to avoid double-trigger
+    s_publish_fail_count.store(0);
+    ESP_LOGW(TAG, "%u publish failures, forcing reconnect", fails);
+    forceReconnect();
+    if (s_reconnect_callback) s_reconnect_callback();
 }
 
 bool MqttClient::isShortOutage() {
@@ -308,8 +960,7 @@ bool MqttClient::isShortOutage() {
 
 void MqttClient::forceReconnect() {
     ESP_LOGW(TAG, "forceReconnect() called");
-    if (teardown_task_handle) xTaskNotify(teardown_task_handle, 0, eNoAction); // triggers destroyClient via teardown task
-    // Alternative: directly call destroyClient() here if you prefer, but teardown task is already there.
+    Supervisor::post(teardown_job, 0, Supervisor::LIFECYCLE);
     scheduleReconnect(1000);
 }
 
@@ -323,53 +974,41 @@ void MqttClient::handleEvent(esp_event_base_t base, int32_t event_id,
   auto *event = (esp_mqtt_event_t *)event_data;
   switch (event_id) {
   case MQTT_EVENT_CONNECTED: {
-    ESP_LOGI(TAG, "Connected");
-    char jsonBuf[1024];
-    snprintf(jsonBuf, sizeof(jsonBuf),
-        "{"
-        "\"device\":\"%s\","
-        "\"project\":\"%s\","
-        "\"version\":\"%s\","
-        "\"tag\":\"%s\","
-        "\"major\":%d,"
-        "\"minor\":%d,"
-        "\"patch\":%d,"
-        "\"build\":%d,"
-        "\"hash_short\":\"%s\","
-        "\"hash_full\":\"%s\","
-        "\"build_id\":\"%s\","
-        "\"dirty\":%s"
-        "}",
-        ED_SYS::ESP_std::Device::mqttName(),          // device ID
-        ED_SYS::ESP_std::Firmware::prjName(),
-        ED_SYS::ESP_std::Firmware::version(),         // full version string
-        ED_SYS::ESP_std::Firmware::tag(),
-        ED_SYS::ESP_std::Firmware::majorVersion(),
-        ED_SYS::ESP_std::Firmware::minorVersion(),
-        ED_SYS::ESP_std::Firmware::patchVersion(),
-        ED_SYS::ESP_std::Firmware::buildNumber(),
-        ED_SYS::ESP_std::Firmware::shortHash(),
-        ED_SYS::ESP_std::Firmware::fullHash(),
-        ED_SYS::ESP_std::Firmware::buildId(),
-        ED_SYS::ESP_std::Firmware::isDirty() ? "true" : "false"
-    );
-
-    // Publish the JSON status (replaces "online")
-    esp_mqtt_client_publish(client, statusTopicBuf, jsonBuf, 0, 1, 1);
-    esp_mqtt_client_subscribe(client, "devices/connection", 0);
-    int sub_id = esp_mqtt_client_subscribe(client, "cmd", 0);
-    ESP_LOGI(TAG, "Subscribe to cmd returned msg_id=%d", sub_id);
+    ESP_LOGI(TAG, "Connected (session %s)", event->session_present ? "present" : "new");
+    ++s_connect_count;
+    BootTimeline::mark(BootTimeline::CONNACK);
+    // Without the old session the broker may have lost its retained store
+    // too: every retained topic is published again.
+    s_session_present = event->session_present != 0;
+    if (!s_session_present)
+      invalidateRetained();
+
+    // Publish the JSON status (replaces "online"): the prebuilt birth
+    // message, straight from its static buffer. Not compressed: it is small
+    // and the connect path should stay cheap.
+    size_t birthLen = birthMessage();
+    if (birthLen > 0) {
+      PublishOptions statusOpts;
+      statusOpts.contentType = "application/json";
+      publishWithId(statusTopicBuf, s_birth_buf, (int)birthLen, 1, true, &statusOpts);
+    }
+    s_connected = true;
+    subscribeAll(event->client);
     for (uint8_t i = 0; i < connected_callback_count; ++i)
-      if (connected_callbacks[i]) connected_callbacks[i](event->client);
+      if (connected_callbacks[i]) {
+        HookTimer timed(connected_hooks[i]);
+        connected_callbacks[i](event->client);
+      }
     break;
   }
 
   case MQTT_EVENT_DISCONNECTED:
+    s_connected = false;
     if (isShortOutage()) {
       ESP_LOGW(TAG, "Transient disconnect, letting MQTT auto‑reconnect");
     } else {
       ESP_LOGE(TAG, "Prolonged disconnect, tearing down client");
-      if (teardown_task_handle) xTaskNotify(teardown_task_handle, 0, eNoAction);
+      Supervisor::post(teardown_job, 0, Supervisor::LIFECYCLE);
       scheduleReconnect(3000);
     }
     break;
@@ -377,19 +1016,28 @@ void MqttClient::handleEvent(esp_event_base_t base, int32_t event_id,
   case MQTT_EVENT_ERROR:
     if (event->error_handle && event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
       ESP_LOGE(TAG, "Transport error, tearing down");
-      if (teardown_task_handle) xTaskNotify(teardown_task_handle, 0, eNoAction);
+      Supervisor::post(teardown_job, 0, Supervisor::LIFECYCLE);
       scheduleReconnect(5000);
     }
     break;
 
   case MQTT_EVENT_DATA: {
-    ESP_LOGI(TAG, "MQTT EVENT DATA received: topic=%.*s, data=%.*s",
+    AllocScope allocScope("mqtt.data", AllocScope::HOT);
+    ESP_LOGD(TAG, "MQTT EVENT DATA received: topic=%.*s, data=%.*s",
              event->topic_len, event->topic,
              event->data_len, event->data);
     if (event->current_data_offset == 0) {
       s_payload_len = 0;
       s_payload_expected = event->total_data_len;
+      // Properties only arrive with the first fragment. Not addressed to
+      // this device (target filter): skip every fragment, no reassembly.
+      s_payload_skip = false;
+      mqtt5_parse_request(event);
+      if (s_payload_skip)
+        ESP_LOGD(TAG, "message for '%s' skipped", s_request.target);
     }
+    if (s_payload_skip)
+      break;
     size_t incoming = event->data_len;
     if (s_payload_len + incoming > MAX_MQTT_PAYLOAD) {
       ESP_LOGW(TAG, "Payload too big, dropping");
@@ -403,25 +1051,80 @@ void MqttClient::handleEvent(esp_event_base_t base, int32_t event_id,
                         ? (s_payload_len >= s_payload_expected)
                         : (event->current_data_offset + incoming >= (size_t)event->total_data_len);
     if (complete) {
-uint32_t msgID = mqtt5_get_epoch_property(event);
+uint32_t msgID = s_request.epoch;
 if (msgID == 0) {
     // Fallback to packet ID if epoch missing or zero (zero is unlikely for real epoch)
     msgID = event->msg_id;
-    ESP_LOGI(TAG, "Epoch not available, using packet ID: %u", msgID);
+    ESP_LOGD(TAG, "Epoch not available, using packet ID: %u", msgID);
 } else {
-    ESP_LOGI(TAG, "Using epoch: %u", msgID);
+    ESP_LOGD(TAG, "Using epoch: %u", msgID);
 }
 
-for (uint8_t i = 0; i < data_callback_count; ++i)
-        if (data_callbacks[i])
+      const char *payload = s_payload_buf;
+      size_t payloadLen = s_payload_len;
+      if (s_request.compressed) {
+#if ED_MQTT_INFLATE_BUF_LEN > 0
+        payloadLen = Lzss::decompress(reinterpret_cast<const uint8_t *>(s_payload_buf),
+                                      s_payload_len, s_inflate_buf, sizeof s_inflate_buf);
+        payload = reinterpret_cast<const char *>(s_inflate_buf);
+#else
+        payloadLen = 0;
+#endif
+        if (payloadLen == 0) {
+          ESP_LOGW(TAG, "compressed payload (%u bytes) not inflated, dropped",
+                   (unsigned)s_payload_len);
+          s_payload_len = 0;
+          s_payload_expected = 0;
+          break;
+        }
+      }
+
+      for (uint8_t i = 0; i < data_callback_count; ++i)
+        if (data_callbacks[i]) {
+          HookTimer timed(data_hooks[i]);
           data_callbacks[i](event->client, event->topic, event->topic_len,
-                            s_payload_buf, s_payload_len, msgID);
+                            payload, payloadLen, msgID);
+        }
+      // Filtered callbacks: one trie walk, then each match once.
+      for (uint32_t routes = TopicRouter::match(event->topic, event->topic_len);
+           routes; routes &= routes - 1) {
+        const uint8_t route = (uint8_t)__builtin_ctz(routes);
+        if (MqttDataCallback cb = TopicRouter::callback(route)) {
+          HookTimer timed(route_hooks[route]);
+          cb(event->client, event->topic, event->topic_len, payload, payloadLen, msgID);
+        }
+      }
       s_payload_len = 0;
       s_payload_expected = 0;
     }
     break;
   }
 
+  case MQTT_EVENT_BEFORE_CONNECT:
+    BootTimeline::mark(BootTimeline::CONNECTING);
+    break;
+
+  case MQTT_EVENT_SUBSCRIBED:
+    handleSuback(event);
+    break;
+
+  case MQTT_EVENT_PUBLISHED: {
+    // Never the client mutex here (see s_retained_mux).
+    taskENTER_CRITICAL(&s_retained_mux);
+    for (uint8_t i = 0; i < MAX_RETAINED_TOPICS; ++i) {
+      RetainedEntry &e = s_retained[i];
+      if (e.used && e.pendingMsgId == event->msg_id) {
+        e.ackedHash = e.pendingHash;
+        e.acked = true;
+        e.pendingMsgId = -1;
+      }
+    }
+    taskEXIT_CRITICAL(&s_retained_mux);
+    for (uint8_t i = 0; i < published_callback_count; ++i)
+      if (published_callbacks[i]) published_callbacks[i](event->msg_id);
+    break;
+  }
+
   default:
     if (event_id >= 0 && event_id < (int)(sizeof(mqtt_event_names) / sizeof(mqtt_event_names[0])))
       ESP_LOGD(TAG, "Event: %s", mqtt_event_names[event_id]);
@@ -429,181 +1132,306 @@ for (uint8_t i = 0; i < data_callback_count; ++i)
   }
 }
 
-// ── MQTT5 epoch property ──────────────────────────────────────────────
-uint32_t MqttClient::mqtt5_get_epoch_property(const esp_mqtt_event_t *event) {
 #ifdef CONFIG_MQTT_PROTOCOL_5
-    if (!event) {
-        ESP_LOGI(TAG, "epoch: event is NULL");
-        return 0;
-    }
-    if (!event->property || !event->property->user_property) {
-        ESP_LOGI(TAG, "epoch: property or user_property is NULL");
-        return 0;
-    }
-
-    mqtt5_user_property_handle_t handle = event->property->user_property;
-    uint8_t count = esp_mqtt5_client_get_user_property_count(handle);
-    ESP_LOGI(TAG, "epoch: property count = %u", count);
-    if (count == 0) return 0;
-
-    // Allocate on heap to avoid stack overflow (count is small)
-    esp_mqtt5_user_property_item_t *items = (esp_mqtt5_user_property_item_t*)malloc(
-        sizeof(esp_mqtt5_user_property_item_t) * count);
-    if (!items) {
-        ESP_LOGE(TAG, "epoch: malloc failed");
-        return 0;
-    }
-
-    uint8_t actual = count;
-    esp_err_t err = esp_mqtt5_client_get_user_property(handle, items, &actual);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "epoch: get_user_property failed: %s", esp_err_to_name(err));
-        free(items);
-        return 0;
-    }
-
-    ESP_LOGI(TAG, "epoch: actual properties = %u", actual);
-    uint32_t result = 0;
-    for (uint8_t i = 0; i < actual; i++) {
-        ESP_LOGD(TAG, "epoch: property[%u] key='%s', value='%s'",
-                 i, items[i].key ? items[i].key : "(null)",
-                 items[i].value ? items[i].value : "(null)");
-        if (items[i].key && strcmp(items[i].key, "epoch") == 0 && items[i].value) {
-            // Copy the value to a local buffer
-            char epoch_str[32];
-            size_t len = strlen(items[i].value);
-            if (len >= sizeof(epoch_str)) len = sizeof(epoch_str)-1;
-            memcpy(epoch_str, items[i].value, len);
-            epoch_str[len] = '\0';
-            ESP_LOGI(TAG, "epoch: raw value = '%s' (len=%zu)", epoch_str, len);
+void MqttClient::deleteUserProperties() {
+    if (s_publish_property) {
+        esp_mqtt5_client_delete_user_property(s_publish_property);
+        s_publish_property = nullptr;
+    }
+    if (s_publish_property_lzss) {
+        esp_mqtt5_client_delete_user_property(s_publish_property_lzss);
+        s_publish_property_lzss = nullptr;
+    }
+}
+#endif
+
+// ── MQTT5 request properties ──────────────────────────────────────────
+void MqttClient::mqtt5_parse_request(const esp_mqtt_event_t *event) {
+    s_request.responseTopic[0] = '\0';
+    s_request.correlationLen = 0;
+    s_request.correlationTruncated = false;
+    s_request.epoch = 0;
+    s_request.dup = event ? event->dup : false;
+    s_request.subscriptionId = 0;
+    s_request.qos = event ? event->qos : 0;
+    s_request.compressed = false;
+    s_request.target[0] = '\0';
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (!event || !event->property) return;
+    const esp_mqtt5_event_property_t *prop = event->property;
+    s_request.subscriptionId = (uint16_t)prop->subscribe_id;
+
+    if (prop->response_topic && prop->response_topic_len > 0) {
+        size_t n = (size_t)prop->response_topic_len;
+        if (n >= sizeof(s_request.responseTopic)) {
+            ESP_LOGW(TAG, "response topic too long (%u), ignored", (unsigned)n);
+        } else {
+            memcpy(s_request.responseTopic, prop->response_topic, n);
+            s_request.responseTopic[n] = '\0';
+        }
+    }
 
+    if (prop->correlation_data && prop->correlation_data_len > 0) {
+        size_t n = prop->correlation_data_len;
+        if (n > sizeof(s_request.correlation)) {
+            n = sizeof(s_request.correlation);
+            s_request.correlationTruncated = true;
+            ESP_LOGW(TAG, "correlation data truncated to %u bytes", (unsigned)n);
+        }
+        memcpy(s_request.correlation, prop->correlation_data, n);
+        s_request.correlationLen = (uint16_t)n;
+    }
+
+    if (!prop->user_property) return;
+    // Public getter: the list layout is esp-mqtt's own. It returns copies of
+    // every key and value, freed below (the only heap use on this path).
+    esp_mqtt5_user_property_item_t items[MAX_USER_PROPS];
+    uint8_t count = MAX_USER_PROPS;
+    {
+        AllocScope allocScope("mqtt.props", AllocScope::EXEMPT);
+        const uint8_t total = esp_mqtt5_client_get_user_property_count(prop->user_property);
+        if (total > MAX_USER_PROPS)
+            ESP_LOGW(TAG, "%u user properties, only the first %u read (raise ED_MQTT_MAX_USER_PROPS)",
+                     total, MAX_USER_PROPS);
+        if (esp_mqtt5_client_get_user_property(prop->user_property, items, &count) != ESP_OK) {
+            ESP_LOGW(TAG, "user properties not readable");
+            return;
+        }
+    }
+    for (uint8_t i = 0; i < count; ++i) {
+        const char *key = items[i].key;
+        const char *value = items[i].value;
+        if (!key || !value)
+            continue;
+        if (strcmp(key, "enc") == 0) {
+            if (strcmp(value, Lzss::NAME) == 0)
+                s_request.compressed = true;
+            else
+                ESP_LOGW(TAG, "unknown payload encoding '%s'", value);
+        } else if (strcmp(key, "target") == 0) {
+            strncpy(s_request.target, value, sizeof(s_request.target) - 1);
+            s_request.target[sizeof(s_request.target) - 1] = '\0';
+            // Whole list, not the copy: ids past MAX_TARGET_LEN count too.
+            MqttTargetFilter filter = s_target_filter;
+            if (filter && TopicRouter::matches(s_target_topic, event->topic, event->topic_len))
+                s_payload_skip = !filter(value);
+        } else if (strcmp(key, "epoch") == 0) {
             // Manual digit‑by‑digit conversion (no strtoll, avoids %lld)
             uint32_t val = 0;
-            const char *p = epoch_str;
+            const char *p = value;
             while (*p >= '0' && *p <= '9') {
-                // Check for overflow (2^32-1 is 4294967295, max 10 digits)
-                if (val > 429496729) {   // 429496729 = 2^32/10 - 1, prevents overflow
-                    ESP_LOGW(TAG, "epoch: value > 2^32-1, truncating to 32-bit");
-                }
                 val = val * 10 + (*p - '0');
                 p++;
             }
             if (*p == '\0') {
-                result = val;
-                ESP_LOGI(TAG, "epoch: successfully parsed epoch = %u", result);
+                s_request.epoch = val;
             } else {
                 ESP_LOGW(TAG, "epoch: invalid characters after digits: '%s'", p);
-                result = 0;
             }
-            break;
         }
     }
-    free(items);
-    ESP_LOGI(TAG, "epoch: returning %u", result);
-    return result;
-#else
-    ESP_LOGW(TAG, "MQTT5 not enabled, returning 0");
-    return 0;
+    for (uint8_t i = 0; i < count; ++i) {
+        free((void *)items[i].key);
+        free((void *)items[i].value);
+    }
 #endif
 }
 
 // ── Destructor & destroyClient ────────────────────────────────────────
 MqttClient::~MqttClient() {
-  if (eventsRegistered && client) {
-    esp_mqtt_client_unregister_event(client, MQTT_EVENT_ANY, mqtt_event_trampoline);
+  esp_mqtt_client_handle_t h = client.exchange(nullptr);
+  if (h) waitForClientUsers();
+  if (eventsRegistered && h) {
+    esp_mqtt_client_unregister_event(h, MQTT_EVENT_ANY, mqtt_event_trampoline);
     eventsRegistered = false;
   }
-  if (client) {
-    esp_mqtt_client_stop(client);
-    esp_mqtt_client_destroy(client);
-    client = nullptr;
+  if (h) {
+    esp_mqtt_client_stop(h);
+    esp_mqtt_client_destroy(h);
   }
 
 #ifdef CONFIG_MQTT_PROTOCOL_5
-  if (s_publish_property) {
-    esp_mqtt5_client_delete_user_property(s_publish_property);
-    s_publish_property = nullptr;
-  }
+  deleteUserProperties();
 #endif
 }
 
+// Unpublishes the handle, waits for the borrowers still using it, then
+// destroys it. Never called while holding a ClientRef (it would wait for
+// itself): it runs on the supervisor task.
 void MqttClient::destroyClient() {
-    SemaphoreHandle_t mutex = get_mqtt_mutex();
+    SemaphoreHandle_t mutex = get_lifecycle_mutex();
     xSemaphoreTake(mutex, portMAX_DELAY);
-    esp_mqtt_client_handle_t old = client;
-    client = nullptr;
+    esp_mqtt_client_handle_t old = client.exchange(nullptr);
+    s_connected = false;
+    if (old)
+        waitForClientUsers();
     eventsRegistered = false;
 
 #ifdef CONFIG_MQTT_PROTOCOL_5
-    if (s_publish_property) {
-        esp_mqtt5_client_delete_user_property(s_publish_property);
-        s_publish_property = nullptr;
-    }
+    // No borrower left and none can start: the handle is gone.
+    deleteUserProperties();
 #endif
 
-    xSemaphoreGive(mutex);
-
     if (old) {
         esp_mqtt_client_stop(old);
         esp_mqtt_client_destroy(old);
     }
+    xSemaphoreGive(mutex);
+}
+
+// Only publishers count, and they are bounded by the esp-mqtt network
+// timeout; there is nothing to cancel, so this waits as long as it takes.
+void MqttClient::waitForClientUsers() {
+    const int64_t t0 = esp_timer_get_time();
+    bool warned = false;
+    while (s_client_users.load() != 0) {
+        vTaskDelay(1);
+        if (!warned && esp_timer_get_time() - t0 > 1000000) {
+            ESP_LOGW(TAG, "teardown waiting for %lu client user(s)",
+                     (unsigned long)s_client_users.load());
+            warned = true;
+        }
+    }
+    const int64_t waited = (esp_timer_get_time() - t0) / 1000;
+    if (waited > 0)
+        ESP_LOGD(TAG, "teardown waited %lld ms for client users", (long long)waited);
 }
 
 void MqttClient::setInstance(MqttClient *instance) {
   if (_instance == nullptr && instance != nullptr) {
     _instance = instance;
-    if (reconnect_queue == nullptr) {
-      reconnect_queue = xQueueCreate(5, sizeof(uint32_t));
-      configASSERT(reconnect_queue);
-    }
-    if (reconnect_task_handle == nullptr) {
-      xTaskCreate(reconnect_task, "mqtt_reconnect", 4096, nullptr,
-                  tskIDLE_PRIORITY + 2, &reconnect_task_handle);
-    }
-    if (teardown_task_handle == nullptr) {
-      xTaskCreate(teardown_task, "mqtt_teardown", 4096,
-                  static_cast<void *>(_instance), tskIDLE_PRIORITY + 1,
-                  &teardown_task_handle);
-    }
   }
   if (s_health_timer == nullptr) {
-    s_health_timer = xTimerCreate("mqtt_health", HEALTH_CHECK_PERIOD_MS, pdTRUE,
-                                  nullptr, health_timer_cb);
+    s_health_timer = xTimerCreateStatic("mqtt_health", HEALTH_CHECK_PERIOD_MS, pdTRUE,
+                                        nullptr, health_timer_cb, &s_health_timer_buf);
     if (s_health_timer) xTimerStart(s_health_timer, 0);
   }
 }
 
 bool MqttClient::publish(const char *topic, const char *message, int qos, bool retain) {
-    SemaphoreHandle_t mutex = get_mqtt_mutex();
-    xSemaphoreTake(mutex, portMAX_DELAY);
-    esp_mqtt_client_handle_t cl = client;
+    return publishWithId(topic, message, qos, retain) >= 0;
+}
+
+int MqttClient::publishWithId(const char *topic, const char *message, int qos, bool retain) {
+    return publishWithId(topic, message, 0, qos, retain, nullptr);
+}
+
+int MqttClient::publishWithId(const char *topic, const char *data, int len, int qos,
+                              bool retain, const PublishOptions *opts) {
+    // The handle is borrowed, not locked: teardown never waits for the
+    // mutex below, only for this guard. The mutex covers what publishers
+    // share with each other: the compression buffer and the client's
+    // publish-property slot, set and used in one step.
+    ClientRef ref(this);
+    esp_mqtt_client_handle_t cl = ref.get();
     if (!cl) {
-        xSemaphoreGive(mutex);
         ESP_LOGE(TAG, "publish: client is null");
-        return false;
+        return -1;
+    }
+    // A handler on the esp-mqtt task holds esp-mqtt's API lock, which the
+    // mutex holder may be waiting for: it never waits for the mutex. When
+    // it is taken, the holder stays parked until the handler returns; this
+    // publish then leaves the compression buffer alone and restores the
+    // holder's armed property after its own.
+    SemaphoreHandle_t mutex = get_mqtt_mutex();
+    const bool locked =
+        xSemaphoreTake(mutex, on_event_task() ? 0 : portMAX_DELAY) == pdTRUE;
+
+    // Retained: skip a payload the broker already acknowledged on this
+    // session. The last-will topic is exempt: the will may have replaced it.
+    uint32_t topicHash = 0;
+    uint32_t payloadHash = 0;
+    if (retain) {
+        const char *will = mqttConfig.session.last_will.topic;
+        bool exempt = (opts && opts->forceRetained) || (will && strcmp(will, topic) == 0);
+        topicHash = fnv1a(topic, strlen(topic));
+        payloadHash = fnv1a(data, len > 0 ? (size_t)len : strlen(data));
+        taskENTER_CRITICAL(&s_retained_mux);
+        const RetainedEntry *e = retainedEntry(topicHash, false);
+        bool unchanged = !exempt && s_session_present && e && e->acked &&
+                         e->ackedHash == payloadHash && e->pendingMsgId < 0;
+        if (unchanged)
+            ++s_retained_skipped;
+        taskEXIT_CRITICAL(&s_retained_mux);
+        if (unchanged) {
+            if (locked)
+                xSemaphoreGive(mutex);
+            ESP_LOGD(TAG, "%s: retained payload unchanged, not republished", topic);
+            return PUBLISH_SKIPPED;
+        }
     }
 
-    bool ok = false;
 #ifdef CONFIG_MQTT_PROTOCOL_5
-    if (s_publish_property != nullptr) {
-        esp_mqtt5_publish_property_config_t prop_config = {
-            .user_property = s_publish_property,
-        };
+    mqtt5_user_property_handle_t user_property = s_publish_property;
+    const bool restore = !locked && s_prop_armed.load();
+    if (locked && s_publish_property_lzss &&
+        ((opts && opts->compressible) || compressTopic(topic))) {
+        size_t n = len > 0 ? (size_t)len : strlen(data);
+        if (n >= COMPRESS_MIN_LEN && n <= COMPRESS_BUF_LEN) {
+            size_t c = Lzss::compress(reinterpret_cast<const uint8_t *>(data), n,
+                                      s_deflate_buf, sizeof s_deflate_buf);
+            if (c > 0) {
+                ESP_LOGD(TAG, "%s: %u -> %u bytes (lzss)", topic, (unsigned)n, (unsigned)c);
+                data = reinterpret_cast<const char *>(s_deflate_buf);
+                len = (int)c;
+                user_property = s_publish_property_lzss;
+            }
+        }
+    }
+    if (user_property != nullptr || opts != nullptr || restore) {
+        esp_mqtt5_publish_property_config_t prop_config = {};
+        prop_config.user_property = user_property;
+        if (opts) {
+            prop_config.response_topic = opts->responseTopic;
+            prop_config.correlation_data = reinterpret_cast<const char *>(opts->correlation);
+            prop_config.correlation_data_len = opts->correlationLen;
+            prop_config.content_type = opts->contentType;
+        }
+        if (locked) {
+            s_armed_prop = prop_config;
+            s_prop_armed.store(true);
+        }
         esp_err_t err = esp_mqtt5_client_set_publish_property(cl, &prop_config);
         if (err != ESP_OK) {
             ESP_LOGW(TAG, "Failed to set publish property: %s", esp_err_to_name(err));
         }
     }
 #endif
-    int msg_id = esp_mqtt_client_publish(cl, topic, message, 0, qos, retain ? 1 : 0);
+    int msg_id;
+    if (qos > 0) {
+        // QoS1/2 messages go to the esp-mqtt outbox, which allocates:
+        // attributed here, not counted against the hot path that publishes.
+        AllocScope allocScope("mqtt.publish", AllocScope::EXEMPT);
+        msg_id = esp_mqtt_client_publish(cl, topic, data, len, qos, retain ? 1 : 0);
+    } else {
+        msg_id = esp_mqtt_client_publish(cl, topic, data, len, qos, retain ? 1 : 0);
+    }
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (locked)
+        s_prop_armed.store(false);
+    else if (restore)
+        esp_mqtt5_client_set_publish_property(cl, &s_armed_prop);
+#endif
+    if (retain) {
+        // QoS0 has no acknowledgement: a successful send is the best there is.
+        // A PUBACK handled before this runs is missed: the payload then only
+        // goes out once more.
+        taskENTER_CRITICAL(&s_retained_mux);
+        RetainedEntry *e = retainedEntry(topicHash, true);
+        e->acked = msg_id >= 0 && qos == 0;
+        e->ackedHash = payloadHash;
+        e->pendingHash = payloadHash;
+        e->pendingMsgId = (msg_id > 0 && qos > 0) ? msg_id : -1;
+        taskEXIT_CRITICAL(&s_retained_mux);
+    }
+    if (locked)
+        xSemaphoreGive(mutex);
     if (msg_id >= 0) {
-        s_publish_fail_count = 0;
-        ok = true;
+        s_publish_fail_count.store(0);
     } else {
-        s_publish_fail_count++;
+        s_publish_fail_count.fetch_add(1);
     }
-    xSemaphoreGive(mutex);
-    return ok;
+    return msg_id;
 }
 
 // ── Sample derived class ───────────────────────────────────────────────
@@ -626,7 +1454,7 @@ void SAMPLE_derivedMqttClient::handleEvent(esp_event_base_t base,
   switch (event_id) {
   case MQTT_EVENT_CONNECTED:
     ESP_LOGI(TAG, "SAMPLE: Connected");
-    esp_mqtt_client_subscribe(client, "/test/topic", 0);
+    esp_mqtt_client_subscribe(event->client, "/test/topic", 0);
     break;
   case MQTT_EVENT_DATA:
     ESP_LOGI(TAG, "SAMPLE: DATA topic=%.*s", event->topic_len, event->topic);
@@ -1,9 +1,11 @@
 #pragma once
+#include <atomic>
 #include <esp_event_base.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/timers.h>
 #include <mqtt_client.h>
+#include "ED_MQTT_config.h"
 
 namespace ED_MQTT {
 
@@ -23,7 +25,13 @@ namespace ED_MQTT {
  */
 
 ESP_EVENT_DECLARE_BASE(ED_MQTT_SENSOR_EVENTS);
-enum { ED_MQTT_SENSOR_EVENT_DATA_READY, ED_MQTT_SENSOR_EVENT_ERROR };
+/// Event data is an ED_MQTT::SensorSample (see ED_MQTT_sensors.h). FLUSH
+/// publishes pending batches now: the sample's topic, or all without data.
+enum {
+  ED_MQTT_SENSOR_EVENT_DATA_READY,
+  ED_MQTT_SENSOR_EVENT_ERROR,
+  ED_MQTT_SENSOR_EVENT_FLUSH
+};
 
 extern const char *mqtt_event_names[];
 
@@ -40,21 +48,171 @@ using MqttDataCallback = void (*)(esp_mqtt_client_handle_t client,
                                   const char *data, size_t dataLen,
                                   uint32_t msgID);
 
+/// Fired when the broker acknowledges a QoS1/2 publish (PUBACK/PUBCOMP).
+using MqttPublishedCallback = void (*)(int msgID);
+
+/// Asked with the MQTT5 "target" user property of an incoming message, on
+/// its first fragment. false drops the message before reassembly.
+using MqttTargetFilter = bool (*)(const char *target);
+
 // ── Compile-time limits ──────────────────────────────────────────────────────
-static constexpr uint8_t MAX_CONNECTED_CALLBACKS = 4;
-static constexpr uint8_t MAX_DATA_CALLBACKS = 4;
+// Overridable from the build, see ED_MQTT_config.h.
+static constexpr uint8_t MAX_CONNECTED_CALLBACKS = ED_MQTT_MAX_CONNECTED_CALLBACKS;
+static constexpr uint8_t MAX_DATA_CALLBACKS = ED_MQTT_MAX_DATA_CALLBACKS;
+static constexpr uint8_t MAX_PUBLISHED_CALLBACKS = ED_MQTT_MAX_PUBLISHED_CALLBACKS;
 /// Max reassembled payload (bytes). Larger messages are logged and dropped.
-static constexpr size_t MAX_MQTT_PAYLOAD = 4096;
+static constexpr size_t MAX_MQTT_PAYLOAD = ED_MQTT_MAX_PAYLOAD;
+static constexpr size_t MAX_RESPONSE_TOPIC_LEN = 96;
+/// Longer correlation data is not echoed: the reply could never be matched.
+static constexpr size_t MAX_CORRELATION_LEN = ED_MQTT_MAX_CORRELATION_LEN;
+/// MQTT5 user properties read per incoming message.
+static constexpr uint8_t MAX_USER_PROPS = ED_MQTT_MAX_USER_PROPS;
+static_assert(ED_MQTT_MAX_CORRELATION_LEN >= 64 && ED_MQTT_MAX_CORRELATION_LEN <= 0xFFFF,
+              "ED_MQTT_MAX_CORRELATION_LEN must be 64..65535");
+static_assert(ED_MQTT_MAX_USER_PROPS > 0 && ED_MQTT_MAX_USER_PROPS <= 255,
+              "ED_MQTT_MAX_USER_PROPS must be 1..255");
+static constexpr size_t MAX_TARGET_LEN = 64;
+/// LZSS compression of outbound payloads (MQTT5 only, see ED_MQTT_lzss.h).
+static constexpr size_t COMPRESS_MIN_LEN = ED_MQTT_COMPRESS_MIN;
+static constexpr size_t COMPRESS_BUF_LEN = ED_MQTT_COMPRESS_BUF_LEN;
+static constexpr size_t INFLATE_BUF_LEN = ED_MQTT_INFLATE_BUF_LEN;
+static constexpr uint8_t MAX_COMPRESS_TOPICS = ED_MQTT_MAX_COMPRESS_TOPICS;
+static_assert(ED_MQTT_MAX_COMPRESS_TOPICS > 0 && ED_MQTT_MAX_COMPRESS_TOPICS <= 255,
+              "ED_MQTT_MAX_COMPRESS_TOPICS must be 1..255");
+/// Connect status message: firmware identity + per-connect fields.
+static constexpr size_t BIRTH_MSG_LEN = 512;
+static constexpr size_t BIRTH_DYNAMIC_LEN = 48;   // ,"connects":…,"uptime_s":…}
+/// Topics whose last acknowledged retained payload is remembered.
+static constexpr uint8_t MAX_RETAINED_TOPICS = ED_MQTT_MAX_RETAINED_TOPICS;
+static_assert(ED_MQTT_MAX_RETAINED_TOPICS > 0 && ED_MQTT_MAX_RETAINED_TOPICS <= 255,
+              "ED_MQTT_MAX_RETAINED_TOPICS must be 1..255");
+/// Topic filters declared with MqttClient::addSubscription().
+static constexpr uint8_t MAX_SUBSCRIPTIONS = ED_MQTT_MAX_SUBSCRIPTIONS;
+static constexpr size_t SUB_FILTER_LEN = 64;
+static_assert(ED_MQTT_MAX_SUBSCRIPTIONS > 0 && ED_MQTT_MAX_SUBSCRIPTIONS <= 255,
+              "ED_MQTT_MAX_SUBSCRIPTIONS must be 1..255");
+
+static_assert(ED_MQTT_MAX_CONNECTED_CALLBACKS > 0 && ED_MQTT_MAX_CONNECTED_CALLBACKS <= 255,
+              "ED_MQTT_MAX_CONNECTED_CALLBACKS must be 1..255");
+static_assert(ED_MQTT_MAX_DATA_CALLBACKS > 0 && ED_MQTT_MAX_DATA_CALLBACKS <= 255,
+              "ED_MQTT_MAX_DATA_CALLBACKS must be 1..255");
+static_assert(ED_MQTT_MAX_PUBLISHED_CALLBACKS > 0 && ED_MQTT_MAX_PUBLISHED_CALLBACKS <= 255,
+              "ED_MQTT_MAX_PUBLISHED_CALLBACKS must be 1..255");
+static_assert(MAX_MQTT_PAYLOAD >= 256, "ED_MQTT_MAX_PAYLOAD below 256 bytes");
+
+// ── Static RAM report ────────────────────────────────────────────────────────
+
+/// Text report of the static tables, one row per table:
+///   name  used/capacity  bytes
+/// Rows are appended into a caller buffer; `total` sums the bytes.
+struct MemoryReport {
+  char *buf;
+  size_t len;
+  size_t used = 0;
+  size_t total = 0;
+
+  MemoryReport(char *b, size_t l) : buf(b), len(l) {
+    if (len) buf[0] = '\0';
+  }
+  /// capacity == 0 marks a plain buffer (no used/capacity column).
+  void row(const char *name, unsigned inUse, unsigned capacity, size_t bytes);
+  void finish();
+};
+
+// ── Boot timeline ────────────────────────────────────────────────────────────
+
+/// Milestones of the first connection after boot, in µs since boot (0: not
+/// reached yet). Only the first mark of each stage counts.
+///   CONNECTING  MQTT_EVENT_BEFORE_CONNECT (broker resolved, TCP/TLS begins)
+///   CONNACK     MQTT_EVENT_CONNECTED: TCP, TLS and MQTT handshakes done
+///   SUBSCRIBED  every declared subscription granted
+class BootTimeline {
+public:
+  enum Stage : uint8_t {
+    IP_READY,
+    DNS_DONE,
+    CONNECTING,
+    CONNACK,
+    SUBSCRIBED,
+    FIRST_COMMAND,
+    STAGE_COUNT
+  };
+  /// Returns true when this call recorded the stage.
+  static bool mark(Stage stage);
+  static int64_t at(Stage stage);
+  static const char *name(Stage stage);
+
+private:
+  static int64_t s_at[STAGE_COUNT];
+};
+
+// ── MQTT5 request metadata ───────────────────────────────────────────────────
+
+/// Properties of the message currently being delivered to data callbacks.
+/// Filled without heap allocation; valid ONLY during the data callback.
+struct RequestContext {
+  char responseTopic[MAX_RESPONSE_TOPIC_LEN]; // "" when the request has none
+  uint8_t correlation[MAX_CORRELATION_LEN];
+  uint16_t correlationLen;
+  bool correlationTruncated;   // longer than MAX_CORRELATION_LEN: do not reply with it
+  uint32_t epoch;  // "epoch" user property, 0 if absent
+  bool dup;        // broker redelivery flag
+  uint16_t subscriptionId; // MQTT5 subscription identifier, 0 when absent
+  int qos;
+  bool compressed; // "enc"="lzss" user property (payload already inflated)
+  char target[MAX_TARGET_LEN]; // "target" user property, "" when absent; may be cut,
+                               // the target filter sees the whole value
+};
+
+/// Optional MQTT5 properties for one publish.
+struct PublishOptions {
+  const char *responseTopic = nullptr;
+  const uint8_t *correlation = nullptr;
+  uint16_t correlationLen = 0;
+  const char *contentType = nullptr;
+  /// LZSS-compress payloads of COMPRESS_MIN_LEN..COMPRESS_BUF_LEN bytes when
+  /// that makes them smaller; announced with the "enc"="lzss" user property.
+  /// Off by default: consumers must understand it. Topics enabled with
+  /// MqttClient::setTopicCompression() are compressed without it.
+  bool compressible = false;
+  /// Retained publishes identical to the last acknowledged one on the same
+  /// topic are skipped while the session is intact; this sends anyway.
+  bool forceRetained = false;
+};
 
 // ────────────────────────────────────────────────────────────────────────────
 class MqttClient {
 public:
   // --- Registration & lifecycle ---
+  // Static: register before create(), so nothing the first connection
+  // delivers is missed.
+  // name labels the callback in the hook profiler (ED_MQTT_profile.h);
+  // default "conn.<n>" / "data.<n>" / the filter.
+
   /// Register a callback fired on every successful broker connection.
-  void registerConnectedCallback(MqttConnectedCallback callback);
+  static void registerConnectedCallback(MqttConnectedCallback callback,
+                                        const char *name = nullptr);
 
   /// Register a callback fired on every fully reassembled incoming message.
-  void registerDataCallback(MqttDataCallback callback);
+  static void registerDataCallback(MqttDataCallback callback, const char *name = nullptr);
+
+  /// Register a callback fired only for messages whose topic matches filter
+  /// ('+'/'#' wildcards, see ED_MQTT_router.h). Does not subscribe.
+  static bool registerDataCallback(const char *filter, MqttDataCallback callback,
+                                   const char *name = nullptr);
+
+  /// Register a callback fired when a QoS1/2 publish is acknowledged.
+  static void registerPublishedCallback(MqttPublishedCallback callback);
+
+  /// Filter on the "target" user property of messages whose topic matches
+  /// topicFilter (one filter; nullptr removes it). Messages without the
+  /// property, or on other topics, are always delivered.
+  static void registerTargetFilter(const char *topicFilter, MqttTargetFilter filter);
+
+  /// Compress every publish on topics matching filter (as if
+  /// PublishOptions::compressible were set); enabled = false removes the
+  /// filter. False when the table (MAX_COMPRESS_TOPICS) is full.
+  static bool setTopicCompression(const char *filter, bool enabled);
 
   /// Create the singleton (first call) or return the existing one.
   /// Pass nullptr for config to use the built-in default from secrets.h.
@@ -68,11 +226,60 @@ public:
   bool publish(const char *topic, const char *message, int qos = 1,
                bool retain = false);
 
+  /// publishWithId() result for a retained payload skipped as unchanged
+  /// (see invalidateRetained()). Above any MQTT packet id and >= 0, so
+  /// success checks still hold; no MQTT_EVENT_PUBLISHED follows.
+  static constexpr int PUBLISH_SKIPPED = 0x10000;
+
+  /// Same as publish(), but returns the esp-mqtt msg_id (-1 on error) so the
+  /// caller can match the MQTT_EVENT_PUBLISHED acknowledgement, or
+  /// PUBLISH_SKIPPED.
+  int publishWithId(const char *topic, const char *message, int qos = 1,
+                    bool retain = false);
+
+  /// Publish len bytes (0 = strlen) with optional MQTT5 properties. Returns
+  /// the msg_id, -1 on error, or PUBLISH_SKIPPED.
+  int publishWithId(const char *topic, const char *data, int len, int qos,
+                    bool retain, const PublishOptions *opts);
+
+  /// MQTT5 metadata of the message being delivered (data callbacks only).
+  static const RequestContext &currentRequest() { return s_request; }
+
+  /// Append the client's static tables to a memory report.
+  static void memoryReport(MemoryReport &report);
+
+  /// Forget the acknowledged retained payload of topic (nullptr: all topics),
+  /// so its next retained publish goes out even if unchanged.
+  static void invalidateRetained(const char *topic = nullptr);
+  /// Retained publishes skipped as unchanged since boot.
+  static uint32_t retainedSkipped() { return s_retained_skipped; }
+
+  // --- Subscriptions ---
+  /// Subscription of a declared filter, as last reported by the broker.
+  enum class SubState : uint8_t { UNKNOWN, PENDING, GRANTED, REFUSED };
+
+  /// Declare a topic filter to keep subscribed (again with another QoS:
+  /// updated). All declared filters go out in one SUBSCRIBE on connect, none
+  /// when the session was resumed and all were granted; a filter declared
+  /// while connected is subscribed right away. subscriptionId (MQTT5, 0:
+  /// none) tags every message delivered through this filter (see
+  /// RequestContext); such a filter gets a SUBSCRIBE of its own.
+  static bool addSubscription(const char *filter, int qos = 0,
+                              uint16_t subscriptionId = 0);
+  /// Forget a filter; UNSUBSCRIBE it when connected.
+  static bool removeSubscription(const char *filter);
+  /// grantedQos (optional) is set when the state is GRANTED.
+  static SubState subscriptionState(const char *filter, int *grantedQos = nullptr);
+  /// Filters the broker refused since the last SUBSCRIBE of each.
+  static uint8_t subscriptionFailures();
+
   /// Optional callback type to be notified when the library forces a reconnect.
   using ReconnectCallback = void (*)(void);
   static void registerReconnectCallback(ReconnectCallback cb);
 
   static MqttClient *getInstance() { return _instance; }
+  /// Current handle, not borrowed: may be destroyed by a teardown at any
+  /// time. Inside the client, use a ClientRef.
   esp_mqtt_client_handle_t getHandle();
   virtual ~MqttClient();
   static void setInstance(MqttClient *instance);
@@ -85,7 +292,26 @@ public:
 protected:
   static esp_mqtt_client_config_t mqttConfig;
   esp_err_t start(esp_mqtt_client_config_t config);
-  esp_mqtt_client_handle_t client = nullptr;
+  // Published without a lock: readers borrow it through a ClientRef, only
+  // start() and destroyClient() replace it.
+  std::atomic<esp_mqtt_client_handle_t> client{nullptr};
+
+  /// Borrows the client handle for a scope, lock-free. destroyClient() takes
+  /// the handle away first and then waits for the borrowers still in flight,
+  /// so a handle got here stays valid until the guard goes.
+  class ClientRef {
+  public:
+    explicit ClientRef(MqttClient *owner);
+    ~ClientRef();
+    ClientRef(const ClientRef &) = delete;
+    ClientRef &operator=(const ClientRef &) = delete;
+    esp_mqtt_client_handle_t get() const { return handle; }
+    explicit operator bool() const { return handle != nullptr; }
+
+  private:
+    esp_mqtt_client_handle_t handle = nullptr;
+    bool counted = false;
+  };
   virtual void handleEvent(esp_event_base_t base, int32_t event_id,
                            void *event_data);
 
@@ -94,49 +320,115 @@ private:
   static MqttClient *_instance;
   static char statusTopicBuf[64];
 
+  // Birth (connect status) message: immutable prefix built once in create()
+  static char s_birth_buf[BIRTH_MSG_LEN];
+  static size_t s_birth_prefix_len;
+  static uint32_t s_connect_count;
+  static void buildBirthMessage();
+  static size_t birthMessage();
+
+  // Retained-publish dedup (guarded by a critical section, see
+  // s_retained_mux in ED_mqtt.cpp). Topics and payloads are kept as FNV-1a
+  // hashes only.
+  struct RetainedEntry {
+    uint32_t topicHash;
+    uint32_t ackedHash;     // payload the broker acknowledged
+    uint32_t pendingHash;   // payload of the QoS1/2 publish in flight
+    int pendingMsgId;       // -1: none
+    bool used;
+    bool acked;
+  };
+  static RetainedEntry s_retained[MAX_RETAINED_TOPICS];
+  static uint8_t s_retained_next;   // round-robin victim when full
+  static bool s_session_present;
+  static uint32_t s_retained_skipped;
+  static RetainedEntry *retainedEntry(uint32_t topicHash, bool create);
+
+  // Subscription table (guarded by s_subs_mutex, see ED_mqtt.cpp). Slots
+  // never move, so the entries sharing a SUBSCRIBE msg id are in SUBACK
+  // reason-code order.
+  struct Subscription {
+    char filter[SUB_FILTER_LEN];
+    uint8_t qos;
+    uint8_t grantedQos;
+    SubState state;
+    int msgId;   // SUBSCRIBE in flight, -1: none
+    uint16_t subId;   // MQTT5 subscription identifier, 0: none
+    bool used;
+  };
+  static Subscription s_subs[MAX_SUBSCRIPTIONS];
+  static Subscription s_connect_subs[MAX_SUBSCRIPTIONS];   // esp-mqtt task only
+  static bool s_connected;
+  static Subscription *findSubscription(const char *filter);
+  static void subscribeAll(esp_mqtt_client_handle_t client);
+  static void sendSubscribe(const char *filter, uint8_t qos, uint16_t subId);
+  static int subscribeOne(esp_mqtt_client_handle_t client, const char *filter,
+                          uint8_t qos, uint16_t subId);
+  static int subscribeMany(esp_mqtt_client_handle_t client,
+                           const esp_mqtt_topic_t *topics, int n);
+  static void applySuback(Subscription &s, int code);
+  static void handleSuback(const esp_mqtt_event_t *event);
+
   // Callback tables
   static MqttConnectedCallback connected_callbacks[MAX_CONNECTED_CALLBACKS];
   static uint8_t connected_callback_count;
   static MqttDataCallback data_callbacks[MAX_DATA_CALLBACKS];
   static uint8_t data_callback_count;
+  // Hook profiler slots, same index as the callback (route id for routes).
+  static int8_t connected_hooks[MAX_CONNECTED_CALLBACKS];
+  static int8_t data_hooks[MAX_DATA_CALLBACKS];
+  static int8_t route_hooks[ED_MQTT_MAX_DATA_ROUTES];
+  static MqttPublishedCallback published_callbacks[MAX_PUBLISHED_CALLBACKS];
+  static uint8_t published_callback_count;
 
   // Payload reassembly buffer
   static char s_payload_buf[MAX_MQTT_PAYLOAD];
+  static uint8_t s_deflate_buf[COMPRESS_BUF_LEN]; // guarded by the client mutex
+#if ED_MQTT_INFLATE_BUF_LEN > 0
+  static uint8_t s_inflate_buf[INFLATE_BUF_LEN];
+#endif
   static size_t s_payload_len;
   static size_t s_payload_expected;
+  static bool s_payload_skip;   // rest of a message refused by the target filter
+  static MqttTargetFilter s_target_filter;
+  static char s_target_topic[SUB_FILTER_LEN];   // topics the target filter applies to
+  // Filters compressed by default, "" = free (guarded by s_compress_mux)
+  static char s_compress_topics[MAX_COMPRESS_TOPICS][SUB_FILTER_LEN];
+  static bool compressTopic(const char *topic);
+  static RequestContext s_request;
 
   // Disconnect tracking
   static int disconnect_count;
   static int64_t last_disconnect_time;
 
-  // Reconnection machinery
-  static void reconnect_task(void *arg);
-  static TaskHandle_t reconnect_task_handle;
-  static QueueHandle_t reconnect_queue;
-  static TimerHandle_t mqtt_reconnect_timer; // not static in original, but made
-                                             // static for clarity
+  // Background jobs: posted to the Supervisor task, never run inline. The
+  // timers are static and their callbacks only post.
+  static void teardown_job(uint32_t arg);
+  static void reconnect_job(uint32_t arg);
+  static void health_job(uint32_t arg);
+  static TimerHandle_t mqtt_reconnect_timer;
   static void mqtt_reconnect_timer_cb(TimerHandle_t xTimer);
 
-  // Teardown task
-  static void teardown_task(void *arg);
-  static TaskHandle_t teardown_task_handle;
-
   // Health monitoring
   static void health_timer_cb(TimerHandle_t xTimer);
   static TimerHandle_t s_health_timer;
-  static uint8_t s_publish_fail_count;
+  static std::atomic<uint8_t> s_publish_fail_count;   // no lock: read by the health job
+  static std::atomic<uint32_t> s_client_users;        // ClientRefs in flight
   static constexpr uint8_t MAX_CONSECUTIVE_FAILURES = 3;
   static constexpr TickType_t HEALTH_CHECK_PERIOD_MS = pdMS_TO_TICKS(30000);
   static ReconnectCallback s_reconnect_callback;
 
 #ifdef CONFIG_MQTT_PROTOCOL_5
   static mqtt5_user_property_handle_t s_publish_property;
+  static mqtt5_user_property_handle_t s_publish_property_lzss; // + "enc"="lzss"
+  static void deleteUserProperties();
 #endif
 
   // Internal helpers
-  static uint32_t mqtt5_get_epoch_property(const esp_mqtt_event_t *event);
+  static void mqtt5_parse_request(const esp_mqtt_event_t *event);
   static void setDefaultConfig();
   void destroyClient();
+  static void waitForClientUsers();
   bool isShortOutage();
   static void scheduleReconnect(uint32_t delay_ms);
 
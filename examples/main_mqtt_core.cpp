@@ -226,7 +226,10 @@ extern "C" void app_main() {
     mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_5;
 
     ED_MQTT_dispatcher::MQTTdispatcher::initialize(&mqtt_cfg);
-    ED_MQTT_dispatcher::MQTTdispatcher::registerJsonFieldProvider(wifiDiagProvider);
+    // AP lookup is slow and rarely changes: refresh once a minute.
+    ED_MQTT_dispatcher::MQTTdispatcher::registerJsonFieldProvider(
+        wifiDiagProvider, 60000,
+        ED_MQTT_dispatcher::MQTTdispatcher::ProviderCost::EXPENSIVE, "wifi");
     ED_MQTT_dispatcher::MQTTdispatcher::run();
 
     static ED_OTA::OTAmanager otaManager;